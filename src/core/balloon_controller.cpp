@@ -0,0 +1,131 @@
+#include "balloon_controller.h"
+#include "../utils/system_checker.h"
+#include <QDebug>
+#include <QPointer>
+#include <QJsonValue>
+
+namespace {
+
+const qint64 MB = 1024 * 1024;
+
+QString balloonPath() {
+    return QString("/machine/peripheral/") + VMInstance::BALLOON_ID;
+}
+
+} // namespace
+
+BalloonController::BalloonController(QemuManager *manager, QObject *parent)
+    : QObject(parent),
+      m_manager(manager),
+      m_timer(new QTimer(this)) {
+
+    m_timer->setInterval(POLL_INTERVAL_MS);
+    connect(m_timer, &QTimer::timeout, this, &BalloonController::poll);
+
+    // A restarted instance has a fresh, deflated balloon
+    connect(m_manager, &QemuManager::instanceStarted, this, &BalloonController::forget);
+    connect(m_manager, &QemuManager::instanceStopped, this, &BalloonController::forget);
+}
+
+void BalloonController::start() {
+    m_timer->start();
+}
+
+void BalloonController::stop() {
+    m_timer->stop();
+}
+
+qint64 BalloonController::targetMB(const QString& name) const {
+    VMInstance *vm = m_manager->instance(name);
+    qint64 ramMB = vm ? vm->config().ramMB() : 0;
+    return m_targets.value(name, ramMB);
+}
+
+void BalloonController::forget(const QString& name) {
+    m_statsEnabled.remove(name);
+    m_targets.remove(name);
+}
+
+void BalloonController::poll() {
+    qint64 hostAvailableMB = SystemChecker::getAvailableRAM();
+
+    for (VMInstance *vm : m_manager->instances()) {
+        if (vm->state() != VMInstance::Running || !vm->config().memoryBalloon() ||
+            !vm->qmp()->isReady()) {
+            continue;
+        }
+
+        // Statistics arrive one interval after polling is switched on
+        if (!m_statsEnabled.contains(vm->name())) {
+            enableGuestStats(vm);
+            continue;
+        }
+
+        QPointer<VMInstance> guard(vm);
+        QJsonObject arguments;
+        arguments["path"] = balloonPath();
+        arguments["property"] = "guest-stats";
+        vm->qmp()->execute("qom-get", arguments,
+                           [this, guard, hostAvailableMB](bool ok, const QJsonValue& result, const QString&) {
+            if (ok && guard) {
+                adjust(guard, result.toObject(), hostAvailableMB);
+            }
+        });
+    }
+}
+
+void BalloonController::enableGuestStats(VMInstance *vm) {
+    QJsonObject arguments;
+    arguments["path"] = balloonPath();
+    arguments["property"] = "guest-stats-polling-interval";
+    arguments["value"] = GUEST_STATS_INTERVAL_S;
+
+    QString name = vm->name();
+    m_statsEnabled.insert(name);
+    vm->qmp()->execute("qom-set", arguments, [this, name](bool ok, const QJsonValue&, const QString& error) {
+        if (!ok) {
+            qWarning() << name << ": Cannot enable balloon statistics:" << error;
+            m_statsEnabled.remove(name);
+        }
+    });
+}
+
+void BalloonController::adjust(VMInstance *vm, const QJsonObject& guestStats, qint64 hostAvailableMB) {
+    // No report from the guest driver yet
+    if (guestStats["last-update"].toInteger() == 0) {
+        return;
+    }
+
+    QString name = vm->name();
+    qint64 ramMB = vm->config().ramMB();
+    qint64 current = m_targets.value(name, ramMB);
+    qint64 target = current;
+
+    if (hostAvailableMB < LOW_WATERMARK_MB) {
+        // Only take what the guest itself reports as available
+        qint64 guestAvailable = guestStats["stats"].toObject()["stat-available-memory"].toInteger(-1);
+        if (guestAvailable < 0) {
+            return;
+        }
+        qint64 spare = guestAvailable / MB - GUEST_HEADROOM_MB;
+        if (spare <= 0) {
+            return;
+        }
+        target = qMax(current - qMin(spare, STEP_MB), ramMB * MIN_GUEST_PERCENT / 100);
+    } else if (hostAvailableMB > HIGH_WATERMARK_MB) {
+        target = qMin(current + STEP_MB, ramMB);
+    }
+
+    if (target == current) {
+        return;
+    }
+
+    QJsonObject arguments;
+    arguments["value"] = target * MB;
+    vm->qmp()->execute("balloon", arguments);
+
+    m_targets.insert(name, target);
+    qDebug() << name << ": Balloon target" << target << "MB of" << ramMB
+             << "(host available:" << hostAvailableMB << "MB)";
+    emit balloonResized(name, target);
+}
@@ -0,0 +1,61 @@
+#ifndef BALLOON_CONTROLLER_H
+#define BALLOON_CONTROLLER_H
+
+#include <QObject>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+#include <QJsonObject>
+#include "qemu_manager.h"
+
+// Moves memory between running instances and the host. Free-page
+// reporting already returns pages a guest frees; on top of that, while
+// the host's available memory is low, the controller inflates the
+// balloons of guests that report spare memory, a step at a time, and
+// deflates them again once the host has room. A guest can always get its
+// memory back by itself (deflate-on-oom).
+class BalloonController : public QObject {
+    Q_OBJECT
+
+public:
+    explicit BalloonController(QemuManager *manager, QObject *parent = nullptr);
+
+    void start();
+    void stop();
+    bool isRunning() const { return m_timer->isActive(); }
+
+    // Current balloon target of an instance, its full RAM if untouched
+    qint64 targetMB(const QString& name) const;
+
+    // Host available memory below which balloons inflate, and above which
+    // they deflate again
+    static constexpr qint64 LOW_WATERMARK_MB = 2048;
+    static constexpr qint64 HIGH_WATERMARK_MB = 4096;
+    // Available memory a guest keeps when its balloon inflates
+    static constexpr qint64 GUEST_HEADROOM_MB = 512;
+    // A balloon never takes more than half of a guest's RAM
+    static const int MIN_GUEST_PERCENT = 50;
+    // Largest resize per instance and poll
+    static constexpr qint64 STEP_MB = 256;
+    static const int POLL_INTERVAL_MS = 5000;
+    // How often guests refresh their balloon statistics
+    static const int GUEST_STATS_INTERVAL_S = 5;
+
+signals:
+    void balloonResized(const QString& name, qint64 targetMB);
+
+private slots:
+    void poll();
+
+private:
+    void enableGuestStats(VMInstance *vm);
+    void adjust(VMInstance *vm, const QJsonObject& guestStats, qint64 hostAvailableMB);
+    void forget(const QString& name);
+
+    QemuManager *m_manager;
+    QTimer *m_timer;
+    QSet<QString> m_statsEnabled;   // Instances polling balloon statistics
+    QMap<QString, qint64> m_targets; // Instance name -> balloon target MB
+};
+
+#endif // BALLOON_CONTROLLER_H
@@ -0,0 +1,279 @@
+#include "bandwidth_shaper.h"
+#include <QFile>
+#include <QStringList>
+#include <QDebug>
+#include <algorithm>
+
+namespace {
+
+// Bucket depth in seconds of the current rate
+const double BURST_SECONDS = 0.25;
+// Smallest read worth waking a segment for
+const qint64 MIN_GRANT = 16 * 1024;
+
+} // namespace
+
+bool BandwidthShaper::Rule::contains(const QTime& time) const {
+    if (start <= end) {
+        return time >= start && time < end;
+    }
+    return time >= start || time < end;
+}
+
+BandwidthShaper::BandwidthShaper(QObject *parent)
+    : QObject(parent),
+      m_rateLimit(0),
+      m_currentRate(0),
+      m_tokens(0.0),
+      m_lastRefill(0),
+      m_idleOnly(false),
+      m_backedOff(false),
+      m_quietSeconds(0),
+      m_lastInterfaceBytes(-1),
+      m_ownBytes(0),
+      m_overhead(DEFAULT_OVERHEAD) {
+
+    m_clock.start();
+
+    m_refillTimer = new QTimer(this);
+    m_refillTimer->setSingleShot(true);
+    connect(m_refillTimer, &QTimer::timeout, this, &BandwidthShaper::tokensAvailable);
+
+    m_monitorTimer = new QTimer(this);
+    m_monitorTimer->setInterval(1000);
+    connect(m_monitorTimer, &QTimer::timeout, this, &BandwidthShaper::onMonitorTick);
+}
+
+void BandwidthShaper::setRateLimit(qint64 bytesPerSecond) {
+    m_rateLimit = qMax<qint64>(0, bytesPerSecond);
+    updateRate();
+}
+
+void BandwidthShaper::setSchedule(const QVector<Rule>& rules) {
+    m_rules = rules;
+    updateRate();
+}
+
+void BandwidthShaper::setIdleOnly(bool enabled, const QString& interface) {
+    m_idleOnly = enabled;
+    m_interface = interface;
+    m_backedOff = false;
+    m_quietSeconds = 0;
+    m_ownBytes = 0;
+    m_overheadSamples.clear();
+    m_overhead = DEFAULT_OVERHEAD;
+    m_lastInterfaceBytes = enabled ? readInterfaceBytes() : -1;
+
+    if (enabled && m_lastInterfaceBytes < 0) {
+        qWarning() << "Cannot read traffic counters for"
+                   << (interface.isEmpty() ? QString("any interface") : interface);
+    }
+    updateRate();
+}
+
+qint64 BandwidthShaper::allowance(qint64 wanted) {
+    if (m_currentRate <= 0) {
+        return wanted;
+    }
+
+    refill();
+    qint64 needed = qMin(wanted, MIN_GRANT);
+    qint64 granted = qMin(wanted, static_cast<qint64>(m_tokens));
+    if (granted >= needed) {
+        return granted;
+    }
+
+    // Wake the readers once a useful amount has trickled in
+    if (!m_refillTimer->isActive()) {
+        double missing = needed - m_tokens;
+        int delay = qBound(5, static_cast<int>(missing * 1000 / m_currentRate) + 1, 250);
+        m_refillTimer->start(delay);
+    }
+    return 0;
+}
+
+void BandwidthShaper::consume(qint64 bytes) {
+    m_ownBytes += bytes;
+    if (m_currentRate > 0) {
+        m_tokens -= bytes;
+    }
+}
+
+void BandwidthShaper::refill() {
+    qint64 now = m_clock.nsecsElapsed();
+    if (m_currentRate > 0) {
+        double burst = qMax<double>(MIN_GRANT, m_currentRate * BURST_SECONDS);
+        m_tokens = qMin(burst, m_tokens + (now - m_lastRefill) / 1e9 * m_currentRate);
+    }
+    m_lastRefill = now;
+}
+
+void BandwidthShaper::updateRate() {
+    qint64 rate = m_rateLimit;
+    QTime now = QTime::currentTime();
+    for (const Rule& rule : m_rules) {
+        if (rule.contains(now)) {
+            rate = rule.bytesPerSecond;
+            break;
+        }
+    }
+
+    if (m_backedOff) {
+        rate = rate > 0 ? qMin(rate, IDLE_TRICKLE_RATE) : IDLE_TRICKLE_RATE;
+    }
+
+    // Schedules and idle detection need a clock; a fixed limit doesn't
+    bool monitor = m_idleOnly || !m_rules.isEmpty();
+    if (monitor && !m_monitorTimer->isActive()) {
+        m_monitorTimer->start();
+    } else if (!monitor) {
+        m_monitorTimer->stop();
+    }
+
+    if (rate == m_currentRate) {
+        return;
+    }
+
+    // Settle the bucket at the old rate before switching
+    refill();
+    m_currentRate = rate;
+    if (rate > 0) {
+        m_tokens = qMin<double>(m_tokens, qMax<double>(MIN_GRANT, rate * BURST_SECONDS));
+    }
+
+    qDebug() << "Download rate limit:"
+             << (rate > 0 ? QString("%1 KB/s").arg(rate / 1024) : QString("unlimited"));
+    emit rateChanged(rate);
+
+    // Readers held back at the old rate re-check their allowance
+    emit tokensAvailable();
+}
+
+void BandwidthShaper::onMonitorTick() {
+    if (m_idleOnly) {
+        qint64 total = readInterfaceBytes();
+        if (total >= 0 && m_lastInterfaceBytes >= 0) {
+            qint64 delta = total - m_lastInterfaceBytes;
+            if (!m_backedOff && m_ownBytes >= OVERHEAD_SAMPLE_MIN) {
+                addOverheadSample(double(delta - m_ownBytes) / m_ownBytes);
+            }
+
+            qint64 expected = m_ownBytes + static_cast<qint64>(m_ownBytes * (m_overhead + OVERHEAD_MARGIN));
+            qint64 foreign = delta - expected;
+
+            if (foreign > IDLE_THRESHOLD) {
+                if (!m_backedOff) {
+                    qDebug() << "Other traffic detected (" << foreign / 1024 << "KB/s), backing off";
+                }
+                m_backedOff = true;
+                m_quietSeconds = 0;
+            } else if (m_backedOff && ++m_quietSeconds >= IDLE_QUIET_SECONDS) {
+                qDebug() << "Link idle again, resuming full speed";
+                m_backedOff = false;
+            }
+        }
+        m_lastInterfaceBytes = total;
+    }
+
+    m_ownBytes = 0;
+    updateRate();
+}
+
+void BandwidthShaper::addOverheadSample(double ratio) {
+    m_overheadSamples.append(qBound(0.0, ratio, MAX_OVERHEAD));
+    if (m_overheadSamples.size() > OVERHEAD_WINDOW) {
+        m_overheadSamples.removeFirst();
+    }
+
+    // Other traffic only ever adds to a sample, so the smallest recent
+    // one is the closest to our own overhead
+    m_overhead = *std::min_element(m_overheadSamples.constBegin(), m_overheadSamples.constEnd());
+}
+
+qint64 BandwidthShaper::readInterfaceBytes() const {
+    QFile file("/proc/net/dev");
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return -1;
+    }
+
+    // "  eth0: <rx bytes> <7 more rx fields> <tx bytes> ..."
+    qint64 total = 0;
+    bool found = false;
+    const QList<QByteArray> lines = file.readAll().split('\n');
+    for (const QByteArray& line : lines) {
+        int colon = line.indexOf(':');
+        if (colon < 0) {
+            continue;
+        }
+
+        QByteArray name = line.left(colon).trimmed();
+        if (m_interface.isEmpty() ? name == "lo" : name != m_interface.toLatin1()) {
+            continue;
+        }
+
+        QList<QByteArray> fields = line.mid(colon + 1).simplified().split(' ');
+        if (fields.size() < 9) {
+            continue;
+        }
+        total += fields[0].toLongLong() + fields[8].toLongLong();
+        found = true;
+    }
+
+    return found ? total : -1;
+}
+
+qint64 BandwidthShaper::parseRate(const QString& text, bool *ok) {
+    QString value = text.trimmed().toUpper();
+    if (value.endsWith("/S")) {
+        value.chop(2);
+    }
+    if (value.endsWith('B')) {
+        value.chop(1);
+    }
+
+    double multiplier = 1.0;
+    if (value.endsWith('K')) {
+        multiplier = 1024.0;
+    } else if (value.endsWith('M')) {
+        multiplier = 1024.0 * 1024.0;
+    } else if (value.endsWith('G')) {
+        multiplier = 1024.0 * 1024.0 * 1024.0;
+    }
+    if (multiplier > 1.0) {
+        value.chop(1);
+    }
+
+    bool valid = false;
+    double number = value.toDouble(&valid);
+    valid = valid && number >= 0;
+
+    if (ok) {
+        *ok = valid;
+    }
+    return valid ? static_cast<qint64>(number * multiplier) : 0;
+}
+
+bool BandwidthShaper::parseRule(const QString& text, Rule& rule) {
+    QStringList parts = text.split('=');
+    if (parts.size() != 2) {
+        return false;
+    }
+
+    QStringList times = parts[0].split('-');
+    if (times.size() != 2) {
+        return false;
+    }
+
+    Rule parsed;
+    parsed.start = QTime::fromString(times[0].trimmed(), "H:mm");
+    parsed.end = QTime::fromString(times[1].trimmed(), "H:mm");
+
+    bool ok = false;
+    parsed.bytesPerSecond = parseRate(parts[1], &ok);
+    if (!ok || !parsed.start.isValid() || !parsed.end.isValid()) {
+        return false;
+    }
+
+    rule = parsed;
+    return true;
+}
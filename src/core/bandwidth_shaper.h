@@ -0,0 +1,103 @@
+#ifndef BANDWIDTH_SHAPER_H
+#define BANDWIDTH_SHAPER_H
+
+#include <QObject>
+#include <QString>
+#include <QTime>
+#include <QTimer>
+#include <QVector>
+#include <QElapsedTimer>
+
+// Token bucket shared by all segments of a DownloadManager. Callers ask
+// for an allowance before reading from a socket and report what they
+// actually consumed; when the bucket is empty they stop reading, the
+// reply's read buffer fills and TCP flow control slows the server down.
+// The rate can follow a time-of-day schedule, and in idle-only mode it
+// drops to a trickle whenever /proc/net/dev shows traffic that isn't ours.
+class BandwidthShaper : public QObject {
+    Q_OBJECT
+
+public:
+    // Rate applied between start and end (local time); end before start
+    // wraps past midnight
+    struct Rule {
+        QTime start;
+        QTime end;
+        qint64 bytesPerSecond = 0;  // 0 = unlimited
+
+        bool contains(const QTime& time) const;
+    };
+
+    explicit BandwidthShaper(QObject *parent = nullptr);
+
+    // Outside all schedule rules; 0 = unlimited
+    void setRateLimit(qint64 bytesPerSecond);
+    qint64 rateLimit() const { return m_rateLimit; }
+
+    void setSchedule(const QVector<Rule>& rules);
+    QVector<Rule> schedule() const { return m_rules; }
+
+    // Empty interface watches every interface except loopback
+    void setIdleOnly(bool enabled, const QString& interface = QString());
+    bool idleOnly() const { return m_idleOnly; }
+
+    // Rate in force right now, after schedule and idle back-off
+    qint64 currentRate() const { return m_currentRate; }
+    bool isLimited() const { return m_currentRate > 0; }
+    bool isBackedOff() const { return m_backedOff; }
+
+    // Bytes the caller may read now, at most wanted. Returns 0 and arms
+    // tokensAvailable() when the bucket is empty.
+    qint64 allowance(qint64 wanted);
+    void consume(qint64 bytes);
+
+    // "512K", "2M", "1.5G" (binary units) or plain bytes per second
+    static qint64 parseRate(const QString& text, bool *ok = nullptr);
+    // "09:00-18:00=512K"
+    static bool parseRule(const QString& text, Rule& rule);
+
+    static const int IDLE_QUIET_SECONDS = 5;  // Quiet needed before full speed again
+    static constexpr qint64 IDLE_TRICKLE_RATE = 32 * 1024;  // While others use the link
+    static constexpr qint64 IDLE_THRESHOLD = 32 * 1024;  // Foreign traffic, bytes/s
+    // Link overhead on top of our payload (headers, ACKs, retransmits),
+    // as a share of it; measured while no other traffic is detected
+    static constexpr double DEFAULT_OVERHEAD = 0.05;
+    static constexpr double MAX_OVERHEAD = 0.25;
+    static constexpr double OVERHEAD_MARGIN = 0.02;  // Slack on the measured share
+    static constexpr qint64 OVERHEAD_SAMPLE_MIN = 256 * 1024;  // Own bytes/s for a sample
+    static const int OVERHEAD_WINDOW = 30;  // Samples, one per second
+
+signals:
+    void tokensAvailable();
+    void rateChanged(qint64 bytesPerSecond);
+
+private slots:
+    void onMonitorTick();
+
+private:
+    void refill();
+    void updateRate();
+    qint64 readInterfaceBytes() const;
+    void addOverheadSample(double ratio);
+
+    qint64 m_rateLimit;
+    QVector<Rule> m_rules;
+    qint64 m_currentRate;
+
+    double m_tokens;
+    QElapsedTimer m_clock;
+    qint64 m_lastRefill;
+    QTimer *m_refillTimer;
+    QTimer *m_monitorTimer;
+
+    bool m_idleOnly;
+    QString m_interface;
+    bool m_backedOff;
+    int m_quietSeconds;
+    qint64 m_lastInterfaceBytes;
+    qint64 m_ownBytes;      // Consumed since the last monitor tick
+    QVector<double> m_overheadSamples;  // Most recent last
+    double m_overhead;
+};
+
+#endif // BANDWIDTH_SHAPER_H
@@ -0,0 +1,95 @@
+#include "boot_watcher.h"
+#include <QDebug>
+#include <QStandardPaths>
+
+BootWatcher::BootWatcher(QObject *parent)
+    : QObject(parent),
+      m_process(new QProcess(this)),
+      m_pollTimer(new QTimer(this)),
+      m_settleTimer(new QTimer(this)),
+      m_adbPort(0),
+      m_timeoutMs(DEFAULT_TIMEOUT_MS),
+      m_active(false),
+      m_connected(false) {
+
+    m_pollTimer->setSingleShot(true);
+    connect(m_pollTimer, &QTimer::timeout, this, &BootWatcher::poll);
+
+    m_settleTimer->setSingleShot(true);
+    connect(m_settleTimer, &QTimer::timeout, this, [this]() {
+        m_active = false;
+        qDebug() << "Android on" << serial() << "booted in" << m_elapsed.elapsed() << "ms";
+        emit bootCompleted(m_elapsed.elapsed());
+    });
+
+    connect(m_process, &QProcess::finished, this, &BootWatcher::onProcessFinished);
+}
+
+BootWatcher::~BootWatcher() {
+    stop();
+}
+
+bool BootWatcher::isAdbAvailable() {
+    return !QStandardPaths::findExecutable("adb").isEmpty();
+}
+
+void BootWatcher::start(int adbPort, int timeoutMs) {
+    stop();
+
+    m_adbPort = adbPort;
+    m_timeoutMs = timeoutMs;
+    m_active = true;
+    m_connected = false;
+    m_elapsed.start();
+    m_pollTimer->start(POLL_INTERVAL_MS);
+}
+
+void BootWatcher::stop() {
+    m_active = false;
+    m_pollTimer->stop();
+    m_settleTimer->stop();
+    if (m_process->state() != QProcess::NotRunning) {
+        m_process->kill();
+        m_process->waitForFinished(1000);
+    }
+}
+
+void BootWatcher::poll() {
+    if (m_elapsed.elapsed() > m_timeoutMs) {
+        m_active = false;
+        qWarning() << "Android on" << serial() << "did not finish booting";
+        emit timedOut();
+        return;
+    }
+
+    // adbd in the guest only becomes reachable once Android is far enough
+    // along, so the connect is repeated until it sticks
+    if (!m_connected) {
+        m_process->start("adb", QStringList() << "connect" << serial());
+    } else {
+        m_process->start("adb", QStringList() << "-s" << serial()
+                                              << "shell" << "getprop" << "sys.boot_completed");
+    }
+}
+
+void BootWatcher::onProcessFinished(int exitCode, QProcess::ExitStatus exitStatus) {
+    if (!m_active) {
+        return;
+    }
+
+    QString output = QString::fromUtf8(m_process->readAllStandardOutput()).trimmed();
+    bool ok = (exitStatus == QProcess::NormalExit && exitCode == 0);
+
+    if (!m_connected) {
+        // "adb connect" exits 0 even when it fails, so check what it said
+        m_connected = ok && output.contains("connected to");
+    } else if (ok && output == "1") {
+        m_settleTimer->start(SETTLE_MS);
+        return;
+    } else if (!ok) {
+        // Device went offline, e.g. adbd restarting during boot
+        m_connected = false;
+    }
+
+    m_pollTimer->start(POLL_INTERVAL_MS);
+}
@@ -0,0 +1,50 @@
+#ifndef BOOT_WATCHER_H
+#define BOOT_WATCHER_H
+
+#include <QObject>
+#include <QProcess>
+#include <QTimer>
+#include <QElapsedTimer>
+
+// Polls a guest over adb until Android reports sys.boot_completed, then
+// waits a little longer for the launcher to settle before reporting it.
+class BootWatcher : public QObject {
+    Q_OBJECT
+
+public:
+    explicit BootWatcher(QObject *parent = nullptr);
+    ~BootWatcher();
+
+    void start(int adbPort, int timeoutMs = DEFAULT_TIMEOUT_MS);
+    void stop();
+    bool isWatching() const { return m_active; }
+
+    static bool isAdbAvailable();
+
+    static const int DEFAULT_TIMEOUT_MS = 5 * 60 * 1000;
+    static const int POLL_INTERVAL_MS = 2000;
+    // Between boot_completed and a drawn, idle home screen
+    static const int SETTLE_MS = 10000;
+
+signals:
+    void bootCompleted(qint64 elapsedMs);
+    void timedOut();
+
+private slots:
+    void poll();
+    void onProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
+
+private:
+    QString serial() const { return QString("127.0.0.1:%1").arg(m_adbPort); }
+
+    QProcess *m_process;
+    QTimer *m_pollTimer;
+    QTimer *m_settleTimer;
+    QElapsedTimer m_elapsed;
+    int m_adbPort;
+    int m_timeoutMs;
+    bool m_active;
+    bool m_connected;
+};
+
+#endif // BOOT_WATCHER_H
@@ -0,0 +1,117 @@
+#include "control_client.h"
+#include <QJsonArray>
+#include <QDebug>
+
+ControlClient::ControlClient(QObject *parent)
+    : QObject(parent), m_socket(new QLocalSocket(this)), m_nextId(1) {
+    connect(m_socket, &QLocalSocket::readyRead, this, &ControlClient::onReadyRead);
+    connect(m_socket, &QLocalSocket::disconnected, this, &ControlClient::disconnected);
+}
+
+ControlClient::~ControlClient() {
+    m_socket->abort();
+}
+
+bool ControlClient::connectToDaemon(const QString& path, int timeoutMs) {
+    m_socket->connectToServer(path);
+    if (!m_socket->waitForConnected(timeoutMs)) {
+        qDebug() << "Daemon not reachable at" << path << ":" << m_socket->errorString();
+        m_socket->abort();
+        return false;
+    }
+    return true;
+}
+
+void ControlClient::disconnectFromDaemon() {
+    // Requests sent just before a disconnect must still reach the daemon
+    m_socket->flush();
+    m_socket->disconnectFromServer();
+}
+
+bool ControlClient::isConnected() const {
+    return m_socket->state() == QLocalSocket::ConnectedState;
+}
+
+int ControlClient::enqueue(const QString& url, const QString& destination,
+                           const QString& sha256, int priority, const QStringList& mirrors) {
+    QJsonObject request;
+    request["url"] = url;
+    request["destination"] = destination;
+    if (!sha256.isEmpty()) {
+        request["sha256"] = sha256;
+    }
+    request["priority"] = priority;
+    if (!mirrors.isEmpty()) {
+        request["mirrors"] = QJsonArray::fromStringList(mirrors);
+    }
+    return send("enqueue", request);
+}
+
+int ControlClient::pause(int jobId) {
+    return sendJobCommand("pause", jobId);
+}
+
+int ControlClient::resume(int jobId) {
+    return sendJobCommand("resume", jobId);
+}
+
+int ControlClient::cancel(int jobId) {
+    return sendJobCommand("cancel", jobId);
+}
+
+int ControlClient::setPriority(int jobId, int priority) {
+    QJsonObject request;
+    request["job"] = jobId;
+    request["priority"] = priority;
+    return send("priority", request);
+}
+
+int ControlClient::list() {
+    return send("list");
+}
+
+int ControlClient::subscribe(int jobId) {
+    return sendJobCommand("subscribe", jobId);
+}
+
+int ControlClient::unsubscribe(int jobId) {
+    return sendJobCommand("unsubscribe", jobId);
+}
+
+int ControlClient::send(const QString& command, QJsonObject request) {
+    if (!isConnected()) {
+        return -1;
+    }
+
+    int id = m_nextId++;
+    request["id"] = id;
+    request["command"] = command;
+    m_socket->write(ControlProtocol::encode(request));
+    return id;
+}
+
+int ControlClient::sendJobCommand(const QString& command, int jobId) {
+    QJsonObject request;
+    if (jobId >= 0) {
+        request["job"] = jobId;
+    }
+    return send(command, request);
+}
+
+void ControlClient::onReadyRead() {
+    while (m_socket->canReadLine()) {
+        QJsonObject message;
+        if (!ControlProtocol::decode(m_socket->readLine().trimmed(), message)) {
+            qWarning() << "Malformed message from daemon";
+            continue;
+        }
+
+        if (message.contains("reply")) {
+            emit replyReceived(message["reply"].toInt(), message["ok"].toBool(), message);
+        } else if (message["event"] == "progress") {
+            emit jobProgress(message["job"].toInt(), message);
+        } else if (message["event"] == "state") {
+            emit jobStateChanged(message["job"].toObject());
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef CONTROL_CLIENT_H
+#define CONTROL_CLIENT_H
+
+#include <QObject>
+#include <QLocalSocket>
+#include <QJsonObject>
+#include <QStringList>
+#include "control_protocol.h"
+
+// Client side of the linuxdroid-daemon control socket. Requests return an
+// id that is matched by replyReceived(); events for subscribed jobs arrive
+// as jobProgress() and jobStateChanged().
+class ControlClient : public QObject {
+    Q_OBJECT
+
+public:
+    explicit ControlClient(QObject *parent = nullptr);
+    ~ControlClient();
+
+    // Blocks for at most timeoutMs; false if no daemon is listening
+    bool connectToDaemon(const QString& path = ControlProtocol::SOCKET_PATH, int timeoutMs = 1000);
+    void disconnectFromDaemon();
+    bool isConnected() const;
+    QString errorString() const { return m_socket->errorString(); }
+
+    int enqueue(const QString& url, const QString& destination,
+                const QString& sha256 = QString(), int priority = 0,
+                const QStringList& mirrors = QStringList());
+    int pause(int jobId);
+    int resume(int jobId);
+    int cancel(int jobId);
+    int setPriority(int jobId, int priority);
+    int list();
+    // jobId -1 subscribes to every job, including ones added later
+    int subscribe(int jobId = -1);
+    int unsubscribe(int jobId = -1);
+
+signals:
+    void replyReceived(int requestId, bool ok, const QJsonObject& reply);
+    void jobProgress(int jobId, const QJsonObject& progress);
+    void jobStateChanged(const QJsonObject& job);
+    void disconnected();
+
+private slots:
+    void onReadyRead();
+
+private:
+    int send(const QString& command, QJsonObject request = QJsonObject());
+    int sendJobCommand(const QString& command, int jobId);
+
+    QLocalSocket *m_socket;
+    int m_nextId;
+};
+
+#endif // CONTROL_CLIENT_H
@@ -0,0 +1,39 @@
+#ifndef CONTROL_PROTOCOL_H
+#define CONTROL_PROTOCOL_H
+
+#include <QByteArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+// linuxdroid-daemon control socket: one compact JSON object per line in
+// both directions.
+//
+//   request:  {"id": 1, "command": "enqueue", "url": ..., "destination": ...}
+//   reply:    {"reply": 1, "ok": true, "job": {...}}
+//   event:    {"event": "progress", "job": 3, "bytesReceived": ..., ...}
+//             {"event": "state", "job": {...}}
+//
+// Commands: enqueue, pause, resume, cancel, priority, list, subscribe,
+// unsubscribe. Progress events are coalesced to a few per second.
+namespace ControlProtocol {
+
+const char SOCKET_PATH[] = "/run/linuxdroid/daemon.sock";
+const qint64 MAX_LINE = 64 * 1024;
+
+inline QByteArray encode(const QJsonObject& message) {
+    return QJsonDocument(message).toJson(QJsonDocument::Compact) + '\n';
+}
+
+inline bool decode(const QByteArray& line, QJsonObject& message) {
+    QJsonParseError error;
+    QJsonDocument document = QJsonDocument::fromJson(line, &error);
+    if (error.error != QJsonParseError::NoError || !document.isObject()) {
+        return false;
+    }
+    message = document.object();
+    return true;
+}
+
+} // namespace ControlProtocol
+
+#endif // CONTROL_PROTOCOL_H
@@ -0,0 +1,384 @@
+#include "control_server.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QRegularExpression>
+#include <QUrl>
+#include <QDebug>
+#include <QVector>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *const ControlServer::ACCESS_GROUP = "linuxdroid";
+
+ControlServer::ControlServer(DownloadQueue *queue, QObject *parent)
+    : QObject(parent),
+      m_server(new QLocalServer(this)),
+      m_queue(queue),
+      m_downloadDir("/opt/linuxdroid/images") {
+
+    m_flushTimer = new QTimer(this);
+    m_flushTimer->setSingleShot(true);
+    connect(m_flushTimer, &QTimer::timeout, this, &ControlServer::flushProgress);
+
+    connect(m_server, &QLocalServer::newConnection, this, &ControlServer::onNewConnection);
+
+    connect(m_queue, &DownloadQueue::jobProgress, this, &ControlServer::onJobProgress);
+    connect(m_queue, &DownloadQueue::jobStatsUpdated, this, &ControlServer::onJobStats);
+    connect(m_queue, &DownloadQueue::jobStateChanged, this, &ControlServer::onJobStateChanged);
+}
+
+ControlServer::~ControlServer() {
+    m_server->close();
+}
+
+bool ControlServer::listen(const QString& path) {
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    // A socket file left behind by a crashed daemon would block listen()
+    QLocalServer::removeServer(path);
+
+    m_server->setSocketOptions(QLocalServer::UserAccessOption | QLocalServer::GroupAccessOption);
+
+    if (!m_server->listen(path)) {
+        qWarning() << "Cannot listen on" << path << ":" << m_server->errorString();
+        return false;
+    }
+
+    // The socket belongs to the access group, so its members (the wizard,
+    // CLI users) can connect without the socket being world-writable
+    QByteArray nativePath = QFile::encodeName(m_server->fullServerName());
+    gid_t group = accessGroupId();
+    if (group != static_cast<gid_t>(-1) && ::chown(nativePath.constData(), static_cast<uid_t>(-1), group) != 0) {
+        qWarning() << "Cannot hand the control socket to group" << ACCESS_GROUP;
+    }
+    ::chmod(nativePath.constData(), 0660);
+
+    qDebug() << "Control socket listening on" << path;
+    return true;
+}
+
+void ControlServer::setDownloadDirectory(const QString& path) {
+    m_downloadDir = QDir::cleanPath(path);
+}
+
+void ControlServer::onNewConnection() {
+    while (QLocalSocket *socket = m_server->nextPendingConnection()) {
+        if (!isAuthorized(socket)) {
+            socket->abort();
+            socket->deleteLater();
+            continue;
+        }
+        m_clients.insert(socket, Client());
+        connect(socket, &QLocalSocket::readyRead, this, &ControlServer::onReadyRead);
+        connect(socket, &QLocalSocket::disconnected, this, &ControlServer::onDisconnected);
+    }
+}
+
+bool ControlServer::isTrustedDirectory(const QString& path) {
+    struct stat info;
+    if (::stat(QFile::encodeName(path).constData(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+        return false;
+    }
+    if (info.st_uid != ::geteuid()) {
+        return false;
+    }
+
+    // As root, a directory others can write to lets them plant links the
+    // service would follow; as the service user, the kernel already stops
+    // it from writing anywhere that user can't
+    return ::geteuid() != 0 || (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+gid_t ControlServer::accessGroupId() {
+    struct group *entry = ::getgrnam(ACCESS_GROUP);
+    return entry ? entry->gr_gid : static_cast<gid_t>(-1);
+}
+
+bool ControlServer::isAuthorized(QLocalSocket *socket) {
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (::getsockopt(socket->socketDescriptor(), SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0) {
+        qWarning() << "Cannot read control client credentials, rejecting";
+        return false;
+    }
+
+    if (peer.uid == 0 || peer.uid == ::geteuid()) {
+        return true;
+    }
+
+    gid_t group = accessGroupId();
+    if (group != static_cast<gid_t>(-1)) {
+        if (peer.gid == group) {
+            return true;
+        }
+
+        // Supplementary groups come from the group database, as the peer's
+        // process may not have picked up a recent membership yet
+        struct passwd *user = ::getpwuid(peer.uid);
+        if (user) {
+            int count = 32;
+            QVector<gid_t> groups(count);
+            if (::getgrouplist(user->pw_name, user->pw_gid, groups.data(), &count) < 0) {
+                groups.resize(count);
+                ::getgrouplist(user->pw_name, user->pw_gid, groups.data(), &count);
+            }
+            groups.resize(qMax(0, count));
+            if (groups.contains(group)) {
+                return true;
+            }
+        }
+    }
+
+    qWarning() << "Rejecting control client uid" << peer.uid << "pid" << peer.pid
+               << "(not in group" << ACCESS_GROUP << ")";
+    return false;
+}
+
+void ControlServer::onReadyRead() {
+    QLocalSocket *socket = qobject_cast<QLocalSocket*>(sender());
+    if (!socket || !m_clients.contains(socket)) {
+        return;
+    }
+
+    while (socket->canReadLine()) {
+        QByteArray line = socket->readLine(ControlProtocol::MAX_LINE).trimmed();
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        QJsonObject request;
+        QJsonObject reply;
+        if (ControlProtocol::decode(line, request)) {
+            reply = handleRequest(socket, request);
+        } else {
+            reply["ok"] = false;
+            reply["error"] = "Malformed request";
+        }
+
+        if (request.contains("id")) {
+            reply["reply"] = request["id"];
+        }
+        send(socket, reply);
+    }
+
+    // A client that never sends a newline doesn't get to grow our buffer
+    if (socket->bytesAvailable() > ControlProtocol::MAX_LINE) {
+        qWarning() << "Dropping control client: request too long";
+        socket->abort();
+    }
+}
+
+void ControlServer::onDisconnected() {
+    QLocalSocket *socket = qobject_cast<QLocalSocket*>(sender());
+    m_clients.remove(socket);
+    if (socket) {
+        socket->deleteLater();
+    }
+}
+
+QJsonObject ControlServer::handleRequest(QLocalSocket *socket, const QJsonObject& request) {
+    QString command = request["command"].toString();
+    int id = request["job"].toInt(-1);
+
+    QJsonObject reply;
+    reply["ok"] = true;
+
+    if (command == "enqueue") {
+        return enqueue(request);
+    } else if (command == "list") {
+        QJsonArray jobs;
+        for (const DownloadQueue::Job& job : m_queue->jobs()) {
+            jobs.append(job.toJson());
+        }
+        reply["jobs"] = jobs;
+        return reply;
+    } else if (command == "subscribe" || command == "unsubscribe") {
+        Client& client = m_clients[socket];
+        bool subscribe = (command == "subscribe");
+
+        if (id < 0) {
+            client.allJobs = subscribe;
+            if (!subscribe) {
+                client.jobs.clear();
+            }
+            return reply;
+        }
+        if (!m_queue->contains(id)) {
+            reply["ok"] = false;
+            reply["error"] = QString("No such job: %1").arg(id);
+            return reply;
+        }
+
+        if (subscribe) {
+            client.jobs.insert(id);
+            // The current state, so watchers don't wait for the next change
+            reply["job"] = m_queue->job(id).toJson();
+        } else {
+            client.jobs.remove(id);
+        }
+        return reply;
+    }
+
+    bool ok = false;
+    if (command == "pause") {
+        ok = m_queue->pause(id);
+    } else if (command == "resume") {
+        ok = m_queue->resume(id);
+    } else if (command == "cancel") {
+        ok = m_queue->cancel(id);
+    } else if (command == "priority") {
+        ok = m_queue->setPriority(id, request["priority"].toInt());
+    } else {
+        reply["ok"] = false;
+        reply["error"] = "Unknown command: " + command;
+        return reply;
+    }
+
+    reply["ok"] = ok;
+    if (ok) {
+        reply["job"] = m_queue->job(id).toJson();
+    } else {
+        reply["error"] = m_queue->contains(id)
+            ? QString("Cannot %1 job %2 while it is %3")
+                  .arg(command).arg(id).arg(DownloadQueue::stateName(m_queue->job(id).state))
+            : QString("No such job: %1").arg(id);
+    }
+    return reply;
+}
+
+QJsonObject ControlServer::enqueue(const QJsonObject& request) {
+    QJsonObject reply;
+    reply["ok"] = false;
+
+    QUrl url(request["url"].toString());
+    if (!url.isValid() || (url.scheme() != "http" && url.scheme() != "https")) {
+        reply["error"] = "Only http and https URLs can be downloaded";
+        return reply;
+    }
+
+    // Clients may be any member of the access group, so destinations are
+    // plain files directly in the download directory. The directory is
+    // resolved, so a symlink in it can't lead the daemon elsewhere.
+    QString directory = QFileInfo(m_downloadDir).canonicalFilePath();
+    if (directory.isEmpty() || !isTrustedDirectory(directory)) {
+        reply["error"] = "Download directory " + m_downloadDir + " is not owned by the service";
+        return reply;
+    }
+
+    QString destination = request["destination"].toString();
+    if (QDir::isRelativePath(destination)) {
+        destination = m_downloadDir + "/" + destination;
+    }
+    QFileInfo destinationInfo(QDir::cleanPath(destination));
+    if (destinationInfo.fileName().isEmpty() ||
+        QFileInfo(destinationInfo.absolutePath()).canonicalFilePath() != directory) {
+        reply["error"] = "Destination must be a file in " + m_downloadDir;
+        return reply;
+    }
+    destination = directory + "/" + destinationInfo.fileName();
+
+    // Nothing already on disk is replaced (a finished download is moved over
+    // its destination). A dangling symlink doesn't "exist" but still counts.
+    QFileInfo existing(destination);
+    if (existing.exists() || existing.isSymLink()) {
+        reply["error"] = destination + " already exists";
+        return reply;
+    }
+
+    // The catalog doesn't list checksums for every image; without one the
+    // job is only unverified, as the destination is new either way
+    QString sha256 = request["sha256"].toString().toLower();
+    static const QRegularExpression hexDigest("^[0-9a-f]{64}$");
+    if (!sha256.isEmpty() && !hexDigest.match(sha256).hasMatch()) {
+        reply["error"] = "Malformed sha256 checksum";
+        return reply;
+    }
+
+    QStringList mirrors;
+    for (const QJsonValue& value : request["mirrors"].toArray()) {
+        mirrors << value.toString();
+    }
+
+    int id = m_queue->enqueue(url.toString(), destination, sha256,
+                              request["priority"].toInt(), mirrors);
+    if (id < 0) {
+        reply["error"] = "A download to " + destination + " is already queued";
+        return reply;
+    }
+
+    reply["ok"] = true;
+    reply["job"] = m_queue->job(id).toJson();
+    return reply;
+}
+
+void ControlServer::send(QLocalSocket *socket, const QJsonObject& message) {
+    socket->write(ControlProtocol::encode(message));
+}
+
+void ControlServer::publish(int jobId, const QJsonObject& event, bool droppable) {
+    QByteArray data = ControlProtocol::encode(event);
+
+    for (auto it = m_clients.begin(); it != m_clients.end(); ++it) {
+        if (!it.value().allJobs && !it.value().jobs.contains(jobId)) {
+            continue;
+        }
+        // A client that stopped reading misses progress, not state changes
+        if (droppable && it.key()->bytesToWrite() > MAX_PENDING_OUTPUT) {
+            continue;
+        }
+        it.key()->write(data);
+    }
+}
+
+void ControlServer::markProgress(int id) {
+    if (!m_flushTimer->isActive()) {
+        m_flushTimer->start(FLUSH_INTERVAL_MS);
+    }
+
+    QJsonObject& event = m_pendingProgress[id];
+    event["event"] = "progress";
+    event["job"] = id;
+}
+
+void ControlServer::onJobProgress(int id, qint64 bytesReceived, qint64 totalBytes) {
+    markProgress(id);
+    QJsonObject& event = m_pendingProgress[id];
+    event["bytesReceived"] = bytesReceived;
+    event["totalBytes"] = totalBytes;
+}
+
+void ControlServer::onJobStats(int id, const DownloadManager::TransferStats& stats) {
+    markProgress(id);
+    QJsonObject& event = m_pendingProgress[id];
+    event["bytesReceived"] = stats.bytesReceived;
+    event["totalBytes"] = stats.totalBytes;
+    event["bytesPerSecond"] = stats.bytesPerSecond;
+    event["secondsRemaining"] = stats.secondsRemaining;
+    event["connections"] = stats.connections.size();
+}
+
+void ControlServer::onJobStateChanged(int id, DownloadQueue::State state) {
+    Q_UNUSED(state);
+
+    // Progress that was still pending goes out before the state change
+    if (m_pendingProgress.contains(id)) {
+        publish(id, m_pendingProgress.take(id), true);
+    }
+
+    QJsonObject event;
+    event["event"] = "state";
+    event["job"] = m_queue->job(id).toJson();
+    publish(id, event, false);
+}
+
+void ControlServer::flushProgress() {
+    for (auto it = m_pendingProgress.constBegin(); it != m_pendingProgress.constEnd(); ++it) {
+        publish(it.key(), it.value(), true);
+    }
+    m_pendingProgress.clear();
+}
@@ -0,0 +1,75 @@
+#ifndef CONTROL_SERVER_H
+#define CONTROL_SERVER_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QJsonObject>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+#include <sys/types.h>
+#include "download_queue.h"
+#include "control_protocol.h"
+
+// Serves the daemon's DownloadQueue over a Unix-domain socket. Any number
+// of clients (the setup wizard, CLI invocations) can drive the queue and
+// watch the same transfers; progress is pushed, never polled. Only root,
+// the daemon's own user and members of the linuxdroid group may connect.
+class ControlServer : public QObject {
+    Q_OBJECT
+
+public:
+    explicit ControlServer(DownloadQueue *queue, QObject *parent = nullptr);
+    ~ControlServer();
+
+    bool listen(const QString& path = ControlProtocol::SOCKET_PATH);
+    QString errorString() const { return m_server->errorString(); }
+
+    // Jobs enqueued over the socket must download into this directory
+    void setDownloadDirectory(const QString& path);
+    QString downloadDirectory() const { return m_downloadDir; }
+
+    // Group whose members may drive the queue
+    static const char *const ACCESS_GROUP;
+
+    static const int FLUSH_INTERVAL_MS = 250;
+    static constexpr qint64 MAX_PENDING_OUTPUT = 1024 * 1024;  // Per client
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+    void onJobProgress(int id, qint64 bytesReceived, qint64 totalBytes);
+    void onJobStats(int id, const DownloadManager::TransferStats& stats);
+    void onJobStateChanged(int id, DownloadQueue::State state);
+    void flushProgress();
+
+private:
+    struct Client {
+        bool allJobs = false;
+        QSet<int> jobs;
+    };
+
+    // Checks the peer's credentials (SO_PEERCRED) against the access group
+    static bool isAuthorized(QLocalSocket *socket);
+    static gid_t accessGroupId();
+    // Owned by the service's user, and not writable by others when that
+    // user is root
+    static bool isTrustedDirectory(const QString& path);
+
+    QJsonObject handleRequest(QLocalSocket *socket, const QJsonObject& request);
+    QJsonObject enqueue(const QJsonObject& request);
+    void send(QLocalSocket *socket, const QJsonObject& message);
+    void publish(int jobId, const QJsonObject& event, bool droppable);
+    void markProgress(int id);
+
+    QLocalServer *m_server;
+    DownloadQueue *m_queue;
+    QMap<QLocalSocket*, Client> m_clients;
+    QMap<int, QJsonObject> m_pendingProgress;  // Latest per job, not yet sent
+    QTimer *m_flushTimer;
+    QString m_downloadDir;
+};
+
+#endif // CONTROL_SERVER_H
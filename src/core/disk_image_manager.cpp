@@ -0,0 +1,298 @@
+#include "disk_image_manager.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <QStandardPaths>
+
+namespace {
+
+const int QEMU_IMG_TIMEOUT_MS = 10000;
+
+} // namespace
+
+DiskImageManager::DiskImageManager(QObject *parent)
+    : QObject(parent),
+      m_process(new QProcess(this)),
+      m_extractProcess(new QProcess(this)) {
+    connect(m_process, &QProcess::finished, this, &DiskImageManager::onProcessFinished);
+    connect(m_extractProcess, &QProcess::finished, this, &DiskImageManager::onExtractFinished);
+}
+
+DiskImageManager::~DiskImageManager() {
+    if (isBusy()) {
+        m_process->kill();
+        m_process->waitForFinished();
+        QFile::remove(m_partial);
+    }
+    if (isExtracting()) {
+        m_extractProcess->kill();
+        m_extractProcess->waitForFinished();
+        QDir(bootFilesPath(m_extractSource) + ".part").removeRecursively();
+    }
+}
+
+void DiskImageManager::ensureBaseImage(const QString& sourceImage) {
+    QString base = baseImagePath(sourceImage);
+
+    if (isBusy()) {
+        QTimer::singleShot(0, this, [this, sourceImage]() {
+            emit error(sourceImage, "Another base image is being prepared");
+        });
+        return;
+    }
+
+    if (QFile::exists(base)) {
+        QTimer::singleShot(0, this, [this, sourceImage, base]() {
+            emit baseReady(sourceImage, base);
+        });
+        return;
+    }
+
+    if (!QFile::exists(sourceImage)) {
+        QTimer::singleShot(0, this, [this, sourceImage]() {
+            emit error(sourceImage, "Android image not found: " + sourceImage);
+        });
+        return;
+    }
+
+    // An empty base would leave every overlay holding a full install; the
+    // base comes from the first installed instance instead
+    if (isInstallerImage(sourceImage)) {
+        QTimer::singleShot(0, this, [this, sourceImage]() {
+            emit error(sourceImage, "No instance of this ISO has been installed yet");
+        });
+        return;
+    }
+
+    m_source = sourceImage;
+    m_base = base;
+    m_partial = base + ".part";
+    QFile::remove(m_partial);
+
+    // One full copy per image, never per instance
+    QStringList args;
+    args << "convert" << "-O" << "qcow2" << sourceImage << m_partial;
+
+    qDebug() << "Preparing base image:" << "qemu-img" << args;
+    m_process->start("qemu-img", args);
+}
+
+void DiskImageManager::promoteToBase(const QString& isoImage, const QString& diskPath) {
+    QString base = baseImagePath(isoImage);
+    if (isBusy() || QFile::exists(base)) {
+        QTimer::singleShot(0, this, [this, isoImage]() {
+            emit error(isoImage, "A base image is already being prepared or exists");
+        });
+        return;
+    }
+
+    m_source = isoImage;
+    m_base = base;
+    m_partial = base + ".part";
+    QFile::remove(m_partial);
+
+    // A standalone copy: the instance's own disk is replaced by an overlay
+    // on it afterwards
+    QStringList args;
+    args << "convert" << "-O" << "qcow2" << diskPath << m_partial;
+
+    qDebug() << "Promoting" << diskPath << "to base image:" << "qemu-img" << args;
+    m_process->start("qemu-img", args);
+}
+
+void DiskImageManager::onProcessFinished(int exitCode, QProcess::ExitStatus exitStatus) {
+    if (exitStatus != QProcess::NormalExit || exitCode != 0) {
+        QString message = QString::fromUtf8(m_process->readAllStandardError()).trimmed();
+        if (message.isEmpty()) {
+            message = "qemu-img failed with exit code " + QString::number(exitCode);
+        }
+        QFile::remove(m_partial);
+        qWarning() << "Base image failed:" << message;
+        emit error(m_source, message);
+        return;
+    }
+
+    finishBase();
+}
+
+void DiskImageManager::finishBase() {
+    // Overlays depend on the base never changing underneath them
+    QFile::setPermissions(m_partial, QFileDevice::ReadOwner | QFileDevice::ReadGroup |
+                                     QFileDevice::ReadOther);
+
+    if (!QFile::rename(m_partial, m_base)) {
+        QFile::remove(m_partial);
+        emit error(m_source, "Cannot create base image " + m_base);
+        return;
+    }
+
+    qDebug() << "Base image ready:" << m_base;
+    emit baseReady(m_source, m_base);
+}
+
+void DiskImageManager::ensureBootFiles(const QString& isoImage) {
+    QString bootPath = bootFilesPath(isoImage);
+
+    if (hasBootFiles(isoImage)) {
+        QTimer::singleShot(0, this, [this, isoImage, bootPath]() {
+            emit bootFilesReady(isoImage, bootPath);
+        });
+        return;
+    }
+
+    QString failure;
+    if (isExtracting()) {
+        failure = "Boot files are already being extracted";
+    } else if (!isInstallerImage(isoImage) || !QFile::exists(isoImage)) {
+        failure = "Not an Android ISO: " + isoImage;
+    } else if (QStandardPaths::findExecutable("bsdtar").isEmpty()) {
+        failure = "bsdtar not found. Please install libarchive-tools";
+    }
+    if (!failure.isEmpty()) {
+        QTimer::singleShot(0, this, [this, isoImage, failure]() {
+            emit bootFilesError(isoImage, failure);
+        });
+        return;
+    }
+
+    // Extracted into a .part directory that is renamed when complete
+    QString partial = bootPath + ".part";
+    QDir(partial).removeRecursively();
+    QDir().mkpath(partial);
+
+    m_extractSource = isoImage;
+    QStringList args;
+    args << "-x" << "-f" << isoImage << "-C" << partial << KERNEL_FILE << INITRD_FILE;
+
+    qDebug() << "Extracting boot files:" << "bsdtar" << args;
+    m_extractProcess->start("bsdtar", args);
+}
+
+void DiskImageManager::onExtractFinished(int exitCode, QProcess::ExitStatus exitStatus) {
+    QString bootPath = bootFilesPath(m_extractSource);
+    QString partial = bootPath + ".part";
+
+    QString message;
+    if (exitStatus != QProcess::NormalExit || exitCode != 0) {
+        message = QString::fromUtf8(m_extractProcess->readAllStandardError()).trimmed();
+        if (message.isEmpty()) {
+            message = "bsdtar failed with exit code " + QString::number(exitCode);
+        }
+    } else if (!QFile::exists(partial + "/" + KERNEL_FILE) || !QFile::exists(partial + "/" + INITRD_FILE)) {
+        message = "The image has no kernel and initrd.img";
+    } else {
+        QDir(bootPath).removeRecursively();
+        if (!QDir().rename(partial, bootPath)) {
+            message = "Cannot create " + bootPath;
+        }
+    }
+
+    if (!message.isEmpty()) {
+        QDir(partial).removeRecursively();
+        qWarning() << "Boot file extraction failed:" << message;
+        emit bootFilesError(m_extractSource, message);
+        return;
+    }
+
+    qDebug() << "Boot files ready:" << bootPath;
+    emit bootFilesReady(m_extractSource, bootPath);
+}
+
+bool DiskImageManager::createOverlay(const QString& basePath, const QString& overlayPath,
+                                     QString *error) {
+    QDir().mkpath(QFileInfo(overlayPath).absolutePath());
+
+    QProcess process;
+    process.start("qemu-img", QStringList()
+                      << "create" << "-f" << "qcow2"
+                      << "-b" << QFileInfo(basePath).absoluteFilePath()
+                      << "-F" << "qcow2"
+                      << overlayPath);
+
+    if (!process.waitForFinished(QEMU_IMG_TIMEOUT_MS) ||
+        process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        QString message = QString::fromUtf8(process.readAllStandardError()).trimmed();
+        if (message.isEmpty()) {
+            message = "qemu-img create failed: " + process.errorString();
+        }
+        qWarning() << "Cannot create overlay" << overlayPath << ":" << message;
+        if (error) {
+            *error = message;
+        }
+        return false;
+    }
+
+    qDebug() << "Created overlay" << overlayPath << "backed by" << basePath;
+    return true;
+}
+
+bool DiskImageManager::holdsInstall(const QString& diskPath) {
+    QJsonObject info = imageInfo(diskPath);
+    return info["full-backing-filename"].toString().isEmpty() &&
+           info["actual-size"].toInteger() >= MIN_INSTALL_MB * 1024 * 1024;
+}
+
+bool DiskImageManager::createInstallDisk(const QString& diskPath, QString *error) {
+    QDir().mkpath(QFileInfo(diskPath).absolutePath());
+
+    QProcess process;
+    process.start("qemu-img", QStringList()
+                      << "create" << "-f" << "qcow2" << diskPath
+                      << QString("%1G").arg(DEFAULT_DISK_SIZE_GB));
+
+    if (!process.waitForFinished(QEMU_IMG_TIMEOUT_MS) ||
+        process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        QString message = QString::fromUtf8(process.readAllStandardError()).trimmed();
+        if (message.isEmpty()) {
+            message = "qemu-img create failed: " + process.errorString();
+        }
+        qWarning() << "Cannot create disk" << diskPath << ":" << message;
+        if (error) {
+            *error = message;
+        }
+        return false;
+    }
+
+    qDebug() << "Created install disk" << diskPath;
+    return true;
+}
+
+QJsonObject DiskImageManager::imageInfo(const QString& imagePath) {
+    QProcess process;
+    process.start("qemu-img", QStringList() << "info" << "--output=json" << "-U" << imagePath);
+    if (!process.waitForFinished(QEMU_IMG_TIMEOUT_MS) || process.exitCode() != 0) {
+        return QJsonObject();
+    }
+    return QJsonDocument::fromJson(process.readAllStandardOutput()).object();
+}
+
+QString DiskImageManager::backingFile(const QString& imagePath) {
+    return imageInfo(imagePath)["full-backing-filename"].toString();
+}
+
+QString DiskImageManager::imageFormat(const QString& imagePath) {
+    return imageInfo(imagePath)["format"].toString();
+}
+
+QString DiskImageManager::baseImagePath(const QString& sourceImage) {
+    QFileInfo info(sourceImage);
+    return info.absoluteDir().filePath(info.completeBaseName() + ".base.qcow2");
+}
+
+bool DiskImageManager::isInstallerImage(const QString& sourceImage) {
+    return sourceImage.endsWith(".iso", Qt::CaseInsensitive);
+}
+
+QString DiskImageManager::bootFilesPath(const QString& sourceImage) {
+    QFileInfo info(sourceImage);
+    return info.absoluteDir().filePath(info.completeBaseName() + ".boot");
+}
+
+bool DiskImageManager::hasBootFiles(const QString& sourceImage) {
+    QDir dir(bootFilesPath(sourceImage));
+    return dir.exists(KERNEL_FILE) && dir.exists(INITRD_FILE);
+}
@@ -0,0 +1,91 @@
+#ifndef DISK_IMAGE_MANAGER_H
+#define DISK_IMAGE_MANAGER_H
+
+#include <QObject>
+#include <QProcess>
+#include <QString>
+#include <QJsonObject>
+
+// Shared base images and per-instance copy-on-write overlays. Every
+// Android disk image is turned into one read-only qcow2 base next to it;
+// an instance's disk is a thin qcow2 overlay that records only what the
+// instance changes, so creating one takes milliseconds and a few hundred KB.
+// An installer ISO has nothing to convert: the first instance installs
+// onto its own standalone disk, which then becomes the ISO's base.
+class DiskImageManager : public QObject {
+    Q_OBJECT
+
+public:
+    explicit DiskImageManager(QObject *parent = nullptr);
+    ~DiskImageManager();
+
+    // Makes sure the base image for sourceImage exists. Disk images (raw,
+    // vmdk, qcow2, ...) are converted once; an installer ISO only has one
+    // after promoteToBase(), and is an error before. Emits baseReady() or
+    // error(), also when the base already exists.
+    void ensureBaseImage(const QString& sourceImage);
+    // Copies an instance disk holding a finished install of the ISO into
+    // the ISO's read-only base. Emits baseReady() or error().
+    void promoteToBase(const QString& isoImage, const QString& diskPath);
+    bool isBusy() const { return m_process->state() != QProcess::NotRunning; }
+
+    // Extracts the kernel and initrd of an Android-x86 ISO once, into
+    // bootFilesPath(), so instances can boot it without BIOS and
+    // bootloader. Runs alongside base image work. Emits bootFilesReady()
+    // or bootFilesError(), also when the files already exist.
+    void ensureBootFiles(const QString& isoImage);
+    bool isExtracting() const { return m_extractProcess->state() != QProcess::NotRunning; }
+
+    // Creates a qcow2 overlay backed by basePath; fast, so synchronous
+    static bool createOverlay(const QString& basePath, const QString& overlayPath,
+                              QString *error = nullptr);
+    // Empty standalone qcow2 of DEFAULT_DISK_SIZE_GB for an instance of an
+    // installer ISO to install onto; sparse, so synchronous
+    static bool createInstallDisk(const QString& diskPath, QString *error = nullptr);
+    // Whether a standalone disk has an Android install on it, judged by
+    // how much of it has been written
+    static bool holdsInstall(const QString& diskPath);
+    // Image the overlay is backed by, or empty for a standalone image
+    static QString backingFile(const QString& imagePath);
+    // qemu-img's name for the format, e.g. "qcow2" or "raw"
+    static QString imageFormat(const QString& imagePath);
+
+    // <images>/<name>.base.qcow2 for <images>/<name>.iso
+    static QString baseImagePath(const QString& sourceImage);
+    static bool isInstallerImage(const QString& sourceImage);
+    // <images>/<name>.boot for <images>/<name>.iso
+    static QString bootFilesPath(const QString& sourceImage);
+    static bool hasBootFiles(const QString& sourceImage);
+
+    static constexpr const char *KERNEL_FILE = "kernel";
+    static constexpr const char *INITRD_FILE = "initrd.img";
+
+    static const int DEFAULT_DISK_SIZE_GB = 16;
+    // Android-x86 writes well over this while installing; a live session
+    // doesn't touch the disk
+    static constexpr qint64 MIN_INSTALL_MB = 512;
+
+signals:
+    void baseReady(const QString& sourceImage, const QString& basePath);
+    void error(const QString& sourceImage, const QString& error);
+    void bootFilesReady(const QString& sourceImage, const QString& bootPath);
+    void bootFilesError(const QString& sourceImage, const QString& error);
+
+private slots:
+    void onProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void onExtractFinished(int exitCode, QProcess::ExitStatus exitStatus);
+
+private:
+    static QJsonObject imageInfo(const QString& imagePath);
+    void finishBase();
+
+    QProcess *m_process;
+    QString m_source;
+    QString m_base;
+    QString m_partial;  // Written here, renamed to m_base when complete
+
+    QProcess *m_extractProcess;
+    QString m_extractSource;
+};
+
+#endif // DISK_IMAGE_MANAGER_H
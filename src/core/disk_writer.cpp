@@ -0,0 +1,408 @@
+#include "disk_writer.h"
+#include <QDebug>
+#include <QMutexLocker>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+const qint64 READ_SIZE = 1024 * 1024;
+// Read-back for hashing yields to queued writes after this many bytes
+const qint64 CATCHUP_STEP = 4 * 1024 * 1024;
+// Written buffers left in the page cache while their writeback runs
+const int WRITEBACK_LAG = 2;
+
+} // namespace
+
+DiskWriter::DiskWriter(QObject *parent)
+    : QThread(parent),
+      m_writing(nullptr),
+      m_fd(-1),
+      m_stopping(false),
+      m_discard(false),
+      m_flushRequested(false),
+      m_hashing(false),
+      m_hashOffset(0) {
+}
+
+DiskWriter::~DiskWriter() {
+    end(true);
+    qDeleteAll(m_buffers);
+}
+
+bool DiskWriter::begin(int fd, const QVector<QPair<qint64, qint64>>& committed,
+                       bool hashing, qint64 hashOffset, const QByteArray& hashState) {
+    if (isRunning() || fd < 0) {
+        return false;
+    }
+
+    // The ring is allocated once and reused for every download
+    if (m_buffers.isEmpty()) {
+        for (int i = 0; i < BUFFER_COUNT; ++i) {
+            Buffer *buffer = new Buffer;
+            buffer->data = QByteArray(BUFFER_SIZE, Qt::Uninitialized);
+            m_buffers.append(buffer);
+        }
+    }
+
+    m_free = m_buffers;
+    m_queue.clear();
+    m_writing = nullptr;
+    m_committed.clear();
+    for (const auto& region : committed) {
+        if (region.second > region.first) {
+            commitLocked(region.first, region.second);
+        }
+    }
+
+    m_fd = fd;
+    m_written.clear();
+    // Hash read-back walks the file front to back
+    ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    m_stopping = false;
+    m_discard = false;
+    m_flushRequested = false;
+    m_error.clear();
+    m_stats = Stats();
+
+    m_hashing = hashing;
+    m_hash.reset();
+    m_hashOffset = 0;
+    if (hashing && hashOffset > 0 && hashOffset <= hashFrontierLocked() &&
+        m_hash.restoreState(hashState) && m_hash.bytesHashed() == hashOffset) {
+        m_hashOffset = hashOffset;
+    } else {
+        m_hash.reset();
+    }
+
+    start();
+    return true;
+}
+
+void DiskWriter::end(bool discard) {
+    if (!isRunning()) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_discard = discard;
+        if (discard) {
+            while (!m_queue.isEmpty()) {
+                Buffer *buffer = m_queue.dequeue();
+                m_stats.bytesQueued -= buffer->size;
+                m_stats.buffersQueued--;
+                m_free.append(buffer);
+            }
+        }
+        m_stopping = true;
+        m_wake.wakeAll();
+    }
+
+    wait();
+}
+
+DiskWriter::Buffer *DiskWriter::acquire(qint64 offset) {
+    QMutexLocker locker(&m_mutex);
+    if (m_free.isEmpty()) {
+        m_stats.backpressureEvents++;
+        return nullptr;
+    }
+
+    // Fill only up to the next BUFFER_SIZE boundary so that, after the
+    // first write of a segment, every write is a full aligned block
+    Buffer *buffer = m_free.takeLast();
+    buffer->offset = offset;
+    buffer->size = 0;
+    buffer->capacity = BUFFER_SIZE - (offset % BUFFER_SIZE);
+    return buffer;
+}
+
+void DiskWriter::submit(Buffer *buffer) {
+    if (buffer->size == 0) {
+        release(buffer);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_queue.enqueue(buffer);
+    m_stats.bytesQueued += buffer->size;
+    m_stats.buffersQueued++;
+    m_wake.wakeOne();
+}
+
+void DiskWriter::release(Buffer *buffer) {
+    QMutexLocker locker(&m_mutex);
+    m_free.append(buffer);
+}
+
+bool DiskWriter::flush() {
+    QMutexLocker locker(&m_mutex);
+    m_wake.wakeAll();
+    while (isRunning() && m_error.isEmpty() && !isIdleLocked()) {
+        m_idle.wait(&m_mutex);
+    }
+    return m_error.isEmpty();
+}
+
+void DiskWriter::requestFlush() {
+    QMutexLocker locker(&m_mutex);
+    m_flushRequested = true;
+    m_wake.wakeAll();
+}
+
+void DiskWriter::truncate() {
+    flush();
+
+    QMutexLocker locker(&m_mutex);
+    QMutexLocker hashLocker(&m_hashMutex);
+    m_committed.clear();
+    m_hash.reset();
+    m_hashOffset = 0;
+}
+
+qint64 DiskWriter::committedEnd(qint64 start) const {
+    QMutexLocker locker(&m_mutex);
+    auto it = m_committed.upperBound(start);
+    if (it == m_committed.constBegin()) {
+        return start;
+    }
+    --it;
+    return qMax(start, it.value());
+}
+
+QByteArray DiskWriter::hashState(qint64 *offset) const {
+    QMutexLocker locker(&m_hashMutex);
+    if (offset) {
+        *offset = m_hashOffset;
+    }
+    return m_hash.saveState();
+}
+
+QByteArray DiskWriter::hashResult() const {
+    QMutexLocker locker(&m_hashMutex);
+    return m_hash.result();
+}
+
+DiskWriter::Stats DiskWriter::stats() const {
+    QMutexLocker locker(&m_mutex);
+    Stats stats = m_stats;
+    stats.bufferCount = m_buffers.size();
+    stats.buffersFree = m_free.size();
+    return stats;
+}
+
+QString DiskWriter::errorString() const {
+    QMutexLocker locker(&m_mutex);
+    return m_error;
+}
+
+void DiskWriter::run() {
+    QByteArray scratch(READ_SIZE, Qt::Uninitialized);
+
+    forever {
+        Buffer *buffer = nullptr;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_stopping &&
+                   (!m_hashing || !m_error.isEmpty() || hashFrontierLocked() <= m_hashOffset)) {
+                m_idle.wakeAll();
+                if (m_flushRequested) {
+                    m_flushRequested = false;
+                    bool ok = m_error.isEmpty();
+                    locker.unlock();
+                    emit flushed(ok);
+                    locker.relock();
+                    continue;
+                }
+                m_wake.wait(&m_mutex);
+            }
+
+            if (m_queue.isEmpty() && m_stopping) {
+                locker.unlock();
+                while (!m_written.isEmpty()) {
+                    auto range = m_written.dequeue();
+                    dropPages(range.first, range.second);
+                }
+                locker.relock();
+                m_idle.wakeAll();
+                if (m_flushRequested) {
+                    m_flushRequested = false;
+                    emit flushed(m_error.isEmpty() && !m_discard);
+                }
+                break;
+            }
+
+            if (!m_queue.isEmpty()) {
+                buffer = m_queue.dequeue();
+                m_writing = buffer;
+            }
+        }
+
+        if (buffer) {
+            bool ok = m_error.isEmpty() && writeBuffer(buffer);
+
+            {
+                QMutexLocker locker(&m_mutex);
+                if (ok) {
+                    commitLocked(buffer->offset, buffer->offset + buffer->size);
+                    m_stats.bytesWritten += buffer->size;
+                }
+                m_stats.bytesQueued -= buffer->size;
+                m_stats.buffersQueued--;
+            }
+
+            // Data landing right at the hash cursor is hashed from memory
+            if (ok && m_hashing && buffer->offset == m_hashOffset) {
+                QMutexLocker hashLocker(&m_hashMutex);
+                m_hash.addData(buffer->data.constData(), buffer->size);
+                m_hashOffset += buffer->size;
+            }
+
+            if (ok) {
+                // Start writeback right away instead of letting dirty pages
+                // pile up, then drop older buffers from the page cache
+                ::sync_file_range(m_fd, buffer->offset, buffer->size, SYNC_FILE_RANGE_WRITE);
+                m_written.enqueue(qMakePair(buffer->offset, buffer->offset + buffer->size));
+                dropWrittenPages();
+            }
+
+            {
+                QMutexLocker locker(&m_mutex);
+                m_writing = nullptr;
+                m_free.append(buffer);
+            }
+            emit bufferAvailable();
+        }
+
+        if (m_hashing && m_error.isEmpty()) {
+            catchUpHash(scratch, CATCHUP_STEP);
+        }
+    }
+}
+
+bool DiskWriter::writeBuffer(Buffer *buffer) {
+    const char *data = buffer->data.constData();
+    qint64 remaining = buffer->size;
+    qint64 offset = buffer->offset;
+
+    while (remaining > 0) {
+        ssize_t written = ::pwrite(m_fd, data, static_cast<size_t>(remaining), offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            QString error = QString("Write failed at offset %1: %2")
+                                .arg(offset).arg(QString::fromLocal8Bit(strerror(errno)));
+            {
+                QMutexLocker locker(&m_mutex);
+                m_error = error;
+                m_idle.wakeAll();
+            }
+            qWarning() << error;
+            emit writeError(error);
+            return false;
+        }
+        data += written;
+        offset += written;
+        remaining -= written;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_stats.writeCalls++;
+    return true;
+}
+
+void DiskWriter::catchUpHash(QByteArray& scratch, qint64 maxBytes) {
+    qint64 target;
+    {
+        QMutexLocker locker(&m_mutex);
+        target = qMin(hashFrontierLocked(), m_hashOffset.load() + maxBytes);
+    }
+
+    while (m_hashOffset < target) {
+        ssize_t n = ::pread(m_fd, scratch.data(),
+                            static_cast<size_t>(qMin<qint64>(target - m_hashOffset, scratch.size())),
+                            m_hashOffset.load());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            QString error = QString("Cannot read back data for hashing at offset %1").arg(m_hashOffset.load());
+            {
+                QMutexLocker locker(&m_mutex);
+                m_error = error;
+                m_idle.wakeAll();
+            }
+            emit writeError(error);
+            return;
+        }
+
+        qint64 offset = m_hashOffset;
+        {
+            QMutexLocker hashLocker(&m_hashMutex);
+            m_hash.addData(scratch.constData(), n);
+            m_hashOffset += n;
+        }
+        dropPages(offset, offset + n);
+    }
+}
+
+void DiskWriter::dropWrittenPages() {
+    while (m_written.size() > WRITEBACK_LAG) {
+        auto range = m_written.dequeue();
+        // Ranges ahead of the hash cursor are dropped by catchUpHash()
+        // once it has read them back
+        if (m_hashing && range.second > m_hashOffset) {
+            continue;
+        }
+        dropPages(range.first, range.second);
+    }
+}
+
+void DiskWriter::dropPages(qint64 start, qint64 end) {
+    // A download must not push the running VM's working set out of the
+    // page cache. DONTNEED only drops clean pages, so wait for writeback.
+    ::sync_file_range(m_fd, start, end - start,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    ::posix_fadvise(m_fd, start, end - start, POSIX_FADV_DONTNEED);
+}
+
+void DiskWriter::commitLocked(qint64 start, qint64 end) {
+    // Merge with an overlapping or adjacent region on the left
+    auto it = m_committed.upperBound(start);
+    if (it != m_committed.begin()) {
+        auto previous = std::prev(it);
+        if (previous.value() >= start) {
+            start = previous.key();
+            end = qMax(end, previous.value());
+            m_committed.erase(previous);
+        }
+    }
+
+    // ...and with everything it now reaches on the right
+    it = m_committed.lowerBound(start);
+    while (it != m_committed.end() && it.key() <= end) {
+        end = qMax(end, it.value());
+        it = m_committed.erase(it);
+    }
+
+    m_committed.insert(start, end);
+}
+
+qint64 DiskWriter::hashFrontierLocked() const {
+    // End of the committed region the hash cursor sits in
+    auto it = m_committed.upperBound(m_hashOffset);
+    if (it == m_committed.constBegin()) {
+        return m_hashOffset;
+    }
+    --it;
+    return qMax(m_hashOffset.load(), it.value());
+}
+
+bool DiskWriter::isIdleLocked() const {
+    return m_queue.isEmpty() && !m_writing &&
+           (!m_hashing || hashFrontierLocked() <= m_hashOffset);
+}
@@ -0,0 +1,127 @@
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QVector>
+#include <QMap>
+#include <QPair>
+#include <atomic>
+#include "../utils/sha256.h"
+
+// Dedicated writer thread for DownloadManager. Network data is read
+// straight into a bounded ring of reusable 4MB buffers, which this thread
+// writes with positional writes. When the ring is exhausted acquire()
+// returns nullptr and the caller stops reading its sockets until
+// bufferAvailable() fires. Optionally the contiguous prefix of the file is
+// hashed as it is committed, reading back regions that were written out
+// of order. Written data is flushed and dropped from the page cache behind
+// the writer so a background download doesn't evict the VM's working set.
+class DiskWriter : public QThread {
+    Q_OBJECT
+
+public:
+    struct Buffer {
+        QByteArray data;     // BUFFER_SIZE bytes, allocated once
+        qint64 offset = 0;   // File offset of data[0]
+        qint64 size = 0;     // Bytes filled so far
+        qint64 capacity = 0; // Fill limit, ends on a BUFFER_SIZE boundary
+    };
+
+    struct Stats {
+        int bufferCount = 0;
+        int buffersFree = 0;
+        int buffersQueued = 0;  // Submitted, waiting for or in a write
+        qint64 bytesQueued = 0;
+        qint64 bytesWritten = 0;
+        qint64 writeCalls = 0;
+        qint64 backpressureEvents = 0;  // acquire() found the ring empty
+
+        // Share of the ring held by callers or the write queue
+        double occupancy() const {
+            return bufferCount > 0 ? 1.0 - double(buffersFree) / bufferCount : 0.0;
+        }
+    };
+
+    explicit DiskWriter(QObject *parent = nullptr);
+    ~DiskWriter();
+
+    // Starts the writer thread on an open file descriptor. committed lists
+    // [start, end) regions already on disk; with hashing enabled the hash
+    // continues from hashState at hashOffset (or from 0 if unusable).
+    bool begin(int fd, const QVector<QPair<qint64, qint64>>& committed,
+               bool hashing, qint64 hashOffset = 0, const QByteArray& hashState = QByteArray());
+    // Writes everything still queued and stops the thread; with discard,
+    // queued data is dropped instead
+    void end(bool discard = false);
+
+    Buffer *acquire(qint64 offset);
+    void submit(Buffer *buffer);
+    void release(Buffer *buffer);
+
+    // Blocks until every submitted buffer is on disk and hashed
+    bool flush();
+    // Same without blocking: flushed() is emitted from the writer thread
+    // once everything submitted so far is on disk and hashed
+    void requestFlush();
+    // Forgets all committed data and restarts the hash from offset 0
+    void truncate();
+
+    qint64 committedEnd(qint64 start) const;
+    qint64 hashOffset() const { return m_hashOffset; }
+    // Serialized hash state; offset receives the byte count it covers
+    QByteArray hashState(qint64 *offset = nullptr) const;
+    QByteArray hashResult() const;
+
+    Stats stats() const;
+    QString errorString() const;
+
+    static constexpr qint64 BUFFER_SIZE = 4 * 1024 * 1024;  // 4MB
+    static const int BUFFER_COUNT = 8;
+
+signals:
+    void bufferAvailable();
+    void writeError(const QString& error);
+    void flushed(bool ok);
+
+protected:
+    void run() override;
+
+private:
+    bool writeBuffer(Buffer *buffer);
+    void commitLocked(qint64 start, qint64 end);
+    qint64 hashFrontierLocked() const;
+    bool isIdleLocked() const;
+    void catchUpHash(QByteArray& scratch, qint64 maxBytes);
+    void dropWrittenPages();
+    void dropPages(qint64 start, qint64 end);
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_wake;   // Work for the writer thread
+    QWaitCondition m_idle;   // Queue drained, hash caught up
+
+    QVector<Buffer*> m_buffers;
+    QVector<Buffer*> m_free;
+    QQueue<Buffer*> m_queue;
+    Buffer *m_writing;
+    QMap<qint64, qint64> m_committed;  // start -> end, merged
+    QQueue<QPair<qint64, qint64>> m_written;  // Writer thread only, still cached
+
+    int m_fd;
+    bool m_stopping;
+    bool m_discard;
+    bool m_flushRequested;
+    QString m_error;
+    Stats m_stats;
+
+    // Only the writer thread updates the hash; m_hashMutex keeps the state
+    // and offset consistent for readers
+    mutable QMutex m_hashMutex;
+    Sha256 m_hash;
+    bool m_hashing;
+    std::atomic<qint64> m_hashOffset;
+};
+
+#endif // DISK_WRITER_H
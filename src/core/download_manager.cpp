@@ -4,27 +4,90 @@
 #include <QNetworkRequest>
 #include <QDebug>
 #include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QSaveFile>
+#include <QStorageInfo>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Opens a file the transfer writes to without following a symlink in its
+// place, and only if it is a regular file with no other names: whoever
+// can write to the download directory must not be able to point the
+// service at somebody else's file. Returns -1 and sets error otherwise.
+int openTransferFile(const QString& path, int flags, QString *error) {
+    int fd = ::open(QFile::encodeName(path).constData(), flags | O_NOFOLLOW | O_CLOEXEC, 0664);
+    if (fd < 0) {
+        *error = QString::fromLocal8Bit(strerror(errno));
+        return -1;
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_nlink != 1) {
+        *error = "not a regular file";
+        ::close(fd);
+        return -1;
+    }
+    // root only writes to its own files; any other user is held back by
+    // the file's permissions
+    if (::geteuid() == 0 && info.st_uid != 0) {
+        *error = "not owned by root";
+        ::close(fd);
+        return -1;
+    }
+
+    // Group members (the wizard, the service) continue each other's
+    // downloads
+    if (info.st_uid == ::geteuid()) {
+        ::fchmod(fd, (info.st_mode & 07777) | S_IRGRP | S_IWGRP);
+    }
+    return fd;
+}
+
+} // namespace
 
 DownloadManager::DownloadManager(QObject *parent)
     : QObject(parent),
       m_networkManager(new QNetworkAccessManager(this)),
-      m_reply(nullptr),
       m_file(nullptr),
+      m_writer(new DiskWriter(this)),
+      m_writerStarted(false),
+      m_shaper(new BandwidthShaper(this)),
+      m_drainStart(0),
+      m_probesPending(0),
+      m_segmentCount(DEFAULT_SEGMENTS),
+      m_acceptRanges(false),
       m_isDownloading(false),
+      m_finishing(false),
       m_bytesReceived(0),
       m_totalBytes(0),
       m_resumedBytes(0),
-      m_previousBytes(0),
-      m_downloadSpeed(0.0),
-      m_retryCount(0) {
+      m_downloadSpeed(0.0) {
 
     m_speedTimer = new QTimer(this);
     connect(m_speedTimer, &QTimer::timeout, this, &DownloadManager::updateSpeed);
+
+    m_probeTimeout = new QTimer(this);
+    m_probeTimeout->setSingleShot(true);
+    connect(m_probeTimeout, &QTimer::timeout, this, &DownloadManager::onProbeTimeout);
+
+    connect(m_writer, &DiskWriter::bufferAvailable, this, &DownloadManager::drainSegments);
+    connect(m_shaper, &BandwidthShaper::tokensAvailable, this, &DownloadManager::drainSegments);
+    connect(m_writer, &DiskWriter::writeError, this, &DownloadManager::onWriteError);
+    connect(m_writer, &DiskWriter::flushed, this, &DownloadManager::onWriterFlushed);
 }
 
 DownloadManager::~DownloadManager() {
     if (m_isDownloading) {
-        cancelDownload();
+        // Keep the .part file and segment state so the next run can resume
+        pauseDownload();
     }
 }
 
@@ -34,13 +97,7 @@ void DownloadManager::startDownload(const QString& url, const QString& destinati
         return;
     }
 
-    m_url = url;
-    m_destination = destination;
-    m_bytesReceived = 0;
-    m_totalBytes = 0;
-    m_resumedBytes = 0;
-    m_previousBytes = 0;
-    m_retryCount = 0;
+    resetTransfer(url, destination);
 
     // Create directory if it doesn't exist
     QFileInfo fileInfo(destination);
@@ -49,57 +106,574 @@ void DownloadManager::startDownload(const QString& url, const QString& destinati
         dir.mkpath(".");
     }
 
-    // Check if file already exists (resume capability)
-    m_file = new QFile(destination + ".part", this);
-    QIODevice::OpenMode mode = QIODevice::WriteOnly | QIODevice::Append;
+    // Segments write at their own offsets, so the file is opened for
+    // random access instead of append. The data itself goes through
+    // DiskWriter on the raw descriptor; QFile only sizes and renames.
+    QString error;
+    int fd = openTransferFile(partPath(), O_RDWR | O_CREAT, &error);
+    m_file = new QFile(partPath(), this);
+    if (fd < 0 || !m_file->open(fd, QIODevice::ReadWrite | QIODevice::Unbuffered,
+                                QFileDevice::AutoCloseHandle)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        emit downloadError("Cannot open file for writing: " + partPath() + " (" + error + ")");
+        delete m_file;
+        m_file = nullptr;
+        return;
+    }
 
-    if (m_file->exists()) {
-        m_resumedBytes = m_file->size();
-        m_bytesReceived = m_resumedBytes;
-        qDebug() << "Resuming download from" << m_resumedBytes << "bytes";
+    m_resumedBytes = m_file->size();
+    if (m_resumedBytes > 0) {
+        qDebug() << "Found partial download of" << m_resumedBytes << "bytes";
     }
 
-    if (!m_file->open(mode)) {
-        emit downloadError("Cannot open file for writing: " + destination);
+    m_isDownloading = true;
+    m_downloadTime.start();
+    m_rate.reset(0);
+    m_speedTimer->start(1000); // Update speed every second
+
+    probeServer();
+
+    qDebug() << "Download started:" << url;
+}
+
+void DownloadManager::repairRanges(const QString& url, const QString& filePath,
+                                   const QVector<QPair<qint64, qint64>>& ranges) {
+    if (m_isDownloading) {
+        emit downloadError("Download already in progress");
+        return;
+    }
+
+    resetTransfer(url, filePath);
+    m_repairRanges = ranges;
+
+    if (ranges.isEmpty()) {
+        emit downloadFinished(filePath);
+        return;
+    }
+
+    // Patch the finished image in place; no .part file or rename involved
+    QString error;
+    int fd = openTransferFile(filePath, O_RDWR, &error);
+    m_file = new QFile(filePath, this);
+    if (fd < 0 || !m_file->open(fd, QIODevice::ReadWrite | QIODevice::Unbuffered,
+                                QFileDevice::AutoCloseHandle)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        emit downloadError("Cannot open file for repair: " + filePath + " (" + error + ")");
         delete m_file;
         m_file = nullptr;
         return;
     }
 
-    QNetworkRequest request(url);
+    m_isDownloading = true;
+    m_downloadTime.start();
+    m_rate.reset(0);
+    m_speedTimer->start(1000);
+
+    probeServer();
+
+    qDebug() << "Repairing" << ranges.size() << "range(s) of" << filePath;
+}
+
+void DownloadManager::resetTransfer(const QString& url, const QString& destination) {
+    m_url = url;
+    m_mirrors.clear();
+    m_streamedChecksum.clear();
+    m_destination = destination;
+    m_segments.clear();
+    m_repairRanges.clear();
+    m_writerStarted = false;
+    m_acceptRanges = false;
+    m_bytesReceived = 0;
+    m_totalBytes = 0;
+    m_resumedBytes = 0;
+    m_downloadSpeed = 0.0;
+}
+
+void DownloadManager::setBandwidthShaper(BandwidthShaper *shaper) {
+    if (!shaper || shaper == m_shaper) {
+        return;
+    }
+
+    disconnect(m_shaper, nullptr, this, nullptr);
+    if (m_shaper->parent() == this) {
+        delete m_shaper;
+    }
+
+    m_shaper = shaper;
+    connect(m_shaper, &BandwidthShaper::tokensAvailable, this, &DownloadManager::drainSegments);
+}
+
+void DownloadManager::setMirrorUrls(const QStringList& urls) {
+    m_mirrorUrls = urls;
+}
+
+void DownloadManager::probeServer() {
+    // Every candidate gets a small ranged GET. Besides measuring how fast
+    // each mirror delivers, the response tells us the total size (from
+    // Content-Range), whether Range requests work, and where redirects
+    // such as SourceForge's /download end up.
+    m_mirrors.clear();
+
+    QStringList candidates;
+    candidates << m_url;
+    for (const QString& url : m_mirrorUrls) {
+        if (!url.isEmpty() && !candidates.contains(url)) {
+            candidates << url;
+        }
+    }
+
+    for (const QString& url : candidates) {
+        Mirror mirror;
+        mirror.url = url;
+        m_mirrors.append(mirror);
+    }
+
+    m_probesPending = m_mirrors.size();
+
+    for (Mirror& mirror : m_mirrors) {
+        QNetworkRequest request(mirror.url);
+        request.setRawHeader("User-Agent", "LinuxDroid/1.0");
+        request.setRawHeader("Range", "bytes=0-" + QByteArray::number(PROBE_SIZE - 1));
+
+        mirror.probeTime.start();
+        mirror.probe = m_networkManager->get(request);
+
+        connect(mirror.probe, &QNetworkReply::readyRead,
+                this, &DownloadManager::onProbeReadyRead);
+        connect(mirror.probe, &QNetworkReply::finished,
+                this, &DownloadManager::onProbeFinished);
+    }
+
+    m_probeTimeout->start(PROBE_TIMEOUT_MS);
+}
+
+int DownloadManager::mirrorForProbe(QNetworkReply *reply) const {
+    for (int i = 0; i < m_mirrors.size(); ++i) {
+        if (m_mirrors[i].probe == reply) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void DownloadManager::onProbeReadyRead() {
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    int index = mirrorForProbe(reply);
+    if (index < 0) {
+        return;
+    }
+
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status != 200) {
+        return;
+    }
+
+    // Server ignored the Range header and started sending the whole file.
+    // Take the size from Content-Length and drop the probe connection.
+    Mirror& mirror = m_mirrors[index];
+    mirror.responded = true;
+    mirror.acceptRanges = false;
+    mirror.totalBytes = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+    mirror.resolvedUrl = reply->url().toString();
+    mirror.probe = nullptr;
+
+    reply->disconnect(this);
+    reply->abort();
+    reply->deleteLater();
+
+    if (--m_probesPending == 0) {
+        selectMirrors();
+    }
+}
+
+void DownloadManager::onProbeFinished() {
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    int index = mirrorForProbe(reply);
+    reply->deleteLater();
+    if (index < 0) {
+        return;
+    }
+
+    Mirror& mirror = m_mirrors[index];
+    mirror.probe = nullptr;
+
+    if (reply->error() != QNetworkReply::NoError) {
+        qWarning() << "Probe of" << mirror.url << "failed:" << reply->errorString();
+    } else {
+        int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        mirror.responded = true;
+        mirror.resolvedUrl = reply->url().toString();
+
+        if (status == 206) {
+            // Content-Range: bytes 0-<n>/<total>
+            QByteArray contentRange = reply->rawHeader("Content-Range");
+            mirror.totalBytes = contentRange.mid(contentRange.lastIndexOf('/') + 1).toLongLong();
+            mirror.acceptRanges = mirror.totalBytes > 0;
+
+            qint64 elapsed = qMax<qint64>(1, mirror.probeTime.elapsed());
+            mirror.probeSpeed = reply->readAll().size() * 1000.0 / elapsed;
+        } else {
+            mirror.acceptRanges = false;
+            mirror.totalBytes = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+        }
+
+        qDebug() << "Mirror" << mirror.url << "size:" << mirror.totalBytes
+                 << "ranges:" << mirror.acceptRanges << "probe speed:" << mirror.probeSpeed;
+    }
+
+    if (--m_probesPending == 0) {
+        selectMirrors();
+    }
+}
+
+void DownloadManager::onProbeTimeout() {
+    // Slow mirrors don't get to hold up the download; they just lose
+    qWarning() << "Mirror probe timed out," << m_probesPending << "mirror(s) still pending";
+    selectMirrors();
+}
+
+void DownloadManager::selectMirrors() {
+    m_probeTimeout->stop();
+
+    for (Mirror& mirror : m_mirrors) {
+        if (mirror.probe) {
+            mirror.probe->disconnect(this);
+            mirror.probe->abort();
+            mirror.probe->deleteLater();
+            mirror.probe = nullptr;
+        }
+    }
+    m_probesPending = 0;
+
+    // The primary URL defines which file we want; mirrors serving a file
+    // of a different size are out. Without a usable primary, the fastest
+    // range-capable mirror sets the reference size.
+    qint64 referenceSize = 0;
+    if (m_mirrors.first().acceptRanges) {
+        referenceSize = m_mirrors.first().totalBytes;
+    } else {
+        double best = -1.0;
+        for (const Mirror& mirror : m_mirrors) {
+            if (mirror.acceptRanges && mirror.probeSpeed > best) {
+                best = mirror.probeSpeed;
+                referenceSize = mirror.totalBytes;
+            }
+        }
+    }
+
+    QVector<Mirror> usable;
+    for (const Mirror& mirror : m_mirrors) {
+        if (mirror.acceptRanges && mirror.totalBytes == referenceSize) {
+            usable.append(mirror);
+        }
+    }
+
+    if (!usable.isEmpty()) {
+        std::stable_sort(usable.begin(), usable.end(), [](const Mirror& a, const Mirror& b) {
+            return a.probeSpeed > b.probeSpeed;
+        });
+        m_acceptRanges = true;
+        m_totalBytes = referenceSize;
+    } else {
+        // Nothing supports ranges: fall back to a plain single-stream
+        // download from the first mirror that answered at all
+        for (const Mirror& mirror : m_mirrors) {
+            if (mirror.responded) {
+                usable.append(mirror);
+                break;
+            }
+        }
+        if (usable.isEmpty()) {
+            // Without an answer there's no telling whether ranges work, and
+            // a restart from zero would throw away the .part file; the
+            // partial download and its state stay for the next attempt
+            failDownload("No mirror answered the probe request");
+            return;
+        }
+        m_acceptRanges = false;
+        m_totalBytes = usable.first().totalBytes;
+    }
+
+    m_mirrors = usable;
+
+    qDebug() << "Server size:" << m_totalBytes << "bytes, ranges:" << m_acceptRanges
+             << "- starting on" << m_mirrors.first().url;
+    planSegments();
+}
+
+int DownloadManager::nextMirror(int current) const {
+    return m_mirrors.isEmpty() ? 0 : (current + 1) % m_mirrors.size();
+}
+
+void DownloadManager::switchMirror(int index) {
+    Segment& segment = m_segments[index];
+    if (segment.reply) {
+        segment.reply->disconnect(this);
+        segment.reply->abort();
+        segment.reply->deleteLater();
+        segment.reply = nullptr;
+    }
+
+    // The bytes already written stay; the new connection continues from
+    // the segment's current offset
+    int previous = segment.mirror;
+    segment.mirror = nextMirror(previous);
+
+    qDebug() << "Segment" << index << "stalled at" << segment.offset() << "on"
+             << m_mirrors[previous].url << "- switching to" << m_mirrors[segment.mirror].url;
+    startSegment(index);
+}
+
+void DownloadManager::planSegments() {
+    if (!m_isDownloading || !m_file) {
+        return;
+    }
+
+    qint64 hashOffset = 0;
+    QByteArray hashState;
+
+    if (isRepairing()) {
+        // Ranges only make sense against the very same file on the server
+        if (!m_acceptRanges || m_totalBytes != m_file->size()) {
+            failDownload("Server cannot serve the ranges needed for repair");
+            return;
+        }
+
+        m_segments.clear();
+        m_totalBytes = 0;
+        for (const auto& range : m_repairRanges) {
+            Segment segment;
+            segment.start = range.first;
+            segment.end = range.second;
+            m_segments.append(segment);
+            m_totalBytes += segment.length();
+        }
+    } else if (m_acceptRanges && m_totalBytes > 0) {
+        if (!loadSegmentState(hashOffset, hashState)) {
+            m_segments.clear();
+
+            // A .part file without segment state is a plain prefix left by a
+            // single-stream download; keep it as an already finished segment.
+            qint64 prefix = (m_resumedBytes > 0 && m_resumedBytes <= m_totalBytes) ? m_resumedBytes : 0;
+            if (prefix > 0) {
+                Segment done;
+                done.start = 0;
+                done.end = prefix - 1;
+                done.received = prefix;
+                m_segments.append(done);
+            }
+
+            // A prefix holding the whole file leaves nothing to fetch; it
+            // only needs verifying and renaming
+            qint64 remaining = m_totalBytes - prefix;
+            if (remaining > 0) {
+                int count = static_cast<int>(qBound<qint64>(1, remaining / MIN_SEGMENT_SIZE, m_segmentCount));
+                qint64 chunk = remaining / count;
+                if (chunk > DiskWriter::BUFFER_SIZE) {
+                    // Keep segment boundaries on writer buffer boundaries
+                    chunk -= chunk % DiskWriter::BUFFER_SIZE;
+                }
+
+                for (int i = 0; i < count; ++i) {
+                    Segment segment;
+                    segment.start = prefix + i * chunk;
+                    segment.end = (i == count - 1) ? m_totalBytes - 1 : segment.start + chunk - 1;
+                    m_segments.append(segment);
+                }
+            }
+        }
+
+        // Allocate the whole file up front so every segment can write at
+        // its offset. This also fills holes left by an earlier session.
+        if (!preallocateFile(m_totalBytes, false)) {
+            return;
+        }
+    } else {
+        // A mirror answered without range support: one stream from the
+        // start, nothing to resume
+        m_segments.clear();
+        m_file->resize(0);
+
+        // Reserve the space without changing the size, which still has
+        // to reflect what actually arrived
+        if (m_totalBytes > 0 && !preallocateFile(m_totalBytes, true)) {
+            return;
+        }
+
+        Segment segment;
+        segment.end = m_totalBytes > 0 ? m_totalBytes - 1 : -1;
+        m_segments.append(segment);
+        QFile::remove(statePath());
+    }
+
+    // Everything the segments already hold is on disk
+    QVector<QPair<qint64, qint64>> committed;
+    for (const Segment& segment : m_segments) {
+        if (segment.received > 0) {
+            committed.append(qMakePair(segment.start, segment.offset()));
+        }
+    }
+
+    // The writer resumes the checksum from the saved state, or hashes
+    // whatever an earlier session left on disk from the start
+    if (!m_writer->begin(m_file->handle(), committed, isHashing(), hashOffset, hashState)) {
+        failDownload("Cannot start disk writer");
+        return;
+    }
+    m_writerStarted = true;
+
+    if (hashOffset > 0 && m_writer->hashOffset() == hashOffset) {
+        qDebug() << "Restored checksum state at" << hashOffset << "bytes";
+    }
+
+    updateBytesReceived();
+    m_resumedBytes = m_bytesReceived;
+
+    if (m_resumedBytes > 0) {
+        qDebug() << "Resuming download from" << m_resumedBytes << "bytes";
+    }
+
+    saveSegmentState();
+
+    bool pending = false;
+    for (int i = 0; i < m_segments.size(); ++i) {
+        if (!m_segments[i].isComplete()) {
+            startSegment(i);
+            pending = true;
+        }
+    }
+
+    qDebug() << "Downloading with" << activeSegments() << "connection(s)";
+
+    if (!pending) {
+        finishDownload();
+    }
+}
+
+bool DownloadManager::preallocateFile(qint64 size, bool keepSize) {
+    // Allocating in one call lets ext4/xfs hand out large contiguous
+    // extents, where a file grown piecemeal by segments ends up scattered
+    // across the disk. fallocate() is used rather than posix_fallocate()
+    // because glibc emulates the latter by writing every block, which would
+    // stall a multi-GB download on filesystems without native support.
+    int result;
+    do {
+        result = ::fallocate(m_file->handle(), keepSize ? FALLOC_FL_KEEP_SIZE : 0, 0, size);
+    } while (result < 0 && errno == EINTR);
+
+    if (result == 0) {
+        return true;
+    }
+
+    int error = errno;
+    QStorageInfo storage(QFileInfo(m_file->fileName()).absolutePath());
+    qint64 needed = size;
+    bool noSpace = (error == ENOSPC || error == EFBIG);
+
+    if (!noSpace) {
+        // The filesystem cannot preallocate; still refuse to start a
+        // download that obviously won't fit, then fall back to a sparse file
+        qDebug() << "Preallocation not supported:" << strerror(error);
+        needed = size - m_file->size();
+        noSpace = storage.isValid() && storage.bytesAvailable() < needed;
+    }
+
+    if (noSpace) {
+        failDownload(QString("Not enough disk space: %1 MB needed, %2 MB available on %3")
+                         .arg(needed / (1024 * 1024))
+                         .arg(storage.bytesAvailable() / (1024 * 1024))
+                         .arg(storage.rootPath()));
+        return false;
+    }
+
+    if (!keepSize && !m_file->resize(size)) {
+        failDownload("Cannot allocate file: " + m_file->errorString());
+        return false;
+    }
+    return true;
+}
+
+void DownloadManager::startSegment(int index) {
+    Segment& segment = m_segments[index];
+
+    // Redirects were already resolved by the probe, so segments go
+    // straight to the concrete mirror
+    const Mirror& mirror = m_mirrors[qBound(0, segment.mirror, m_mirrors.size() - 1)];
+    QNetworkRequest request(mirror.resolvedUrl.isEmpty() ? mirror.url : mirror.resolvedUrl);
     request.setRawHeader("User-Agent", "LinuxDroid/1.0");
 
     // Resume support
-    if (m_resumedBytes > 0) {
-        QByteArray rangeHeader = "bytes=" + QByteArray::number(m_resumedBytes) + "-";
+    if (m_acceptRanges) {
+        QByteArray rangeHeader = "bytes=" + QByteArray::number(segment.offset()) + "-";
+        if (segment.end >= 0) {
+            rangeHeader += QByteArray::number(segment.end);
+        }
         request.setRawHeader("Range", rangeHeader);
     }
 
-    m_reply = m_networkManager->get(request);
+    segment.rangeChecked = false;
+    segment.replyFinished = false;
+    segment.slowSeconds = 0;
+    segment.rate.reset(m_downloadTime.nsecsElapsed());
+    segment.reply = m_networkManager->get(request);
+
+    // Qt stops reading the socket once this much is unread, which is how
+    // a full writer ring pushes back on the server
+    segment.reply->setReadBufferSize(READ_BUFFER_SIZE);
 
-    connect(m_reply, &QNetworkReply::downloadProgress,
-            this, &DownloadManager::onDownloadProgress);
-    connect(m_reply, &QNetworkReply::finished,
+    connect(segment.reply, &QNetworkReply::finished,
             this, &DownloadManager::onFinished);
-    connect(m_reply, &QNetworkReply::readyRead,
+    connect(segment.reply, &QNetworkReply::readyRead,
             this, &DownloadManager::onReadyRead);
-    connect(m_reply, QOverload<QNetworkReply::NetworkError>::of(&QNetworkReply::errorOccurred),
+    connect(segment.reply, QOverload<QNetworkReply::NetworkError>::of(&QNetworkReply::errorOccurred),
             this, &DownloadManager::onError);
+}
 
-    m_isDownloading = true;
-    m_downloadTime.start();
-    m_speedTimer->start(1000); // Update speed every second
+int DownloadManager::segmentForReply(QNetworkReply *reply) const {
+    for (int i = 0; i < m_segments.size(); ++i) {
+        if (m_segments[i].reply == reply) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    qDebug() << "Download started:" << url;
+int DownloadManager::activeSegments() const {
+    int count = 0;
+    for (const Segment& segment : m_segments) {
+        if (segment.reply) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void DownloadManager::setSegmentCount(int count) {
+    m_segmentCount = qBound(1, count, 16);
+}
+
+bool DownloadManager::supportsResume() {
+    return m_acceptRanges;
 }
 
 void DownloadManager::pauseDownload() {
     if (!m_isDownloading) {
         return;
     }
+    m_finishing = false;
+
+    abortSegments();
+    m_writer->end();
+    saveSegmentState();
 
-    if (m_reply) {
-        m_reply->abort();
+    if (m_file) {
+        m_file->close();
+        delete m_file;
+        m_file = nullptr;
     }
 
     m_isDownloading = false;
@@ -111,109 +685,597 @@ void DownloadManager::resumeDownload() {
         return;
     }
 
+    if (isRepairing()) {
+        QVector<QPair<qint64, qint64>> ranges = m_repairRanges;
+        repairRanges(m_url, m_destination, ranges);
+        return;
+    }
+
     startDownload(m_url, m_destination);
 }
 
 void DownloadManager::cancelDownload() {
-    if (m_reply) {
-        m_reply->abort();
-        m_reply->deleteLater();
-        m_reply = nullptr;
-    }
+    m_finishing = false;
+    abortSegments();
+    m_writer->end(true);
 
     if (m_file) {
         m_file->close();
-        m_file->remove();
+        if (!isRepairing()) {
+            QFile::remove(partPath());
+        }
         delete m_file;
         m_file = nullptr;
     }
+    QFile::remove(statePath());
 
+    m_segments.clear();
     m_isDownloading = false;
     m_speedTimer->stop();
 }
 
-void DownloadManager::onDownloadProgress(qint64 bytesReceived, qint64 totalBytes) {
-    // bytesReceived is the total bytes received in THIS session (not including resumed bytes)
-    // So the actual total is: resumed bytes + current session bytes
-    m_bytesReceived = m_resumedBytes + bytesReceived;
-
-    if (totalBytes > 0) {
-        // totalBytes is the size of the remaining download
-        // Add resumed bytes to get the actual total file size
-        m_totalBytes = m_resumedBytes + totalBytes;
+void DownloadManager::abortSegments() {
+    // Disconnect first so the aborted replies don't trigger the retry path
+    m_probeTimeout->stop();
+    for (Mirror& mirror : m_mirrors) {
+        if (mirror.probe) {
+            mirror.probe->disconnect(this);
+            mirror.probe->abort();
+            mirror.probe->deleteLater();
+            mirror.probe = nullptr;
+        }
     }
 
-    emit downloadProgress(m_bytesReceived, m_totalBytes);
+    for (Segment& segment : m_segments) {
+        if (segment.reply) {
+            segment.reply->disconnect(this);
+            segment.reply->abort();
+            segment.reply->deleteLater();
+            segment.reply = nullptr;
+        }
+        // Hand partial buffers to the writer; cancel discards them there
+        if (segment.buffer) {
+            m_writer->submit(segment.buffer);
+            segment.buffer = nullptr;
+        }
+    }
 }
 
 void DownloadManager::onReadyRead() {
-    if (m_file) {
-        m_file->write(m_reply->readAll());
+    int index = segmentForReply(qobject_cast<QNetworkReply*>(sender()));
+    if (index >= 0) {
+        readSegmentData(index);
     }
 }
 
+void DownloadManager::readSegmentData(int index) {
+    if (!m_file) {
+        return;
+    }
+
+    Segment& segment = m_segments[index];
+    QNetworkReply *reply = segment.reply;
+
+    if (!segment.rangeChecked) {
+        segment.rangeChecked = true;
+        int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+        if (status == 200 && (segment.offset() > 0 || m_segments.size() > 1)) {
+            if (isRepairing()) {
+                failDownload("Server stopped accepting range requests");
+                return;
+            }
+            if (m_segments.size() > 1) {
+                // The whole file is coming on this connection; read as one
+                // segment, everything past its end would be drained and lost
+                fallBackToSingleStream();
+                return;
+            }
+
+            // Server ignored the Range header: start the file over
+            qWarning() << "Server ignored range request, restarting from 0";
+            if (segment.buffer) {
+                m_writer->release(segment.buffer);
+                segment.buffer = nullptr;
+            }
+            segment.received = 0;
+            m_writer->truncate();
+            m_file->resize(0);
+        }
+    }
+
+    qint64 before = segment.received;
+
+    // Read straight into writer buffers. When the ring is exhausted or the
+    // shaper's bucket is empty, the rest stays in the reply until
+    // drainSegments() is called again.
+    while (reply->bytesAvailable() > 0) {
+        qint64 limit = segment.end >= 0 ? segment.length() - segment.received : -1;
+        if (limit == 0) {
+            // Never let a segment spill into its neighbour
+            reply->readAll();
+            break;
+        }
+
+        if (!segment.buffer) {
+            segment.buffer = m_writer->acquire(segment.offset());
+            if (!segment.buffer) {
+                break;
+            }
+            segment.bufferAge = 0;
+        }
+
+        DiskWriter::Buffer *buffer = segment.buffer;
+        qint64 space = buffer->capacity - buffer->size;
+        if (limit > 0) {
+            space = qMin(space, limit);
+        }
+
+        space = m_shaper->allowance(space);
+        if (space == 0) {
+            break;
+        }
+
+        qint64 n = reply->read(buffer->data.data() + buffer->size, space);
+        if (n <= 0) {
+            break;
+        }
+        m_shaper->consume(n);
+        buffer->size += n;
+        segment.received += n;
+
+        if (buffer->size == buffer->capacity || segment.isComplete()) {
+            m_writer->submit(buffer);
+            segment.buffer = nullptr;
+        }
+    }
+
+    if (segment.received == before) {
+        return;
+    }
+
+    qint64 now = m_downloadTime.nsecsElapsed();
+    segment.rate.addBytes(segment.received - before, now);
+    m_rate.addBytes(segment.received - before, now);
+    segment.retryCount = 0;
+
+    updateBytesReceived();
+    emit downloadProgress(m_bytesReceived, m_totalBytes);
+}
+
+void DownloadManager::fallBackToSingleStream() {
+    qWarning() << "Server ignored a range request, falling back to a single stream";
+
+    // Nothing written so far is kept: the single stream rewrites the file
+    // from the start
+    abortSegments();
+    m_writer->end(true);
+    m_writerStarted = false;
+    m_acceptRanges = false;
+    planSegments();
+}
+
 void DownloadManager::onFinished() {
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    int index = segmentForReply(reply);
+    if (index < 0) {
+        reply->deleteLater();
+        return;
+    }
+
+    if (reply->error() != QNetworkReply::NoError) {
+        qWarning() << "Segment" << index << "error:" << reply->errorString();
+
+        m_segments[index].reply = nullptr;
+        reply->deleteLater();
+        retrySegment(index);
+        return;
+    }
+
+    // Write remaining data
+    m_segments[index].replyFinished = true;
+    readSegmentData(index);
+    if (!m_isDownloading) {
+        return;
+    }
+
+    // With the ring full or the rate limit reached, the tail is drained
+    // from drainSegments()
+    if (reply->bytesAvailable() > 0) {
+        return;
+    }
+
+    completeSegment(index);
+}
+
+void DownloadManager::completeSegment(int index) {
+    Segment& segment = m_segments[index];
+    segment.reply->deleteLater();
+    segment.reply = nullptr;
+    segment.replyFinished = false;
+
+    if (segment.buffer) {
+        m_writer->submit(segment.buffer);
+        segment.buffer = nullptr;
+    }
+
+    if (segment.end < 0) {
+        // Unknown length: the stream ending is what defines the size
+        segment.end = segment.start + segment.received - 1;
+        m_totalBytes = segment.received;
+    }
+
+    if (!segment.isComplete()) {
+        qWarning() << "Segment" << index << "closed early at" << segment.offset();
+        retrySegment(index);
+        return;
+    }
+
+    for (const Segment& s : m_segments) {
+        if (!s.isComplete()) {
+            saveSegmentState();
+            return;
+        }
+    }
+
+    finishDownload();
+}
+
+void DownloadManager::drainSegments() {
+    if (!m_isDownloading || m_segments.isEmpty()) {
+        return;
+    }
+
+    // Resume segments that were held back by a full ring or the rate
+    // limit. The starting segment rotates so a tight budget is shared.
+    int count = m_segments.size();
+    m_drainStart = (m_drainStart + 1) % count;
+
+    for (int n = 0; n < count; ++n) {
+        int i = (m_drainStart + n) % count;
+        Segment& segment = m_segments[i];
+        if (!segment.reply || segment.reply->bytesAvailable() == 0) {
+            continue;
+        }
+
+        readSegmentData(i);
+        if (!m_isDownloading) {
+            return;
+        }
+
+        if (m_segments[i].replyFinished && m_segments[i].reply->bytesAvailable() == 0) {
+            completeSegment(i);
+            if (!m_isDownloading) {
+                return;
+            }
+        }
+    }
+}
+
+void DownloadManager::onWriteError(const QString& error) {
+    if (m_isDownloading) {
+        failDownload(error);
+    }
+}
+
+void DownloadManager::retrySegment(int index) {
+    Segment& segment = m_segments[index];
+
+    // Retry logic
+    if (segment.retryCount >= MAX_RETRIES) {
+        failDownload("Download failed after " + QString::number(MAX_RETRIES) + " retries");
+        return;
+    }
+
+    // Fail over to the next mirror, if there is one
+    segment.retryCount++;
+    segment.mirror = nextMirror(segment.mirror);
+    qDebug() << "Retrying segment" << index << "from" << segment.offset()
+             << "on" << m_mirrors[segment.mirror].url << "attempt" << segment.retryCount;
+    saveSegmentState();
+
+    QTimer::singleShot(2000, this, [this, index]() {
+        if (m_isDownloading && index < m_segments.size() &&
+            !m_segments[index].reply && !m_segments[index].isComplete()) {
+            startSegment(index);
+        }
+    });
+}
+
+void DownloadManager::finishDownload() {
     m_speedTimer->stop();
-    m_isDownloading = false;
 
-    if (m_reply->error() != QNetworkReply::NoError) {
-        qWarning() << "Download error:" << m_reply->errorString();
+    m_finishing = true;
+    if (m_file) {
+        // Every buffer is submitted by now; the writer drains them and,
+        // when hashing, finishes the checksum before onWriterFlushed()
+        m_writer->requestFlush();
+        return;
+    }
+
+    onWriterFlushed(true);
+}
+
+void DownloadManager::onWriterFlushed(bool ok) {
+    // A pause or cancel while flushing wins
+    if (!m_finishing) {
+        return;
+    }
+    m_finishing = false;
 
-        if (m_file) {
-            m_file->close();
-            delete m_file;
-            m_file = nullptr;
+    if (m_file) {
+        m_writer->end();
+        if (!ok) {
+            failDownload(m_writer->errorString());
+            return;
         }
 
-        // Retry logic
-        if (m_retryCount < MAX_RETRIES) {
-            m_retryCount++;
-            qDebug() << "Retrying download, attempt" << m_retryCount;
-            QTimer::singleShot(2000, this, &DownloadManager::resumeDownload);
-        } else {
-            emit downloadError("Download failed after " + QString::number(MAX_RETRIES) + " retries");
+        if (isHashing() && m_writer->hashOffset() == m_file->size()) {
+            m_streamedChecksum = QString(m_writer->hashResult().toHex());
         }
 
-        m_reply->deleteLater();
-        m_reply = nullptr;
+        DiskWriter::Stats stats = m_writer->stats();
+        qDebug() << "Disk writer:" << stats.writeCalls << "writes," << stats.backpressureEvents
+                 << "backpressure stalls";
+    }
+
+    m_isDownloading = false;
+
+    if (m_file && isRepairing()) {
+        m_file->close();
+        delete m_file;
+        m_file = nullptr;
+
+        qDebug() << "Repair completed:" << m_destination;
+        emit downloadFinished(m_destination);
         return;
     }
 
-    // Write remaining data
     if (m_file) {
-        m_file->write(m_reply->readAll());
         m_file->close();
 
-        // Rename .part file to final name
-        QString finalName = m_destination;
-        QFile::remove(finalName); // Remove if exists
-        m_file->rename(finalName);
+        // Rename .part file to final name. rename() replaces whatever is
+        // there, a symlink included, instead of following it.
+        if (::rename(QFile::encodeName(partPath()).constData(),
+                     QFile::encodeName(m_destination).constData()) != 0) {
+            qWarning() << "Cannot rename" << partPath() << "to" << m_destination << ":"
+                       << strerror(errno);
+        }
 
         delete m_file;
         m_file = nullptr;
     }
-
-    m_reply->deleteLater();
-    m_reply = nullptr;
+    QFile::remove(statePath());
 
     qDebug() << "Download completed:" << m_destination;
     emit downloadFinished(m_destination);
+
+    if (isHashing()) {
+        bool matches = (m_streamedChecksum == m_expectedChecksum.toLower());
+
+        qDebug() << "Checksum verification:" << (matches ? "SUCCESS" : "FAILED");
+        qDebug() << "Expected:" << m_expectedChecksum;
+        qDebug() << "Calculated:" << m_streamedChecksum;
+
+        emit checksumVerified(matches);
+    }
+}
+
+void DownloadManager::failDownload(const QString& error) {
+    m_finishing = false;
+    abortSegments();
+    m_writer->end();
+    saveSegmentState();
+
+    if (m_file) {
+        m_file->close();
+        delete m_file;
+        m_file = nullptr;
+    }
+
+    m_isDownloading = false;
+    m_speedTimer->stop();
+    emit downloadError(error);
+}
+
+void DownloadManager::updateBytesReceived() {
+    qint64 total = 0;
+    for (const Segment& segment : m_segments) {
+        total += segment.received;
+    }
+    m_bytesReceived = total;
+}
+
+bool DownloadManager::loadSegmentState(qint64& hashOffset, QByteArray& hashState) {
+    // Written with QSaveFile, whose rename replaces a planted symlink
+    QString error;
+    int fd = openTransferFile(statePath(), O_RDONLY, &error);
+    QFile file(statePath());
+    if (fd < 0 || !file.open(fd, QIODevice::ReadOnly, QFileDevice::AutoCloseHandle)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+
+    QJsonObject state = QJsonDocument::fromJson(file.readAll()).object();
+
+    // Only trust the state if it describes this exact file
+    if (state["url"].toString() != m_url ||
+        state["totalBytes"].toVariant().toLongLong() != m_totalBytes ||
+        !m_file || m_file->size() != m_totalBytes) {
+        qDebug() << "Discarding stale segment state";
+        return false;
+    }
+
+    QVector<Segment> segments;
+    for (const QJsonValue& value : state["segments"].toArray()) {
+        QJsonObject obj = value.toObject();
+        Segment segment;
+        segment.start = obj["start"].toVariant().toLongLong();
+        segment.end = obj["end"].toVariant().toLongLong();
+        segment.received = obj["received"].toVariant().toLongLong();
+
+        if (segment.end < segment.start || segment.received < 0 ||
+            segment.received > segment.length()) {
+            return false;
+        }
+        segments.append(segment);
+    }
+
+    if (segments.isEmpty()) {
+        return false;
+    }
+
+    m_segments = segments;
+
+    // DiskWriter validates the hash state; if it is unusable the prefix
+    // gets re-hashed from disk instead
+    hashOffset = state["hashOffset"].toVariant().toLongLong();
+    hashState = QByteArray::fromBase64(state["hashState"].toString().toLatin1());
+
+    return true;
+}
+
+void DownloadManager::saveSegmentState() {
+    if (isRepairing() || !m_acceptRanges || m_totalBytes <= 0 || m_segments.isEmpty()) {
+        return;
+    }
+
+    // Read the hash before the committed regions: the writer only hashes
+    // committed data, so the saved hash never runs ahead of the segments
+    qint64 hashOffset = 0;
+    QByteArray hashState;
+    if (m_writerStarted && isHashing()) {
+        hashState = m_writer->hashState(&hashOffset);
+    }
+
+    // Only bytes the writer has put on disk count as received; data still
+    // in the ring is fetched again after a crash
+    QJsonArray segments;
+    for (const Segment& segment : m_segments) {
+        qint64 received = segment.received;
+        if (m_writerStarted) {
+            qint64 committedEnd = qMin(m_writer->committedEnd(segment.start), segment.end + 1);
+            received = qBound<qint64>(0, committedEnd - segment.start, received);
+        }
+
+        QJsonObject obj;
+        obj["start"] = segment.start;
+        obj["end"] = segment.end;
+        obj["received"] = received;
+        segments.append(obj);
+    }
+
+    QJsonObject state;
+    state["url"] = m_url;
+    state["totalBytes"] = m_totalBytes;
+    state["segments"] = segments;
+
+    if (!hashState.isEmpty()) {
+        state["hashOffset"] = hashOffset;
+        state["hashState"] = QString::fromLatin1(hashState.toBase64());
+    }
+
+    QSaveFile file(statePath());
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+        file.commit();
+    }
 }
 
 void DownloadManager::onError(QNetworkReply::NetworkError error) {
-    qWarning() << "Network error:" << error << m_reply->errorString();
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    qWarning() << "Network error:" << error << (reply ? reply->errorString() : QString());
 }
 
 void DownloadManager::updateSpeed() {
-    calculateSpeed();
+    qint64 now = m_downloadTime.nsecsElapsed();
+    m_rate.update(now);
+    m_downloadSpeed = m_rate.rate();
     emit downloadSpeedUpdated(m_downloadSpeed);
+
+    int active = activeSegments();
+    double fairShare = m_downloadSpeed / qMax(1, active);
+
+    for (int i = 0; i < m_segments.size(); ++i) {
+        Segment& segment = m_segments[i];
+
+        // Slow connections don't get to hold a buffer indefinitely
+        if (segment.buffer && segment.buffer->size > 0 && ++segment.bufferAge >= BUFFER_MAX_AGE) {
+            m_writer->submit(segment.buffer);
+            segment.buffer = nullptr;
+        }
+
+        if (!segment.reply) {
+            continue;
+        }
+        segment.rate.update(now);
+
+        // Data waiting for a free buffer is backpressure, not a stall
+        if (segment.reply->bytesAvailable() > 0) {
+            segment.slowSeconds = 0;
+            continue;
+        }
+
+        // A connection that delivers nothing for a while is moved to another
+        // mirror (or reconnected, if there is only one)
+        if (segment.rate.idleNsecs(now) >= STALL_SECONDS * NSECS_PER_SEC) {
+            switchMirror(i);
+            continue;
+        }
+
+        // One that keeps crawling far below its share of the aggregate
+        // moves on as well, if there is another mirror to try
+        bool slow = m_mirrors.size() > 1 && active > 1 && segment.rate.hasRate() &&
+                    segment.rate.rate() * SLOW_RATIO < fairShare;
+        segment.slowSeconds = slow ? segment.slowSeconds + 1 : 0;
+        if (segment.slowSeconds >= STALL_SECONDS) {
+            qDebug() << "Segment" << i << "at" << segment.rate.rate() << "B/s, share is" << fairShare;
+            switchMirror(i);
+        }
+    }
+
+    emit downloadStatsUpdated(stats());
+
+    // Checkpoint segment progress so a crash loses at most a second of work
+    saveSegmentState();
 }
 
-void DownloadManager::calculateSpeed() {
-    qint64 currentBytes = m_bytesReceived;
-    qint64 bytesDiff = currentBytes - m_previousBytes;
-    m_downloadSpeed = bytesDiff; // Bytes per second
-    m_previousBytes = currentBytes;
+DownloadManager::TransferStats DownloadManager::stats() const {
+    qint64 now = m_downloadTime.isValid() ? m_downloadTime.nsecsElapsed() : 0;
+
+    TransferStats stats;
+    stats.bytesReceived = m_bytesReceived;
+    stats.totalBytes = m_totalBytes;
+    stats.bytesPerSecond = m_downloadSpeed;
+    stats.secondsRemaining = secondsRemaining();
+
+    // Resumed bytes didn't cost this session any time
+    qint64 sessionBytes = m_bytesReceived - m_resumedBytes;
+    if (now > 0 && sessionBytes > 0) {
+        stats.averageBytesPerSecond = sessionBytes / (now / 1e9);
+    }
+
+    for (int i = 0; i < m_segments.size(); ++i) {
+        const Segment& segment = m_segments[i];
+        if (!segment.reply) {
+            continue;
+        }
+
+        TransferStats::Connection connection;
+        connection.segment = i;
+        if (segment.mirror < m_mirrors.size()) {
+            connection.mirror = m_mirrors[segment.mirror].url;
+        }
+        connection.received = segment.received;
+        connection.remaining = segment.end >= 0 ? segment.length() - segment.received : -1;
+        connection.bytesPerSecond = segment.rate.rate();
+        connection.idleSeconds = static_cast<int>(segment.rate.idleNsecs(now) / NSECS_PER_SEC);
+        stats.connections.append(connection);
+    }
+
+    return stats;
 }
 
 int DownloadManager::progressPercentage() const {
@@ -223,17 +1285,25 @@ int DownloadManager::progressPercentage() const {
     return static_cast<int>((m_bytesReceived * 100) / m_totalBytes);
 }
 
+qint64 DownloadManager::secondsRemaining() const {
+    if (!m_rate.hasRate() || m_downloadSpeed <= 0 || m_totalBytes <= 0) {
+        return -1;
+    }
+    return static_cast<qint64>((m_totalBytes - m_bytesReceived) / m_downloadSpeed);
+}
+
 QString DownloadManager::estimatedTimeRemaining() const {
-    if (m_downloadSpeed <= 0 || m_totalBytes <= 0) {
+    return formatTimeRemaining(secondsRemaining());
+}
+
+QString DownloadManager::formatTimeRemaining(qint64 secondsRemaining) {
+    if (secondsRemaining < 0) {
         return "Calculating...";
     }
 
-    qint64 remainingBytes = m_totalBytes - m_bytesReceived;
-    int secondsRemaining = static_cast<int>(remainingBytes / m_downloadSpeed);
-
-    int hours = secondsRemaining / 3600;
-    int minutes = (secondsRemaining % 3600) / 60;
-    int seconds = secondsRemaining % 60;
+    qint64 hours = secondsRemaining / 3600;
+    qint64 minutes = (secondsRemaining % 3600) / 60;
+    qint64 seconds = secondsRemaining % 60;
 
     if (hours > 0) {
         return QString("%1h %2m").arg(hours).arg(minutes);
@@ -254,6 +1324,13 @@ bool DownloadManager::verifyChecksum() {
         return true; // Skip verification if not set
     }
 
+    // The download was already hashed on the fly
+    if (!m_streamedChecksum.isEmpty()) {
+        bool matches = (m_streamedChecksum == m_expectedChecksum.toLower());
+        emit checksumVerified(matches);
+        return matches;
+    }
+
     QFile file(m_destination);
     if (!file.open(QIODevice::ReadOnly)) {
         emit checksumVerified(false);
@@ -8,15 +8,45 @@
 #include <QTimer>
 #include <QElapsedTimer>
 #include <QCryptographicHash>
+#include <QVector>
+#include <QPair>
+#include <QStringList>
+#include "disk_writer.h"
+#include "bandwidth_shaper.h"
+#include "../utils/rate_estimator.h"
 
 class DownloadManager : public QObject {
     Q_OBJECT
 
 public:
+    // Snapshot published once per second through downloadStatsUpdated()
+    struct TransferStats {
+        struct Connection {
+            int segment = 0;
+            QString mirror;
+            qint64 received = 0;
+            qint64 remaining = -1;       // -1 for an open-ended stream
+            double bytesPerSecond = 0.0;  // Smoothed
+            int idleSeconds = 0;
+        };
+
+        qint64 bytesReceived = 0;
+        qint64 totalBytes = 0;
+        double bytesPerSecond = 0.0;         // Smoothed, all connections
+        double averageBytesPerSecond = 0.0;  // This session, resumed bytes excluded
+        qint64 secondsRemaining = -1;        // -1 until there is a rate
+        QVector<Connection> connections;
+    };
+
     explicit DownloadManager(QObject *parent = nullptr);
     ~DownloadManager();
 
     void startDownload(const QString& url, const QString& destination);
+
+    // Re-fetches only the given inclusive byte ranges of an existing file,
+    // e.g. the chunks ImageVerifier reported as corrupt
+    void repairRanges(const QString& url, const QString& filePath,
+                      const QVector<QPair<qint64, qint64>>& ranges);
     void pauseDownload();
     void resumeDownload();
     void cancelDownload();
@@ -27,49 +57,165 @@ public:
     int progressPercentage() const;
     double downloadSpeed() const { return m_downloadSpeed; }
     QString estimatedTimeRemaining() const;
+    // "1h 5m", "3m 20s" or "Calculating..." for a negative estimate
+    static QString formatTimeRemaining(qint64 secondsRemaining);
+    TransferStats stats() const;
+
+    // Alternative URLs for the same file. All candidates are probed, the
+    // download starts on the fastest, and stalled or failing segments move
+    // to the next mirror without losing the bytes they already have.
+    void setMirrorUrls(const QStringList& urls);
+    QStringList mirrorUrls() const { return m_mirrorUrls; }
 
-    // Checksum verification
+    // Segmented downloads: number of concurrent byte-range connections.
+    // A value of 1 disables segmentation.
+    void setSegmentCount(int count);
+    int segmentCount() const { return m_segmentCount; }
+    int activeSegments() const;
+
+    // Checksum verification. With an expected checksum set, the download
+    // is hashed as it arrives and checksumVerified fires after the last
+    // byte, so verifyChecksum() only re-reads files it did not download.
     void setExpectedChecksum(const QString& sha256);
     bool verifyChecksum();
 
+    // Occupancy of the writer thread's buffer ring, for diagnostics
+    DiskWriter::Stats writeStats() const { return m_writer->stats(); }
+
+    // Rate limit shared by all segments; unlimited unless configured.
+    // Several managers can share one shaper to limit them together.
+    BandwidthShaper *bandwidthShaper() const { return m_shaper; }
+    void setBandwidthShaper(BandwidthShaper *shaper);
+
 signals:
     void downloadProgress(qint64 bytesReceived, qint64 totalBytes);
     void downloadFinished(const QString& filePath);
     void downloadError(const QString& error);
     void downloadSpeedUpdated(double bytesPerSecond);
+    void downloadStatsUpdated(const DownloadManager::TransferStats& stats);
     void checksumVerified(bool success);
 
 private slots:
-    void onDownloadProgress(qint64 bytesReceived, qint64 totalBytes);
+    void onProbeReadyRead();
+    void onProbeFinished();
+    void onProbeTimeout();
     void onFinished();
     void onReadyRead();
     void onError(QNetworkReply::NetworkError error);
+    void drainSegments();
+    void onWriteError(const QString& error);
+    void onWriterFlushed(bool ok);
     void updateSpeed();
 
 private:
+    // One byte range of the target file, fetched by its own connection.
+    // end is inclusive; -1 means the length is unknown and the segment
+    // runs until the server closes the stream.
+    struct Segment {
+        qint64 start = 0;
+        qint64 end = -1;
+        qint64 received = 0;
+        QNetworkReply *reply = nullptr;
+        int retryCount = 0;
+        bool rangeChecked = false;
+        int mirror = 0;           // Index into m_mirrors
+        RateEstimator rate;       // This connection only
+        int slowSeconds = 0;      // Consecutive ticks far below its share
+        DiskWriter::Buffer *buffer = nullptr;  // Being filled from reply
+        int bufferAge = 0;          // Seconds since buffer was acquired
+        bool replyFinished = false; // Waiting for a free buffer to drain
+
+        qint64 length() const { return end < 0 ? -1 : end - start + 1; }
+        qint64 offset() const { return start + received; }
+        bool isComplete() const { return end >= 0 && received >= length(); }
+    };
+
+    // A candidate source for the file, as measured by its probe
+    struct Mirror {
+        QString url;
+        QString resolvedUrl;  // Final URL after redirects
+        QNetworkReply *probe = nullptr;
+        QElapsedTimer probeTime;
+        qint64 totalBytes = 0;
+        bool acceptRanges = false;
+        bool responded = false;
+        double probeSpeed = 0.0;  // Bytes per second
+    };
+
     bool supportsResume();
-    void calculateSpeed();
+    qint64 secondsRemaining() const;
+
+    void probeServer();
+    int mirrorForProbe(QNetworkReply *reply) const;
+    void selectMirrors();
+    int nextMirror(int current) const;
+    void switchMirror(int index);
+    void planSegments();
+    bool preallocateFile(qint64 size, bool keepSize);
+    void startSegment(int index);
+    void readSegmentData(int index);
+    void completeSegment(int index);
+    void retrySegment(int index);
+    int segmentForReply(QNetworkReply *reply) const;
+    void abortSegments();
+    // Drops every segment and restarts as one stream from offset 0
+    void fallBackToSingleStream();
+    void finishDownload();
+    void failDownload(const QString& error);
+    void updateBytesReceived();
+
+    void resetTransfer(const QString& url, const QString& destination);
+    bool isRepairing() const { return !m_repairRanges.isEmpty(); }
+
+    bool isHashing() const { return !m_expectedChecksum.isEmpty() && !isRepairing(); }
+
+    bool loadSegmentState(qint64& hashOffset, QByteArray& hashState);
+    void saveSegmentState();
+    QString partPath() const { return m_destination + ".part"; }
+    QString statePath() const { return m_destination + ".part.state"; }
 
     QNetworkAccessManager *m_networkManager;
-    QNetworkReply *m_reply;
     QFile *m_file;
+    DiskWriter *m_writer;
+    bool m_writerStarted;  // m_writer holds this transfer's state
+    BandwidthShaper *m_shaper;
+    int m_drainStart;
 
     QString m_url;
+    QStringList m_mirrorUrls;
+    QVector<Mirror> m_mirrors;  // Usable sources, fastest first
+    int m_probesPending;
+    QTimer *m_probeTimeout;
     QString m_destination;
     QString m_expectedChecksum;
+    QString m_streamedChecksum;  // Digest of the last completed download
+
+    QVector<Segment> m_segments;
+    QVector<QPair<qint64, qint64>> m_repairRanges;
+    int m_segmentCount;
+    bool m_acceptRanges;
 
     bool m_isDownloading;
+    bool m_finishing;  // Waiting for the writer to flush the last data
     qint64 m_bytesReceived;
     qint64 m_totalBytes;
     qint64 m_resumedBytes;  // Bytes already downloaded when resuming
-    qint64 m_previousBytes;
+    RateEstimator m_rate;  // All connections
     double m_downloadSpeed;
 
     QTimer *m_speedTimer;
     QElapsedTimer m_downloadTime;
 
-    int m_retryCount;
     static const int MAX_RETRIES = 3;
+    static const int DEFAULT_SEGMENTS = 4;
+    static const int STALL_SECONDS = 15;
+    static const int SLOW_RATIO = 8;  // Slower than share / SLOW_RATIO is slow
+    static constexpr qint64 NSECS_PER_SEC = 1000 * 1000 * 1000;
+    static const int PROBE_TIMEOUT_MS = 10000;
+    static constexpr qint64 PROBE_SIZE = 256 * 1024;  // 256KB
+    static constexpr qint64 MIN_SEGMENT_SIZE = 16 * 1024 * 1024;  // 16MB
+    static constexpr qint64 READ_BUFFER_SIZE = 1024 * 1024;  // Per reply, 1MB
+    static const int BUFFER_MAX_AGE = 2;  // Seconds before a partial buffer is written
 };
 
 #endif // DOWNLOAD_MANAGER_H
@@ -0,0 +1,418 @@
+#include "download_queue.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QDebug>
+#include <algorithm>
+
+QJsonObject DownloadQueue::Job::toJson() const {
+    QJsonObject json;
+    json["id"] = id;
+    json["url"] = url;
+    json["destination"] = destination;
+    if (!sha256.isEmpty()) {
+        json["sha256"] = sha256;
+    }
+    if (!mirrors.isEmpty()) {
+        json["mirrors"] = QJsonArray::fromStringList(mirrors);
+    }
+    json["priority"] = priority;
+    json["state"] = stateName(state);
+    json["bytesReceived"] = bytesReceived;
+    json["totalBytes"] = totalBytes;
+    if (!error.isEmpty()) {
+        json["error"] = error;
+    }
+    json["created"] = created.toString(Qt::ISODate);
+    return json;
+}
+
+DownloadQueue::Job DownloadQueue::Job::fromJson(const QJsonObject& json) {
+    Job job;
+    job.id = json["id"].toInt();
+    job.url = json["url"].toString();
+    job.destination = json["destination"].toString();
+    job.sha256 = json["sha256"].toString();
+    for (const QJsonValue& value : json["mirrors"].toArray()) {
+        job.mirrors << value.toString();
+    }
+    job.priority = json["priority"].toInt();
+    job.state = stateFromName(json["state"].toString());
+    job.bytesReceived = json["bytesReceived"].toVariant().toLongLong();
+    job.totalBytes = json["totalBytes"].toVariant().toLongLong();
+    job.error = json["error"].toString();
+    job.created = QDateTime::fromString(json["created"].toString(), Qt::ISODate);
+    return job;
+}
+
+DownloadQueue::DownloadQueue(const QString& statePath, QObject *parent)
+    : QObject(parent),
+      m_statePath(statePath),
+      m_shaper(new BandwidthShaper(this)),
+      m_maxConcurrent(DEFAULT_CONCURRENT),
+      m_nextId(1) {
+}
+
+DownloadQueue::~DownloadQueue() {
+    // Running jobs stay Active on disk and keep their .part state, so the
+    // next start picks them up again
+    for (DownloadManager *worker : m_workers) {
+        worker->disconnect(this);
+        worker->pauseDownload();
+    }
+}
+
+bool DownloadQueue::load() {
+    if (m_statePath.isEmpty()) {
+        return false;
+    }
+
+    QFile file(m_statePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    m_nextId = qMax(1, root["nextId"].toInt(1));
+    m_jobs.clear();
+
+    for (const QJsonValue& value : root["jobs"].toArray()) {
+        Job job = Job::fromJson(value.toObject());
+        if (job.id <= 0 || job.url.isEmpty() || job.destination.isEmpty()) {
+            continue;
+        }
+
+        // Interrupted by a crash or restart: continue from the .part state
+        if (job.state == Active) {
+            job.state = Queued;
+        }
+        m_nextId = qMax(m_nextId, job.id + 1);
+        m_jobs.append(job);
+    }
+
+    qDebug() << "Loaded" << m_jobs.size() << "download job(s) from" << m_statePath;
+    schedule();
+    return true;
+}
+
+int DownloadQueue::enqueue(const QString& url, const QString& destination,
+                           const QString& sha256, int priority, const QStringList& mirrors) {
+    for (const Job& existing : m_jobs) {
+        if (!existing.isFinished() && existing.destination == destination) {
+            qWarning() << "Job" << existing.id << "already downloads to" << destination;
+            return -1;
+        }
+    }
+
+    Job job;
+    job.id = m_nextId++;
+    job.url = url;
+    job.destination = destination;
+    job.sha256 = sha256;
+    job.mirrors = mirrors;
+    job.priority = priority;
+    job.created = QDateTime::currentDateTimeUtc();
+    m_jobs.append(job);
+
+    save();
+    emit jobAdded(job.id);
+
+    schedule();
+    return job.id;
+}
+
+bool DownloadQueue::pause(int id) {
+    int index = indexOf(id);
+    if (index < 0 || m_jobs[index].isFinished() || m_jobs[index].state == Paused) {
+        return false;
+    }
+
+    stopWorker(id, false);
+    setState(m_jobs[index], Paused);
+    schedule();
+    return true;
+}
+
+bool DownloadQueue::resume(int id) {
+    int index = indexOf(id);
+    if (index < 0 || (m_jobs[index].state != Paused && m_jobs[index].state != Failed)) {
+        return false;
+    }
+
+    setState(m_jobs[index], Queued);
+    schedule();
+    return true;
+}
+
+bool DownloadQueue::cancel(int id) {
+    int index = indexOf(id);
+    if (index < 0 || m_jobs[index].isFinished()) {
+        return false;
+    }
+
+    if (m_workers.contains(id)) {
+        stopWorker(id, true);
+    } else {
+        // Paused jobs still have their partial download on disk
+        QFile::remove(m_jobs[index].destination + ".part");
+        QFile::remove(m_jobs[index].destination + ".part.state");
+    }
+
+    setState(m_jobs[index], Cancelled);
+    schedule();
+    return true;
+}
+
+bool DownloadQueue::setPriority(int id, int priority) {
+    int index = indexOf(id);
+    if (index < 0) {
+        return false;
+    }
+
+    // Takes effect the next time a worker is free; running jobs continue
+    m_jobs[index].priority = priority;
+    save();
+    return true;
+}
+
+void DownloadQueue::clearFinished() {
+    m_jobs.erase(std::remove_if(m_jobs.begin(), m_jobs.end(),
+                                [](const Job& job) { return job.isFinished(); }),
+                 m_jobs.end());
+    save();
+}
+
+void DownloadQueue::setMaxConcurrent(int count) {
+    m_maxConcurrent = qBound(1, count, 8);
+    schedule();
+}
+
+DownloadQueue::Job DownloadQueue::job(int id) const {
+    int index = indexOf(id);
+    return index >= 0 ? m_jobs[index] : Job();
+}
+
+bool DownloadQueue::isIdle() const {
+    if (!m_workers.isEmpty()) {
+        return false;
+    }
+    for (const Job& job : m_jobs) {
+        if (job.state == Queued) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DownloadManager::TransferStats DownloadQueue::stats(int id) const {
+    DownloadManager *worker = m_workers.value(id);
+    return worker ? worker->stats() : DownloadManager::TransferStats();
+}
+
+int DownloadQueue::indexOf(int id) const {
+    for (int i = 0; i < m_jobs.size(); ++i) {
+        if (m_jobs[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void DownloadQueue::schedule() {
+    while (m_workers.size() < m_maxConcurrent) {
+        // Highest priority first, oldest first within a priority
+        int best = -1;
+        for (int i = 0; i < m_jobs.size(); ++i) {
+            if (m_jobs[i].state != Queued) {
+                continue;
+            }
+            if (best < 0 || m_jobs[i].priority > m_jobs[best].priority ||
+                (m_jobs[i].priority == m_jobs[best].priority && m_jobs[i].id < m_jobs[best].id)) {
+                best = i;
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+        startJob(m_jobs[best]);
+    }
+
+    if (isIdle()) {
+        emit idle();
+    }
+}
+
+void DownloadQueue::startJob(Job& job) {
+    int id = job.id;
+
+    DownloadManager *worker = new DownloadManager(this);
+    worker->setBandwidthShaper(m_shaper);
+    worker->setExpectedChecksum(job.sha256);
+    worker->setMirrorUrls(job.mirrors);
+
+    connect(worker, &DownloadManager::downloadProgress, this, [this, id](qint64 received, qint64 total) {
+        int index = indexOf(id);
+        if (index >= 0) {
+            m_jobs[index].bytesReceived = received;
+            m_jobs[index].totalBytes = total;
+        }
+        emit jobProgress(id, received, total);
+    });
+    connect(worker, &DownloadManager::downloadStatsUpdated, this,
+            [this, id](const DownloadManager::TransferStats& stats) {
+        emit jobStatsUpdated(id, stats);
+    });
+    connect(worker, &DownloadManager::downloadFinished, this, [this, id](const QString& filePath) {
+        onWorkerFinished(id, filePath);
+    });
+    connect(worker, &DownloadManager::checksumVerified, this, [this, id](bool success) {
+        onWorkerChecksum(id, success);
+    });
+    connect(worker, &DownloadManager::downloadError, this, [this, id](const QString& error) {
+        onWorkerError(id, error);
+    });
+
+    m_workers.insert(id, worker);
+    setState(job, Active);
+
+    qDebug() << "Starting download job" << id << "(priority" << job.priority << "):" << job.url;
+
+    // May fail synchronously, so nothing may touch job afterwards
+    QString url = job.url;
+    QString destination = job.destination;
+    worker->startDownload(url, destination);
+}
+
+void DownloadQueue::stopWorker(int id, bool cancel) {
+    DownloadManager *worker = m_workers.take(id);
+    if (!worker) {
+        return;
+    }
+
+    worker->disconnect(this);
+    if (cancel) {
+        worker->cancelDownload();
+    } else {
+        worker->pauseDownload();
+    }
+    worker->deleteLater();
+}
+
+void DownloadQueue::releaseWorker(int id) {
+    // Called from the worker's own signals, hence deleteLater
+    DownloadManager *worker = m_workers.take(id);
+    if (worker) {
+        worker->disconnect(this);
+        worker->deleteLater();
+    }
+}
+
+void DownloadQueue::setState(Job& job, State state, const QString& error) {
+    job.state = state;
+    job.error = error;
+    save();
+    emit jobStateChanged(job.id, state);
+}
+
+void DownloadQueue::onWorkerFinished(int id, const QString& filePath) {
+    int index = indexOf(id);
+    if (index < 0 || !m_jobs[index].sha256.isEmpty()) {
+        // Jobs with a checksum complete in onWorkerChecksum()
+        return;
+    }
+
+    releaseWorker(id);
+    m_jobs[index].bytesReceived = m_jobs[index].totalBytes;
+    setState(m_jobs[index], Completed);
+
+    qDebug() << "Download job" << id << "completed:" << filePath;
+    emit jobCompleted(id, filePath);
+    schedule();
+}
+
+void DownloadQueue::onWorkerChecksum(int id, bool success) {
+    int index = indexOf(id);
+    if (index < 0) {
+        return;
+    }
+
+    releaseWorker(id);
+
+    if (!success) {
+        onWorkerError(id, "Checksum verification failed");
+        return;
+    }
+
+    m_jobs[index].bytesReceived = m_jobs[index].totalBytes;
+    setState(m_jobs[index], Completed);
+
+    qDebug() << "Download job" << id << "completed and verified:" << m_jobs[index].destination;
+    emit jobCompleted(id, m_jobs[index].destination);
+    schedule();
+}
+
+void DownloadQueue::onWorkerError(int id, const QString& error) {
+    int index = indexOf(id);
+    if (index < 0) {
+        return;
+    }
+
+    releaseWorker(id);
+    setState(m_jobs[index], Failed, error);
+
+    qWarning() << "Download job" << id << "failed:" << error;
+    emit jobFailed(id, error);
+    schedule();
+}
+
+void DownloadQueue::save() {
+    if (m_statePath.isEmpty()) {
+        return;
+    }
+
+    QJsonArray jobs;
+    for (const Job& job : m_jobs) {
+        jobs.append(job.toJson());
+    }
+
+    QJsonObject root;
+    root["version"] = 1;
+    root["nextId"] = m_nextId;
+    root["jobs"] = jobs;
+
+    QDir().mkpath(QFileInfo(m_statePath).absolutePath());
+
+    QSaveFile file(m_statePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write download queue:" << m_statePath;
+        return;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Indented));
+    file.commit();
+}
+
+QString DownloadQueue::stateName(State state) {
+    switch (state) {
+    case Queued:    return "queued";
+    case Active:    return "active";
+    case Paused:    return "paused";
+    case Completed: return "completed";
+    case Failed:    return "failed";
+    case Cancelled: return "cancelled";
+    }
+    return "queued";
+}
+
+DownloadQueue::State DownloadQueue::stateFromName(const QString& name) {
+    static const State states[] = { Queued, Active, Paused, Completed, Failed, Cancelled };
+    for (State state : states) {
+        if (stateName(state) == name) {
+            return state;
+        }
+    }
+    return Queued;
+}
@@ -0,0 +1,116 @@
+#ifndef DOWNLOAD_QUEUE_H
+#define DOWNLOAD_QUEUE_H
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QMap>
+#include <QDateTime>
+#include <QJsonObject>
+#include "download_manager.h"
+#include "bandwidth_shaper.h"
+
+// Prioritized download jobs run by a pool of DownloadManager workers.
+// The queue is persisted as JSON after every change, so jobs survive a
+// daemon restart; unfinished ones continue from their .part state.
+class DownloadQueue : public QObject {
+    Q_OBJECT
+
+public:
+    enum State {
+        Queued,
+        Active,
+        Paused,
+        Completed,
+        Failed,
+        Cancelled
+    };
+
+    struct Job {
+        int id = 0;
+        QString url;
+        QString destination;
+        QString sha256;
+        QStringList mirrors;
+        int priority = 0;  // Higher runs first
+        State state = Queued;
+        qint64 bytesReceived = 0;
+        qint64 totalBytes = 0;
+        QString error;
+        QDateTime created;
+
+        bool isFinished() const { return state == Completed || state == Failed || state == Cancelled; }
+        QJsonObject toJson() const;
+        static Job fromJson(const QJsonObject& json);
+    };
+
+    // An empty statePath keeps the queue in memory only
+    explicit DownloadQueue(const QString& statePath = QString(), QObject *parent = nullptr);
+    ~DownloadQueue();
+
+    // Restores the saved queue; jobs that were running are queued again
+    bool load();
+
+    // Returns the new job id, or -1 if the destination is already taken
+    // by an unfinished job
+    int enqueue(const QString& url, const QString& destination,
+                const QString& sha256 = QString(), int priority = 0,
+                const QStringList& mirrors = QStringList());
+    bool pause(int id);
+    bool resume(int id);
+    bool cancel(int id);
+    bool setPriority(int id, int priority);
+    // Drops completed, failed and cancelled jobs from the list
+    void clearFinished();
+
+    void setMaxConcurrent(int count);
+    int maxConcurrent() const { return m_maxConcurrent; }
+
+    QVector<Job> jobs() const { return m_jobs; }
+    bool contains(int id) const { return indexOf(id) >= 0; }
+    Job job(int id) const;
+    int activeCount() const { return m_workers.size(); }
+    bool isIdle() const;
+
+    // Worker statistics for an active job
+    DownloadManager::TransferStats stats(int id) const;
+
+    // Shared by all workers, so a limit covers the whole queue
+    BandwidthShaper *bandwidthShaper() const { return m_shaper; }
+
+    static QString stateName(State state);
+    static State stateFromName(const QString& name);
+
+    static const int DEFAULT_CONCURRENT = 2;
+
+signals:
+    void jobAdded(int id);
+    void jobStateChanged(int id, DownloadQueue::State state);
+    void jobProgress(int id, qint64 bytesReceived, qint64 totalBytes);
+    void jobStatsUpdated(int id, const DownloadManager::TransferStats& stats);
+    void jobCompleted(int id, const QString& filePath);
+    void jobFailed(int id, const QString& error);
+    void idle();
+
+private:
+    int indexOf(int id) const;
+    void schedule();
+    void startJob(Job& job);
+    void stopWorker(int id, bool cancel);
+    void releaseWorker(int id);
+    void setState(Job& job, State state, const QString& error = QString());
+    void onWorkerFinished(int id, const QString& filePath);
+    void onWorkerChecksum(int id, bool success);
+    void onWorkerError(int id, const QString& error);
+    void save();
+
+    QString m_statePath;
+    QVector<Job> m_jobs;
+    QMap<int, DownloadManager*> m_workers;
+    BandwidthShaper *m_shaper;
+    int m_maxConcurrent;
+    int m_nextId;
+};
+
+#endif // DOWNLOAD_QUEUE_H
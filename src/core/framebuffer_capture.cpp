@@ -0,0 +1,175 @@
+#include "framebuffer_capture.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QPointer>
+#include <cstring>
+
+FramebufferCapture::FramebufferCapture(QemuManager *manager, QObject *parent)
+    : QObject(parent),
+      m_manager(manager),
+      m_timer(new QTimer(this)),
+      m_workerThread(new QThread(this)),
+      m_worker(new QObject),
+      m_maxFps(DEFAULT_FPS) {
+
+    m_worker->moveToThread(m_workerThread);
+    connect(m_workerThread, &QThread::finished, m_worker, &QObject::deleteLater);
+    m_workerThread->start(QThread::LowPriority);
+
+    m_timer->setInterval(1000 / m_maxFps);
+    connect(m_timer, &QTimer::timeout, this, &FramebufferCapture::captureAll);
+    connect(m_manager, &QemuManager::instanceStopped, this, &FramebufferCapture::onInstanceStopped);
+}
+
+FramebufferCapture::~FramebufferCapture() {
+    // Results still queued for this object are dropped with it
+    m_workerThread->quit();
+    m_workerThread->wait();
+
+    for (const QString& name : m_channels.keys()) {
+        QFile::remove(dumpPath(name));
+    }
+}
+
+void FramebufferCapture::setMaxFps(int fps) {
+    m_maxFps = qBound(1, fps, MAX_FPS);
+    m_timer->setInterval(1000 / m_maxFps);
+}
+
+void FramebufferCapture::start() {
+    m_timer->start();
+}
+
+void FramebufferCapture::stop() {
+    m_timer->stop();
+}
+
+QString FramebufferCapture::dumpPath(const QString& name) const {
+    QString dir = QDir("/dev/shm").exists() ? "/dev/shm" : QDir::tempPath();
+    return QDir(dir).filePath(QString("linuxdroid-%1-%2.ppm")
+                                  .arg(QCoreApplication::applicationPid())
+                                  .arg(QString(name).replace('/', '_')));
+}
+
+void FramebufferCapture::captureAll() {
+    for (VMInstance *vm : m_manager->instances()) {
+        // A paused guest's screen doesn't change
+        if (vm->state() == VMInstance::Running && vm->qmp()->isReady()) {
+            capture(vm);
+        }
+    }
+}
+
+void FramebufferCapture::capture(VMInstance *vm) {
+    QString name = vm->name();
+    Channel& channel = m_channels[name];
+    if (channel.busy) {
+        // The last dump is still being written; skip a frame
+        return;
+    }
+    channel.busy = true;
+
+    QString path = dumpPath(name);
+    QJsonObject arguments;
+    arguments["filename"] = path;
+
+    QPointer<FramebufferCapture> guard(this);
+    vm->qmp()->execute("screendump", arguments,
+                       [guard, name, path](bool ok, const QJsonValue&, const QString& error) {
+        if (!guard || !guard->m_channels.contains(name)) {
+            return;
+        }
+        if (!ok) {
+            qDebug() << name << ": screendump failed:" << error;
+            guard->m_channels[name].busy = false;
+            return;
+        }
+        guard->finishCapture(name, path);
+    });
+}
+
+void FramebufferCapture::finishCapture(const QString& name, const QString& path) {
+    // The channel stays busy until the worker is done, so the next dump
+    // can't overwrite the file while it is read. The previous frame is
+    // shared with the worker read-only.
+    QImage previous = m_channels[name].frame;
+
+    QMetaObject::invokeMethod(m_worker, [this, name, path, previous]() {
+        QImage current(path, "PPM");
+        QVector<QRect> dirty;
+        if (!current.isNull()) {
+            current = current.convertToFormat(QImage::Format_RGB32);
+            if (previous.size() != current.size()) {
+                dirty.append(current.rect());
+            } else {
+                dirty = dirtyTiles(previous, current);
+            }
+        }
+
+        QMetaObject::invokeMethod(this, [this, name, current, dirty]() {
+            applyFrame(name, current, dirty);
+        }, Qt::QueuedConnection);
+    }, Qt::QueuedConnection);
+}
+
+void FramebufferCapture::applyFrame(const QString& name, const QImage& frame,
+                                    const QVector<QRect>& dirty) {
+    auto it = m_channels.find(name);
+    if (it == m_channels.end()) {
+        return;
+    }
+    it->busy = false;
+
+    if (frame.isNull() || dirty.isEmpty()) {
+        return;
+    }
+
+    it->frame = frame;
+    emit frameUpdated(name, frame, dirty);
+}
+
+QVector<QRect> FramebufferCapture::dirtyTiles(const QImage& previous, const QImage& current) {
+    QVector<QRect> dirty;
+    int width = current.width();
+    int height = current.height();
+
+    for (int top = 0; top < height; top += TILE_SIZE) {
+        int rows = qMin(TILE_SIZE, height - top);
+        QRect run;
+
+        for (int left = 0; left < width; left += TILE_SIZE) {
+            int columns = qMin(TILE_SIZE, width - left);
+            size_t bytes = static_cast<size_t>(columns) * 4;
+
+            bool changed = false;
+            for (int y = top; y < top + rows && !changed; ++y) {
+                const uchar *a = previous.constScanLine(y) + left * 4;
+                const uchar *b = current.constScanLine(y) + left * 4;
+                changed = std::memcmp(a, b, bytes) != 0;
+            }
+
+            // Neighbouring dirty tiles in a row become one rectangle
+            if (changed) {
+                run = run.united(QRect(left, top, columns, rows));
+            } else if (!run.isNull()) {
+                dirty.append(run);
+                run = QRect();
+            }
+        }
+
+        if (!run.isNull()) {
+            dirty.append(run);
+        }
+    }
+
+    return dirty;
+}
+
+void FramebufferCapture::onInstanceStopped(const QString& name) {
+    if (m_channels.remove(name) > 0) {
+        QFile::remove(dumpPath(name));
+        emit frameRemoved(name);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef FRAMEBUFFER_CAPTURE_H
+#define FRAMEBUFFER_CAPTURE_H
+
+#include <QObject>
+#include <QImage>
+#include <QMap>
+#include <QRect>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+#include "qemu_manager.h"
+
+// Pulls the framebuffers of all running instances for thumbnails, without
+// a window per VM. Each frame is a QMP screendump into shared memory
+// (/dev/shm), read back as raw PPM and compared tile by tile with the
+// previous one on a worker thread; only frames with changes are passed
+// on, together with the changed rectangles. Every instance has at most one
+// dump in flight and is captured at most maxFps times a second.
+class FramebufferCapture : public QObject {
+    Q_OBJECT
+
+public:
+    explicit FramebufferCapture(QemuManager *manager, QObject *parent = nullptr);
+    ~FramebufferCapture();
+
+    void setMaxFps(int fps);
+    int maxFps() const { return m_maxFps; }
+
+    void start();
+    void stop();
+
+    // Last frame of an instance, null if none was captured yet
+    QImage frame(const QString& name) const { return m_channels.value(name).frame; }
+
+    static const int DEFAULT_FPS = 2;
+    static constexpr int MAX_FPS = 30;
+    // Edge of the square tiles frames are compared in
+    static constexpr int TILE_SIZE = 64;
+
+    // Changed tiles between two frames of the same size, merged into rows
+    static QVector<QRect> dirtyTiles(const QImage& previous, const QImage& current);
+
+signals:
+    // dirty is in frame coordinates
+    void frameUpdated(const QString& name, const QImage& frame, const QVector<QRect>& dirty);
+    void frameRemoved(const QString& name);
+
+private slots:
+    void captureAll();
+    void onInstanceStopped(const QString& name);
+
+private:
+    struct Channel {
+        QImage frame;
+        bool busy = false;
+    };
+
+    void capture(VMInstance *vm);
+    // Hands the dump to the worker thread for decoding and diffing
+    void finishCapture(const QString& name, const QString& path);
+    void applyFrame(const QString& name, const QImage& frame, const QVector<QRect>& dirty);
+    QString dumpPath(const QString& name) const;
+
+    QemuManager *m_manager;
+    QTimer *m_timer;
+    QThread *m_workerThread;
+    QObject *m_worker;  // Lives in m_workerThread; runs the decode jobs
+    int m_maxFps;
+    QMap<QString, Channel> m_channels;
+};
+
+#endif // FRAMEBUFFER_CAPTURE_H
@@ -0,0 +1,325 @@
+#include "image_verifier.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCryptographicHash>
+#include <QThread>
+#include <QMutex>
+#include <QDebug>
+#include <vector>
+
+// Shared between the worker threads of one run. Each chunk index is
+// claimed by exactly one worker, so the hash slots need no locking.
+struct ImageVerifier::Job {
+    enum Mode { Create, Verify };
+
+    Mode mode = Create;
+    QString path;
+    qint64 fileSize = 0;
+    qint64 chunkSize = 0;
+    int chunkCount = 0;
+    Manifest expected;
+
+    std::vector<QByteArray> hashes;
+    std::atomic<int> nextChunk{0};
+    std::atomic<int> pendingWorkers{0};
+    std::atomic<qint64> bytesHashed{0};
+    std::atomic<bool> failed{false};
+
+    QMutex errorMutex;
+    QString errorMessage;
+};
+
+namespace {
+
+const int READ_SIZE = 1024 * 1024;
+
+// RFC 6962 style domain separation keeps leaves and inner nodes distinct
+const char LEAF_PREFIX = 0x00;
+const char NODE_PREFIX = 0x01;
+
+} // namespace
+
+bool ImageVerifier::Manifest::isValid() const {
+    if (fileSize < 0 || chunkSize <= 0) {
+        return false;
+    }
+    qint64 expectedChunks = (fileSize + chunkSize - 1) / chunkSize;
+    return chunkHashes.size() == expectedChunks;
+}
+
+ImageVerifier::ImageVerifier(QObject *parent)
+    : QObject(parent), m_cancelled(false), m_busy(false) {
+    m_pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+ImageVerifier::~ImageVerifier() {
+    cancel();
+    m_pool.waitForDone();
+}
+
+void ImageVerifier::createManifest(const QString& imagePath, qint64 chunkSize) {
+    if (m_busy) {
+        emit error("Verification already in progress");
+        return;
+    }
+
+    QFileInfo info(imagePath);
+    if (!info.exists() || chunkSize <= 0) {
+        emit error("Image not found: " + imagePath);
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->mode = Job::Create;
+    job->path = imagePath;
+    job->fileSize = info.size();
+    job->chunkSize = chunkSize;
+    job->chunkCount = static_cast<int>((job->fileSize + chunkSize - 1) / chunkSize);
+
+    startJob(job);
+}
+
+void ImageVerifier::verify(const QString& imagePath) {
+    if (m_busy) {
+        emit error("Verification already in progress");
+        return;
+    }
+
+    Manifest manifest;
+    if (!loadManifest(manifestPath(imagePath), manifest)) {
+        emit error("No valid manifest for " + imagePath);
+        return;
+    }
+
+    QFileInfo info(imagePath);
+    if (!info.exists() || info.size() != manifest.fileSize) {
+        emit error(QString("Image size %1 does not match manifest size %2")
+                       .arg(info.size()).arg(manifest.fileSize));
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->mode = Job::Verify;
+    job->path = imagePath;
+    job->fileSize = manifest.fileSize;
+    job->chunkSize = manifest.chunkSize;
+    job->chunkCount = manifest.chunkCount();
+    job->expected = manifest;
+
+    startJob(job);
+}
+
+void ImageVerifier::cancel() {
+    m_cancelled = true;
+}
+
+void ImageVerifier::startJob(const std::shared_ptr<Job>& job) {
+    m_busy = true;
+    m_cancelled = false;
+    job->hashes.resize(job->chunkCount);
+
+    int workers = qBound(1, job->chunkCount, m_pool.maxThreadCount());
+    job->pendingWorkers = workers;
+
+    qDebug() << "Hashing" << job->chunkCount << "chunks of" << job->path
+             << "on" << workers << "threads";
+
+    for (int i = 0; i < workers; ++i) {
+        m_pool.start([this, job]() { runWorker(job); });
+    }
+}
+
+void ImageVerifier::runWorker(const std::shared_ptr<Job>& job) {
+    QFile file(job->path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        QMutexLocker locker(&job->errorMutex);
+        job->errorMessage = "Cannot open image: " + file.errorString();
+        job->failed = true;
+    }
+
+    QByteArray buffer(READ_SIZE, Qt::Uninitialized);
+
+    while (!job->failed && !m_cancelled) {
+        int index = job->nextChunk++;
+        if (index >= job->chunkCount) {
+            break;
+        }
+
+        qint64 offset = index * job->chunkSize;
+        qint64 remaining = qMin(job->chunkSize, job->fileSize - offset);
+        qint64 chunkBytes = remaining;
+
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        hash.addData(QByteArray(1, LEAF_PREFIX));
+
+        if (!file.seek(offset)) {
+            remaining = -1;
+        }
+        while (remaining > 0) {
+            qint64 n = file.read(buffer.data(), qMin<qint64>(remaining, READ_SIZE));
+            if (n <= 0) {
+                break;
+            }
+            hash.addData(QByteArray::fromRawData(buffer.constData(), static_cast<int>(n)));
+            remaining -= n;
+        }
+
+        if (remaining != 0) {
+            QMutexLocker locker(&job->errorMutex);
+            job->errorMessage = QString("Read error in chunk %1: %2").arg(index).arg(file.errorString());
+            job->failed = true;
+            break;
+        }
+
+        job->hashes[index] = hash.result();
+        qint64 done = (job->bytesHashed += chunkBytes);
+
+        QMetaObject::invokeMethod(this, [this, done, job]() {
+            emit progress(done, job->fileSize);
+        }, Qt::QueuedConnection);
+    }
+
+    if (--job->pendingWorkers == 0) {
+        QMetaObject::invokeMethod(this, [this, job]() { finishJob(job); }, Qt::QueuedConnection);
+    }
+}
+
+void ImageVerifier::finishJob(const std::shared_ptr<Job>& job) {
+    m_busy = false;
+
+    if (m_cancelled) {
+        emit error("Verification cancelled");
+        return;
+    }
+
+    if (job->failed) {
+        emit error(job->errorMessage);
+        return;
+    }
+
+    QVector<QByteArray> hashes(job->hashes.begin(), job->hashes.end());
+
+    if (job->mode == Job::Create) {
+        Manifest manifest;
+        manifest.fileSize = job->fileSize;
+        manifest.chunkSize = job->chunkSize;
+        manifest.chunkHashes = hashes;
+        manifest.rootHash = merkleRoot(hashes);
+
+        if (!saveManifest(manifestPath(job->path), manifest)) {
+            emit error("Cannot write manifest for " + job->path);
+            return;
+        }
+
+        qDebug() << "Manifest created:" << job->path << manifest.rootHash.toHex();
+        emit manifestCreated(job->path, manifest.rootHash);
+        return;
+    }
+
+    QVector<int> badChunks;
+    for (int i = 0; i < hashes.size(); ++i) {
+        if (hashes[i] != job->expected.chunkHashes[i]) {
+            badChunks.append(i);
+        }
+    }
+
+    qDebug() << "Verification of" << job->path << (badChunks.isEmpty() ? "SUCCESS" : "FAILED")
+             << "-" << badChunks.size() << "bad chunk(s)";
+    emit verificationFinished(job->path, badChunks.isEmpty(), badChunks);
+}
+
+QByteArray ImageVerifier::merkleRoot(const QVector<QByteArray>& leaves) {
+    if (leaves.isEmpty()) {
+        return QCryptographicHash::hash(QByteArray(), QCryptographicHash::Sha256);
+    }
+
+    QVector<QByteArray> level = leaves;
+    while (level.size() > 1) {
+        QVector<QByteArray> next;
+        for (int i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                // Odd node is promoted unchanged
+                next.append(level[i]);
+                continue;
+            }
+            QCryptographicHash hash(QCryptographicHash::Sha256);
+            hash.addData(QByteArray(1, NODE_PREFIX));
+            hash.addData(level[i]);
+            hash.addData(level[i + 1]);
+            next.append(hash.result());
+        }
+        level = next;
+    }
+    return level.first();
+}
+
+QVector<QPair<qint64, qint64>> ImageVerifier::rangesForChunks(const Manifest& manifest,
+                                                              const QVector<int>& chunks) {
+    QVector<QPair<qint64, qint64>> ranges;
+    for (int index : chunks) {
+        qint64 start = index * manifest.chunkSize;
+        qint64 end = qMin(start + manifest.chunkSize, manifest.fileSize) - 1;
+
+        if (!ranges.isEmpty() && ranges.last().second + 1 == start) {
+            ranges.last().second = end;
+        } else {
+            ranges.append(qMakePair(start, end));
+        }
+    }
+    return ranges;
+}
+
+bool ImageVerifier::loadManifest(const QString& path, Manifest& manifest) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonObject json = QJsonDocument::fromJson(file.readAll()).object();
+    if (json["algorithm"].toString() != "sha256") {
+        return false;
+    }
+
+    Manifest loaded;
+    loaded.fileSize = json["fileSize"].toVariant().toLongLong();
+    loaded.chunkSize = json["chunkSize"].toVariant().toLongLong();
+    loaded.rootHash = QByteArray::fromHex(json["root"].toString().toLatin1());
+    for (const QJsonValue& value : json["chunks"].toArray()) {
+        loaded.chunkHashes.append(QByteArray::fromHex(value.toString().toLatin1()));
+    }
+
+    // A manifest whose root doesn't match its own leaves was tampered with
+    if (!loaded.isValid() || merkleRoot(loaded.chunkHashes) != loaded.rootHash) {
+        qWarning() << "Invalid manifest:" << path;
+        return false;
+    }
+
+    manifest = loaded;
+    return true;
+}
+
+bool ImageVerifier::saveManifest(const QString& path, const Manifest& manifest) {
+    QJsonArray chunks;
+    for (const QByteArray& hash : manifest.chunkHashes) {
+        chunks.append(QString(hash.toHex()));
+    }
+
+    QJsonObject json;
+    json["version"] = 1;
+    json["algorithm"] = "sha256";
+    json["fileSize"] = manifest.fileSize;
+    json["chunkSize"] = manifest.chunkSize;
+    json["root"] = QString(manifest.rootHash.toHex());
+    json["chunks"] = chunks;
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(QJsonDocument(json).toJson(QJsonDocument::Indented));
+    return file.commit();
+}
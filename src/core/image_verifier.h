@@ -0,0 +1,68 @@
+#ifndef IMAGE_VERIFIER_H
+#define IMAGE_VERIFIER_H
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+#include <QPair>
+#include <QThreadPool>
+#include <atomic>
+#include <memory>
+
+// Chunked, multi-threaded image verification. An image is split into
+// fixed-size chunks whose SHA-256 hashes are combined into a Merkle root
+// and stored next to the image as <image>.merkle. Re-verification hashes
+// all chunks in parallel and reports exactly which ones are corrupt, so
+// DownloadManager::repairRanges() can re-fetch just those byte ranges.
+class ImageVerifier : public QObject {
+    Q_OBJECT
+
+public:
+    struct Manifest {
+        qint64 fileSize = 0;
+        qint64 chunkSize = 0;
+        QVector<QByteArray> chunkHashes;
+        QByteArray rootHash;
+
+        int chunkCount() const { return chunkHashes.size(); }
+        bool isValid() const;
+    };
+
+    explicit ImageVerifier(QObject *parent = nullptr);
+    ~ImageVerifier();
+
+    void createManifest(const QString& imagePath, qint64 chunkSize = DEFAULT_CHUNK_SIZE);
+    void verify(const QString& imagePath);
+    void cancel();
+    bool isBusy() const { return m_busy; }
+
+    static QString manifestPath(const QString& imagePath) { return imagePath + ".merkle"; }
+    static bool loadManifest(const QString& path, Manifest& manifest);
+    static bool saveManifest(const QString& path, const Manifest& manifest);
+    static QByteArray merkleRoot(const QVector<QByteArray>& leaves);
+
+    // Inclusive byte ranges covering the given chunks, adjacent ones merged
+    static QVector<QPair<qint64, qint64>> rangesForChunks(const Manifest& manifest,
+                                                          const QVector<int>& chunks);
+
+    static constexpr qint64 DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;  // 4MB
+
+signals:
+    void progress(qint64 bytesHashed, qint64 totalBytes);
+    void manifestCreated(const QString& imagePath, const QByteArray& rootHash);
+    void verificationFinished(const QString& imagePath, bool success, const QVector<int>& badChunks);
+    void error(const QString& message);
+
+private:
+    struct Job;
+
+    void startJob(const std::shared_ptr<Job>& job);
+    void runWorker(const std::shared_ptr<Job>& job);
+    void finishJob(const std::shared_ptr<Job>& job);
+
+    QThreadPool m_pool;
+    std::atomic<bool> m_cancelled;
+    bool m_busy;
+};
+
+#endif // IMAGE_VERIFIER_H
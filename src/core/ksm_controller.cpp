@@ -0,0 +1,164 @@
+#include "ksm_controller.h"
+#include <QDebug>
+#include <QFile>
+#include <unistd.h>
+
+namespace {
+
+const QString KSM_PATH = "/sys/kernel/mm/ksm/";
+
+qint64 readValue(const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+    return file.readAll().trimmed().toLongLong();
+}
+
+} // namespace
+
+KsmController::KsmController(QemuManager *manager, QObject *parent)
+    : QObject(parent),
+      m_manager(manager),
+      m_timer(new QTimer(this)),
+      m_running(false),
+      m_warnedReadOnly(false) {
+
+    m_timer->setInterval(STATS_INTERVAL_MS);
+    connect(m_timer, &QTimer::timeout, this, &KsmController::update);
+
+    connect(m_manager, &QemuManager::instanceStarted, this, &KsmController::retune);
+    connect(m_manager, &QemuManager::instanceStopped, this, &KsmController::retune);
+}
+
+KsmController::~KsmController() {
+    restoreSettings();
+}
+
+void KsmController::start() {
+    m_running = true;
+    retune();
+    update();
+    m_timer->start();
+}
+
+void KsmController::stop() {
+    m_running = false;
+    m_timer->stop();
+    restoreSettings();
+}
+
+qint64 KsmController::savedMB() const {
+    return pagesToMB(m_hostStats.pagesSharing);
+}
+
+qint64 KsmController::pagesToMB(qint64 pages) {
+    return pages * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+int KsmController::mergingInstanceCount() const {
+    int count = 0;
+    for (VMInstance *vm : m_manager->instances()) {
+        if (vm->isActive() && vm->config().memoryMerge()) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void KsmController::retune() {
+    if (!m_running) {
+        return;
+    }
+
+    int count = mergingInstanceCount();
+    if (count < MIN_INSTANCES) {
+        restoreSettings();
+        return;
+    }
+
+    // Scan faster the more guests there are to compare
+    qint64 pagesToScan = qMin(PAGES_PER_INSTANCE * count, MAX_PAGES_TO_SCAN);
+    if (writeSetting("sleep_millisecs", SCAN_SLEEP_MS) &&
+        writeSetting("pages_to_scan", pagesToScan) &&
+        writeSetting("run", 1)) {
+        qDebug() << "KSM scanning" << pagesToScan << "pages every" << SCAN_SLEEP_MS
+                 << "ms for" << count << "instances";
+    }
+}
+
+bool KsmController::writeSetting(const QString& name, qint64 value) {
+    qint64 current = readValue(KSM_PATH + name);
+    if (current == value) {
+        return true;
+    }
+
+    QFile file(KSM_PATH + name);
+    if (!file.open(QIODevice::WriteOnly) || file.write(QByteArray::number(value)) < 0) {
+        if (!m_warnedReadOnly) {
+            qWarning() << "Cannot tune KSM (" << file.errorString() << "), only reporting";
+            m_warnedReadOnly = true;
+        }
+        return false;
+    }
+
+    if (!m_savedSettings.contains(name)) {
+        m_savedSettings.insert(name, current);
+    }
+    return true;
+}
+
+void KsmController::restoreSettings() {
+    // run last, so the scanner stops before it slows down
+    static const char *order[] = { "sleep_millisecs", "pages_to_scan", "run" };
+    for (const char *name : order) {
+        if (m_savedSettings.contains(name)) {
+            QFile file(KSM_PATH + name);
+            if (file.open(QIODevice::WriteOnly)) {
+                file.write(QByteArray::number(m_savedSettings.value(name)));
+            }
+        }
+    }
+    m_savedSettings.clear();
+}
+
+void KsmController::update() {
+    HostStats host;
+    host.running = readValue(KSM_PATH + "run") == 1;
+    host.pagesShared = readValue(KSM_PATH + "pages_shared");
+    host.pagesSharing = readValue(KSM_PATH + "pages_sharing");
+    host.pagesUnshared = readValue(KSM_PATH + "pages_unshared");
+    host.pagesVolatile = readValue(KSM_PATH + "pages_volatile");
+    host.fullScans = readValue(KSM_PATH + "full_scans");
+    m_hostStats = host;
+
+    m_instanceStats.clear();
+    for (VMInstance *vm : m_manager->instances()) {
+        int pid = vm->pid();
+        if (pid <= 0 || !vm->config().memoryMerge()) {
+            continue;
+        }
+
+        // ksm_stat (Linux 6.1+) lists "name value" pairs
+        QMap<QString, qint64> values;
+        QFile file(QString("/proc/%1/ksm_stat").arg(pid));
+        if (!file.open(QIODevice::ReadOnly)) {
+            continue;
+        }
+        for (const QByteArray& line : file.readAll().split('\n')) {
+            QList<QByteArray> parts = line.simplified().split(' ');
+            if (parts.size() == 2) {
+                values.insert(QString::fromUtf8(parts[0]), parts[1].toLongLong());
+            }
+        }
+
+        InstanceStats stats;
+        stats.mergingPages = values.value("ksm_merging_pages",
+                                          readValue(QString("/proc/%1/ksm_merging_pages").arg(pid)));
+        stats.unmergedPages = qMax<qint64>(0, values.value("ksm_rmap_items") - stats.mergingPages);
+        stats.profitBytes = values.value("ksm_process_profit");
+        m_instanceStats.insert(vm->name(), stats);
+    }
+
+    emit statsUpdated();
+}
@@ -0,0 +1,75 @@
+#ifndef KSM_CONTROLLER_H
+#define KSM_CONTROLLER_H
+
+#include <QObject>
+#include <QMap>
+#include <QTimer>
+#include "qemu_manager.h"
+
+// Deduplicates identical guest memory across instances with the kernel's
+// samepage merging. Instances mark their RAM mergeable (mem-merge); while
+// two or more of them run, the controller switches KSM on and scales its
+// scan rate with their number, and puts the host's own settings back when
+// fewer are left. Tuning needs write access to /sys/kernel/mm/ksm; without
+// it the controller only reports.
+class KsmController : public QObject {
+    Q_OBJECT
+
+public:
+    struct HostStats {
+        bool running = false;
+        qint64 pagesShared = 0;     // Deduplicated pages in use
+        qint64 pagesSharing = 0;    // Sites sharing them, i.e. pages saved
+        qint64 pagesUnshared = 0;   // Unique pages being checked repeatedly
+        qint64 pagesVolatile = 0;   // Changing too fast to merge
+        qint64 fullScans = 0;
+    };
+
+    struct InstanceStats {
+        qint64 mergingPages = 0;    // Guest pages backed by a shared page
+        qint64 unmergedPages = 0;   // Scanned but still unique
+        qint64 profitBytes = 0;     // Memory saved minus KSM's overhead
+    };
+
+    explicit KsmController(QemuManager *manager, QObject *parent = nullptr);
+    ~KsmController();
+
+    void start();
+    void stop();
+
+    HostStats hostStats() const { return m_hostStats; }
+    InstanceStats instanceStats(const QString& name) const { return m_instanceStats.value(name); }
+    // Memory saved by sharing, in MB
+    qint64 savedMB() const;
+
+    static qint64 pagesToMB(qint64 pages);
+
+    // Instances needed before merging is worth a scanner thread
+    static const int MIN_INSTANCES = 2;
+    static constexpr int PAGES_PER_INSTANCE = 256;
+    static constexpr int MAX_PAGES_TO_SCAN = 2048;
+    static const int SCAN_SLEEP_MS = 20;
+    static const int STATS_INTERVAL_MS = 10000;
+
+signals:
+    void statsUpdated();
+
+private slots:
+    void update();
+    void retune();
+
+private:
+    int mergingInstanceCount() const;
+    bool writeSetting(const QString& name, qint64 value);
+    void restoreSettings();
+
+    QemuManager *m_manager;
+    QTimer *m_timer;
+    HostStats m_hostStats;
+    QMap<QString, InstanceStats> m_instanceStats;
+    QMap<QString, qint64> m_savedSettings;  // Host values before we tuned
+    bool m_running;
+    bool m_warnedReadOnly;
+};
+
+#endif // KSM_CONTROLLER_H
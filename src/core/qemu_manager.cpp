@@ -1,183 +1,180 @@
 #include "qemu_manager.h"
 #include "vm_config.h"
 #include <QDebug>
-#include <QFile>
-#include <QStandardPaths>
+#include <QTcpServer>
 
 QemuManager::QemuManager(QObject *parent)
-    : QObject(parent), m_isRunning(false) {
-    m_process = std::make_unique<QProcess>(this);
-
-    connect(m_process.get(), &QProcess::readyReadStandardOutput,
-            this, &QemuManager::handleProcessOutput);
-    connect(m_process.get(), &QProcess::readyReadStandardError,
-            this, &QemuManager::handleProcessError);
-    connect(m_process.get(), QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
-            this, &QemuManager::handleProcessFinished);
+    : QObject(parent), m_topology(HostTopology::detect()) {
+    qDebug() << "Host topology:" << m_topology.cpuCount() << "CPU(s) on"
+             << m_topology.nodeCount() << "NUMA node(s)";
 }
 
 QemuManager::~QemuManager() {
-    if (m_isRunning) {
-        stopVM();
-    }
-}
-
-bool QemuManager::checkQemuAvailable() {
-    QProcess check;
-    check.start("which", QStringList() << "qemu-system-x86_64");
-    check.waitForFinished();
-    return check.exitCode() == 0;
-}
-
-bool QemuManager::verifyKVMSupport() {
-    return QFile::exists("/dev/kvm");
+    // Instances are children; their destructors stop QEMU
+    qDeleteAll(m_instances);
 }
 
-bool QemuManager::startVM(const VMConfig& config) {
-    if (m_isRunning) {
-        m_lastError = "VM is already running";
-        emit vmError(m_lastError);
-        return false;
+VMInstance *QemuManager::startVM(const VMConfig& config, const QString& incomingState) {
+    VMInstance *vm = m_instances.value(config.name());
+    if (vm && vm->isActive()) {
+        emit instanceError(config.name(), "VM is already running");
+        return nullptr;
     }
 
-    if (!checkQemuAvailable()) {
-        m_lastError = "QEMU not found. Please install qemu-system-x86";
-        emit vmError(m_lastError);
-        return false;
+    // The config may have changed since the last run
+    if (vm) {
+        removeInstance(config.name());
     }
 
-    if (!verifyKVMSupport()) {
-        qWarning() << "KVM not available. Performance will be reduced.";
+    int port = allocatePort();
+    if (port < 0) {
+        emit instanceError(config.name(), "No free host port for adb forwarding");
+        return nullptr;
     }
 
-    QStringList args = buildQemuCommand(config);
-
-    qDebug() << "Starting QEMU with args:" << args;
-    m_process->start("qemu-system-x86_64", args);
-
-    if (!m_process->waitForStarted(5000)) {
-        m_lastError = "Failed to start QEMU process";
-        emit vmError(m_lastError);
-        return false;
+    vm = new VMInstance(config, port, this);
+    m_instances.insert(config.name(), vm);
+    vm->setPlacement(allocateCpus(config));
+
+    QString name = config.name();
+    connect(vm, &VMInstance::stateChanged, this, [this, name](VMInstance::State state) {
+        emit instanceStateChanged(name, state);
+    });
+    connect(vm, &VMInstance::started, this, [this, name]() {
+        emit instanceStarted(name);
+    });
+    connect(vm, &VMInstance::stopped, this, [this, name]() {
+        m_cpuReservations.remove(name);
+        emit instanceStopped(name);
+    });
+    connect(vm, &VMInstance::error, this, [this, name, vm](const QString& error) {
+        emit instanceError(name, error);
+        // Nothing will stop, so the CPUs and the adb port are given back here
+        if (vm->failedToStart()) {
+            removeInstance(name);
+        }
+    });
+
+    vm->setIncomingState(incomingState);
+    if (!vm->start()) {
+        removeInstance(name);
+        return nullptr;
     }
 
-    m_isRunning = true;
-    emit vmStarted();
-    return true;
+    qDebug() << "Started" << name << "- adb on port" << port << "-"
+             << runningCount() << "instance(s) running";
+    return vm;
 }
 
-QStringList QemuManager::buildQemuCommand(const VMConfig& config) {
-    QStringList args;
-
-    // Enable KVM if available
-    if (verifyKVMSupport()) {
-        args << "-enable-kvm";
+void QemuManager::stopVM(const QString& name) {
+    if (VMInstance *vm = instance(name)) {
+        vm->stop();
     }
-
-    // CPU configuration
-    args << "-cpu" << "host";
-    args << "-smp" << QString::number(config.cpuCores());
-
-    // Memory
-    args << "-m" << QString::number(config.ramMB()) + "M";
-
-    // Display
-    args << "-vga" << "virtio";
-    args << "-display" << "gtk,gl=on";
-
-    // Boot from image
-    args << "-cdrom" << config.imagePath();
-
-    // Disk image for persistent storage
-    if (!config.diskPath().isEmpty()) {
-        args << "-drive" << "file=" + config.diskPath() + ",if=virtio";
-    }
-
-    // Network
-    args << "-netdev" << "user,id=net0,hostfwd=tcp::5555-:5555";
-    args << "-device" << "virtio-net-pci,netdev=net0";
-
-    // Audio
-    args << "-device" << "intel-hda";
-    args << "-device" << "hda-duplex";
-
-    // USB support
-    args << "-usb";
-    args << "-device" << "usb-tablet";
-
-    // Boot order
-    args << "-boot" << "d";
-
-    return args;
 }
 
-void QemuManager::stopVM() {
-    if (!m_isRunning) {
-        return;
+void QemuManager::pauseVM(const QString& name) {
+    if (VMInstance *vm = instance(name)) {
+        vm->pause();
     }
+}
 
-    m_process->terminate();
-
-    if (!m_process->waitForFinished(5000)) {
-        m_process->kill();
-        m_process->waitForFinished();
+void QemuManager::resumeVM(const QString& name) {
+    if (VMInstance *vm = instance(name)) {
+        vm->resume();
     }
-
-    m_isRunning = false;
-    emit vmStopped();
 }
 
-void QemuManager::pauseVM() {
-    if (m_isRunning) {
-        m_process->write("stop\n");
+void QemuManager::stopAll() {
+    for (VMInstance *vm : m_instances) {
+        vm->stop();
     }
 }
 
-void QemuManager::resumeVM() {
-    if (m_isRunning) {
-        m_process->write("cont\n");
+int QemuManager::runningCount() const {
+    int count = 0;
+    for (VMInstance *vm : m_instances) {
+        if (vm->isActive()) {
+            count++;
+        }
     }
+    return count;
 }
 
-bool QemuManager::isRunning() const {
-    return m_isRunning;
+bool QemuManager::isRunning(const QString& name) const {
+    VMInstance *vm = instance(name);
+    return vm && vm->isActive();
 }
 
-QString QemuManager::getStatus() const {
-    if (m_isRunning) {
-        return "Running";
-    } else if (!m_lastError.isEmpty()) {
-        return "Error: " + m_lastError;
+QString QemuManager::getStatus(const QString& name) const {
+    VMInstance *vm = instance(name);
+    if (!vm) {
+        return "Stopped";
     }
-    return "Stopped";
+    if (vm->state() == VMInstance::Error) {
+        return "Error: " + vm->errorString();
+    }
+    return VMInstance::stateName(vm->state());
 }
 
-int QemuManager::getVMPid() const {
-    if (m_isRunning) {
-        return m_process->processId();
+void QemuManager::removeInstance(const QString& name) {
+    VMInstance *vm = m_instances.value(name);
+    if (!vm || vm->isActive()) {
+        return;
     }
-    return -1;
+
+    m_instances.remove(name);
+    m_cpuReservations.remove(name);
+    releasePort(vm->adbPort());
+    vm->deleteLater();
 }
 
-void QemuManager::handleProcessOutput() {
-    QString output = QString::fromUtf8(m_process->readAllStandardOutput());
-    emit outputReceived(output);
-    qDebug() << "QEMU output:" << output;
+int QemuManager::allocatePort() {
+    for (int port = ADB_PORT_FIRST; port <= ADB_PORT_LAST; port += 2) {
+        if (m_usedPorts.contains(port)) {
+            continue;
+        }
+
+        // Also skip ports taken by something else, e.g. an SDK emulator
+        QTcpServer probe;
+        if (!probe.listen(QHostAddress::Any, port)) {
+            continue;
+        }
+        probe.close();
+
+        m_usedPorts.insert(port);
+        return port;
+    }
+    return -1;
 }
 
-void QemuManager::handleProcessError() {
-    QString error = QString::fromUtf8(m_process->readAllStandardError());
-    qWarning() << "QEMU error:" << error;
+void QemuManager::releasePort(int port) {
+    m_usedPorts.remove(port);
 }
 
-void QemuManager::handleProcessFinished(int exitCode) {
-    m_isRunning = false;
-    qDebug() << "QEMU process finished with exit code:" << exitCode;
+HostTopology::Placement QemuManager::allocateCpus(const VMConfig& config) {
+    if (!config.cpuPinning()) {
+        return HostTopology::Placement();
+    }
 
-    if (exitCode != 0) {
-        m_lastError = "QEMU exited with code " + QString::number(exitCode);
-        emit vmError(m_lastError);
+    // Instances never share host CPUs; when there aren't enough left the
+    // new one floats instead
+    HostTopology::Placement placement =
+        m_topology.place(config.cpuCores(), config.ramMB(), reservedCpus());
+    if (!placement.isValid()) {
+        qDebug() << config.name() << "not pinned: no" << config.cpuCores() << "free host CPUs";
+        return placement;
     }
 
-    emit vmStopped();
+    m_cpuReservations.insert(config.name(), placement.cpus);
+    return placement;
+}
+
+QSet<int> QemuManager::reservedCpus() const {
+    QSet<int> reserved;
+    for (const QVector<int>& cpus : m_cpuReservations) {
+        for (int cpu : cpus) {
+            reserved.insert(cpu);
+        }
+    }
+    return reserved;
 }
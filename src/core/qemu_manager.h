@@ -2,12 +2,16 @@
 #define QEMU_MANAGER_H
 
 #include <QString>
-#include <QProcess>
 #include <QObject>
-#include <memory>
+#include <QMap>
+#include <QSet>
+#include "vm_instance.h"
+#include "../utils/host_topology.h"
 
 class VMConfig;
 
+// Supervises any number of Android VMs at once. Each instance has its own
+// QEMU process, QMP channel and host ports; instances are keyed by name.
 class QemuManager : public QObject {
     Q_OBJECT
 
@@ -15,33 +19,46 @@ public:
     explicit QemuManager(QObject *parent = nullptr);
     ~QemuManager();
 
-    bool startVM(const VMConfig& config);
-    void stopVM();
-    void pauseVM();
-    void resumeVM();
-    bool isRunning() const;
-    QString getStatus() const;
-    int getVMPid() const;
+    // Starts an instance for config, replacing a stopped one of the same
+    // name. With incomingState the VM loads that saved state and stays
+    // paused instead of booting.
+    VMInstance *startVM(const VMConfig& config, const QString& incomingState = QString());
+    void stopVM(const QString& name);
+    void pauseVM(const QString& name);
+    void resumeVM(const QString& name);
+    void stopAll();
 
-signals:
-    void vmStarted();
-    void vmStopped();
-    void vmError(const QString& error);
-    void outputReceived(const QString& output);
+    VMInstance *instance(const QString& name) const { return m_instances.value(name); }
+    QList<VMInstance*> instances() const { return m_instances.values(); }
+    int runningCount() const;
+    bool isRunning(const QString& name) const;
+    QString getStatus(const QString& name) const;
+    // Forgets a stopped instance, e.g. after it was deleted
+    void removeInstance(const QString& name);
+
+    const HostTopology& topology() const { return m_topology; }
 
-private slots:
-    void handleProcessOutput();
-    void handleProcessError();
-    void handleProcessFinished(int exitCode);
+    // Host ports forwarded to the guest's adbd, two apart like the SDK
+    // emulator's console/adb pairs
+    static const int ADB_PORT_FIRST = 5555;
+    static const int ADB_PORT_LAST = 5685;
+
+signals:
+    void instanceStarted(const QString& name);
+    void instanceStopped(const QString& name);
+    void instanceStateChanged(const QString& name, VMInstance::State state);
+    void instanceError(const QString& name, const QString& error);
 
 private:
-    bool checkQemuAvailable();
-    QStringList buildQemuCommand(const VMConfig& config);
-    bool verifyKVMSupport();
+    int allocatePort();
+    void releasePort(int port);
+    HostTopology::Placement allocateCpus(const VMConfig& config);
+    QSet<int> reservedCpus() const;
 
-    std::unique_ptr<QProcess> m_process;
-    bool m_isRunning;
-    QString m_lastError;
+    QMap<QString, VMInstance*> m_instances;
+    QSet<int> m_usedPorts;
+    HostTopology m_topology;
+    QMap<QString, QVector<int>> m_cpuReservations;  // Instance name -> host CPUs
 };
 
 #endif // QEMU_MANAGER_H
@@ -0,0 +1,323 @@
+#include "qmp_client.h"
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QDateTime>
+#include <QDebug>
+
+namespace {
+
+// Lets QEMU keep reading the socket while a slow in-band command runs
+const char *const WANTED_CAPABILITIES[] = { "oob" };
+
+const char CAPABILITIES_ID[] = "qmp_capabilities";
+
+} // namespace
+
+QmpClient::QmpClient(QObject *parent)
+    : QObject(parent),
+      m_socket(new QLocalSocket(this)),
+      m_retryTimer(new QTimer(this)),
+      m_state(Unconnected),
+      m_deadline(0),
+      m_nextId(1) {
+
+    m_retryTimer->setSingleShot(true);
+    connect(m_retryTimer, &QTimer::timeout, this, &QmpClient::tryConnect);
+
+    connect(m_socket, &QLocalSocket::connected, this, &QmpClient::onConnected);
+    connect(m_socket, &QLocalSocket::readyRead, this, &QmpClient::onReadyRead);
+    connect(m_socket, &QLocalSocket::disconnected, this, &QmpClient::onDisconnected);
+    connect(m_socket, &QLocalSocket::errorOccurred, this, &QmpClient::onSocketError);
+}
+
+QmpClient::~QmpClient() {
+    // Callbacks may reference objects that are being destroyed too
+    m_state = Unconnected;
+    m_inFlight.clear();
+    m_outgoing.clear();
+    m_socket->abort();
+}
+
+void QmpClient::connectToSocket(const QString& path, int timeoutMs) {
+    disconnectFromQemu();
+
+    m_path = path;
+    m_deadline = QDateTime::currentMSecsSinceEpoch() + timeoutMs;
+    m_state = Connecting;
+    tryConnect();
+}
+
+void QmpClient::disconnectFromQemu() {
+    m_retryTimer->stop();
+    if (m_state == Unconnected) {
+        return;
+    }
+
+    m_state = Unconnected;
+    m_socket->abort();
+    failAll("QMP connection closed");
+}
+
+int QmpClient::execute(const QString& command, const QJsonObject& arguments, Callback callback) {
+    Command cmd;
+    cmd.id = m_nextId++;
+    cmd.name = command;
+    cmd.arguments = arguments;
+    cmd.callback = callback;
+
+    if (m_state == Unconnected) {
+        // Report asynchronously, like every other outcome
+        QMetaObject::invokeMethod(this, [this, cmd]() {
+            finishCommand(cmd, false, QJsonValue(), "Not connected to QEMU");
+        }, Qt::QueuedConnection);
+        return cmd.id;
+    }
+
+    m_outgoing.enqueue(cmd);
+    sendCommands();
+    return cmd.id;
+}
+
+int QmpClient::executeHuman(const QString& commandLine, Callback callback) {
+    QJsonObject arguments;
+    arguments["command-line"] = commandLine;
+    return execute("human-monitor-command", arguments, callback);
+}
+
+void QmpClient::tryConnect() {
+    if (m_state != Connecting) {
+        return;
+    }
+    m_socket->abort();
+    m_retryTimer->stop();
+    m_socket->connectToServer(m_path);
+}
+
+void QmpClient::onConnected() {
+    // Nothing is sent until QEMU's greeting arrives
+    qDebug() << "QMP connected:" << m_path;
+}
+
+void QmpClient::onSocketError(QLocalSocket::LocalSocketError error) {
+    if (m_state != Connecting) {
+        return;
+    }
+
+    // The socket doesn't exist yet, or QEMU isn't accepting on it yet
+    bool notYet = (error == QLocalSocket::ServerNotFoundError ||
+                   error == QLocalSocket::ConnectionRefusedError);
+    if (notYet && QDateTime::currentMSecsSinceEpoch() < m_deadline) {
+        m_retryTimer->start(RETRY_INTERVAL_MS);
+        return;
+    }
+
+    QString message = "Cannot connect to QMP socket " + m_path + ": " + m_socket->errorString();
+    qWarning() << message;
+    m_state = Unconnected;
+    failAll(message);
+    emit connectionFailed(message);
+}
+
+void QmpClient::onDisconnected() {
+    if (m_state == Unconnected) {
+        return;
+    }
+
+    // Closed before the greeting; QEMU may still be starting up
+    if (m_state == Connecting) {
+        if (QDateTime::currentMSecsSinceEpoch() < m_deadline) {
+            m_retryTimer->start(RETRY_INTERVAL_MS);
+        } else {
+            QString message = "QMP socket closed before the greeting: " + m_path;
+            m_state = Unconnected;
+            failAll(message);
+            emit connectionFailed(message);
+        }
+        return;
+    }
+
+    qDebug() << "QMP disconnected:" << m_path;
+    m_state = Unconnected;
+    failAll("QMP connection closed");
+    emit disconnected();
+}
+
+void QmpClient::onReadyRead() {
+    while (m_socket->canReadLine()) {
+        QByteArray line = m_socket->readLine().trimmed();
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        QJsonParseError error;
+        QJsonDocument document = QJsonDocument::fromJson(line, &error);
+        if (error.error != QJsonParseError::NoError || !document.isObject()) {
+            qWarning() << "Malformed QMP message:" << line.left(200);
+            continue;
+        }
+
+        handleMessage(document.object());
+        if (m_state == Unconnected) {
+            return;
+        }
+    }
+}
+
+void QmpClient::handleMessage(const QJsonObject& message) {
+    if (message.contains("QMP")) {
+        handleGreeting(message["QMP"].toObject());
+        return;
+    }
+
+    if (message.contains("event")) {
+        handleEvent(message);
+        return;
+    }
+
+    bool ok = message.contains("return");
+    QJsonValue result = message["return"];
+    QString error;
+    if (!ok) {
+        QJsonObject errorObject = message["error"].toObject();
+        error = errorObject["desc"].toString();
+        if (error.isEmpty()) {
+            error = errorObject["class"].toString("Unknown QMP error");
+        }
+    }
+
+    QJsonValue id = message["id"];
+    if (m_state == Negotiating && id.toString() == CAPABILITIES_ID) {
+        if (!ok) {
+            QString failure = "QMP capabilities negotiation failed: " + error;
+            qWarning() << failure;
+            m_state = Unconnected;
+            m_socket->abort();
+            failAll(failure);
+            emit connectionFailed(failure);
+            return;
+        }
+
+        m_state = Ready;
+        qDebug() << "QMP ready, QEMU" << m_version << "capabilities" << m_enabledCapabilities;
+        emit ready();
+        sendCommands();
+        return;
+    }
+
+    auto it = m_inFlight.find(id.toInt(-1));
+    if (it == m_inFlight.end()) {
+        qWarning() << "QMP reply for unknown command:" << id;
+        return;
+    }
+
+    Command command = it.value();
+    m_inFlight.erase(it);
+    finishCommand(command, ok, result, error);
+    sendCommands();
+}
+
+void QmpClient::handleGreeting(const QJsonObject& greeting) {
+    if (m_state != Connecting) {
+        return;
+    }
+
+    QJsonObject version = greeting["version"].toObject()["qemu"].toObject();
+    m_version = QString("%1.%2.%3").arg(version["major"].toInt())
+                                   .arg(version["minor"].toInt())
+                                   .arg(version["micro"].toInt());
+
+    m_serverCapabilities.clear();
+    for (const QJsonValue& value : greeting["capabilities"].toArray()) {
+        m_serverCapabilities << value.toString();
+    }
+
+    // Only what both sides support is enabled
+    m_enabledCapabilities.clear();
+    for (const char *capability : WANTED_CAPABILITIES) {
+        if (m_serverCapabilities.contains(capability)) {
+            m_enabledCapabilities << capability;
+        }
+    }
+
+    QJsonObject request;
+    request["execute"] = "qmp_capabilities";
+    request["id"] = CAPABILITIES_ID;
+    if (!m_enabledCapabilities.isEmpty()) {
+        QJsonObject arguments;
+        arguments["enable"] = QJsonArray::fromStringList(m_enabledCapabilities);
+        request["arguments"] = arguments;
+    }
+
+    m_state = Negotiating;
+    write(request);
+}
+
+void QmpClient::handleEvent(const QJsonObject& message) {
+    QString event = message["event"].toString();
+    QJsonObject data = message["data"].toObject();
+    QJsonObject timestamp = message["timestamp"].toObject();
+    qint64 usecs = timestamp["seconds"].toInteger() * 1000000 + timestamp["microseconds"].toInteger();
+
+    emit eventReceived(event, data, usecs);
+
+    if (event == "STOP") {
+        emit stopped();
+    } else if (event == "RESUME") {
+        emit resumed();
+    } else if (event == "SHUTDOWN") {
+        emit shutdown(data["guest"].toBool(), data["reason"].toString());
+    } else if (event == "POWERDOWN") {
+        emit powerdown();
+    } else if (event.startsWith("BLOCK_JOB_") || event == "JOB_STATUS_CHANGE") {
+        emit blockJobEvent(event, data);
+    }
+}
+
+void QmpClient::finishCommand(const Command& command, bool ok, const QJsonValue& result,
+                              const QString& error) {
+    if (!ok) {
+        qWarning() << "QMP command" << command.name << "failed:" << error;
+    }
+    if (command.callback) {
+        command.callback(ok, result, error);
+    }
+    emit commandFinished(command.id, ok, result, error);
+}
+
+void QmpClient::sendCommands() {
+    if (m_state != Ready) {
+        return;
+    }
+
+    // Pipelined: several commands are on the wire at once, matched to
+    // their replies by id
+    while (!m_outgoing.isEmpty() && m_inFlight.size() < MAX_IN_FLIGHT) {
+        Command command = m_outgoing.dequeue();
+
+        QJsonObject request;
+        request["execute"] = command.name;
+        request["id"] = command.id;
+        if (!command.arguments.isEmpty()) {
+            request["arguments"] = command.arguments;
+        }
+
+        m_inFlight.insert(command.id, command);
+        write(request);
+    }
+}
+
+void QmpClient::write(const QJsonObject& message) {
+    m_socket->write(QJsonDocument(message).toJson(QJsonDocument::Compact) + "\r\n");
+}
+
+void QmpClient::failAll(const QString& error) {
+    QList<Command> commands = m_inFlight.values();
+    while (!m_outgoing.isEmpty()) {
+        commands.append(m_outgoing.dequeue());
+    }
+    m_inFlight.clear();
+
+    for (const Command& command : commands) {
+        finishCommand(command, false, QJsonValue(), error);
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef QMP_CLIENT_H
+#define QMP_CLIENT_H
+
+#include <QObject>
+#include <QLocalSocket>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QStringList>
+#include <QQueue>
+#include <QMap>
+#include <QTimer>
+#include <functional>
+
+// Asynchronous QEMU Machine Protocol client over the Unix socket created
+// by "-qmp unix:<path>,server=on,wait=off". After the greeting the client
+// negotiates capabilities, then pipelines commands (tagged with an id so
+// replies can be matched) and reports asynchronous events. Nothing here
+// blocks the event loop.
+class QmpClient : public QObject {
+    Q_OBJECT
+
+public:
+    // ok is false when QEMU returned an error or the connection closed
+    // before the reply arrived; result is the "return" value otherwise
+    using Callback = std::function<void(bool ok, const QJsonValue& result, const QString& error)>;
+
+    explicit QmpClient(QObject *parent = nullptr);
+    ~QmpClient();
+
+    // QEMU creates the socket some time after the process starts, so the
+    // connection is retried until timeoutMs has passed
+    void connectToSocket(const QString& path, int timeoutMs = 10000);
+    void disconnectFromQemu();
+
+    // Capabilities negotiated, commands are being executed
+    bool isReady() const { return m_state == Ready; }
+    QString socketPath() const { return m_path; }
+    // QEMU version from the greeting, e.g. "8.2.1"
+    QString qemuVersion() const { return m_version; }
+    // Capabilities QEMU offered and those that were enabled
+    QStringList serverCapabilities() const { return m_serverCapabilities; }
+    QStringList enabledCapabilities() const { return m_enabledCapabilities; }
+
+    // Queues a command and returns its id. Commands issued before the
+    // handshake finishes are sent once it does.
+    int execute(const QString& command, const QJsonObject& arguments = QJsonObject(),
+                Callback callback = nullptr);
+    // Runs an arbitrary monitor command through human-monitor-command
+    int executeHuman(const QString& commandLine, Callback callback = nullptr);
+
+    int pendingCommands() const { return m_inFlight.size() + m_outgoing.size(); }
+
+    // QEMU processes a limited number of in-band commands at a time
+    static const int MAX_IN_FLIGHT = 8;
+    static const int RETRY_INTERVAL_MS = 100;
+
+signals:
+    void ready();
+    void connectionFailed(const QString& error);
+    void disconnected();
+
+    void commandFinished(int id, bool ok, const QJsonValue& result, const QString& error);
+
+    // Every event; the typed signals below cover the common ones
+    void eventReceived(const QString& event, const QJsonObject& data, qint64 timestampUsecs);
+    void stopped();
+    void resumed();
+    void shutdown(bool guest, const QString& reason);
+    void powerdown();
+    // BLOCK_JOB_COMPLETED, BLOCK_JOB_CANCELLED, BLOCK_JOB_ERROR, BLOCK_JOB_READY
+    // and JOB_STATUS_CHANGE
+    void blockJobEvent(const QString& event, const QJsonObject& data);
+
+private slots:
+    void tryConnect();
+    void onConnected();
+    void onReadyRead();
+    void onDisconnected();
+    void onSocketError(QLocalSocket::LocalSocketError error);
+
+private:
+    enum State {
+        Unconnected,
+        Connecting,
+        Negotiating,  // Greeting received, qmp_capabilities sent
+        Ready
+    };
+
+    struct Command {
+        int id = 0;
+        QString name;
+        QJsonObject arguments;
+        Callback callback;
+    };
+
+    void handleMessage(const QJsonObject& message);
+    void handleGreeting(const QJsonObject& greeting);
+    void handleEvent(const QJsonObject& message);
+    void finishCommand(const Command& command, bool ok, const QJsonValue& result,
+                       const QString& error);
+    void sendCommands();
+    void write(const QJsonObject& message);
+    void failAll(const QString& error);
+
+    QLocalSocket *m_socket;
+    QTimer *m_retryTimer;
+    State m_state;
+    QString m_path;
+    qint64 m_deadline;
+
+    QString m_version;
+    QStringList m_serverCapabilities;
+    QStringList m_enabledCapabilities;
+
+    QQueue<Command> m_outgoing;
+    QMap<int, Command> m_inFlight;
+    int m_nextId;
+};
+
+#endif // QMP_CLIENT_H
@@ -1,7 +1,9 @@
 #include "vm_config.h"
+#include "disk_image_manager.h"
 #include <QFile>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QCryptographicHash>
 #include <QThread>
 #include <QSysInfo>
 #include <QStorageInfo>
@@ -12,7 +14,21 @@ VMConfig::VMConfig()
     : m_cpuCores(2),
       m_ramMB(4096),
       m_resolution(1920, 1080),
-      m_rootEnabled(false) {
+      m_dpi(0),
+      m_rootEnabled(false),
+      m_fastBoot(true),
+      m_cpuPinning(true),
+      m_directBoot(true),
+      m_memoryBacking(DefaultMemory),
+      m_memoryPrealloc(false),
+      m_memoryBalloon(true),
+      m_memoryMerge(true),
+      m_diskAio(AutoAio),
+      m_diskCache(AutoCache),
+      m_diskIothread(true),
+      m_diskDiscard(true),
+      m_networkMode(UserNetwork),
+      m_displayBackend(GtkDisplay) {
 }
 
 VMConfig::VMConfig(const QString& configPath) : VMConfig() {
@@ -57,7 +73,22 @@ QJsonObject VMConfig::toJson() const {
     json["ramMB"] = m_ramMB;
     json["resolutionWidth"] = m_resolution.width();
     json["resolutionHeight"] = m_resolution.height();
+    json["dpi"] = m_dpi;
     json["rootEnabled"] = m_rootEnabled;
+    json["fastBoot"] = m_fastBoot;
+    json["cpuPinning"] = m_cpuPinning;
+    json["directBoot"] = m_directBoot;
+    json["memoryBacking"] = memoryBackingName(m_memoryBacking);
+    json["memoryPrealloc"] = m_memoryPrealloc;
+    json["memoryBalloon"] = m_memoryBalloon;
+    json["memoryMerge"] = m_memoryMerge;
+    json["diskAio"] = diskAioName(m_diskAio);
+    json["diskCache"] = diskCacheName(m_diskCache);
+    json["diskIothread"] = m_diskIothread;
+    json["diskDiscard"] = m_diskDiscard;
+    json["networkMode"] = networkModeName(m_networkMode);
+    json["tapDevice"] = m_tapDevice;
+    json["displayBackend"] = displayBackendName(m_displayBackend);
     return json;
 }
 
@@ -72,8 +103,57 @@ void VMConfig::fromJson(const QJsonObject& json) {
     int width = json["resolutionWidth"].toInt(1920);
     int height = json["resolutionHeight"].toInt(1080);
     m_resolution = QSize(width, height);
+    m_dpi = json["dpi"].toInt(0);
 
     m_rootEnabled = json["rootEnabled"].toBool(false);
+    m_fastBoot = json["fastBoot"].toBool(true);
+    m_cpuPinning = json["cpuPinning"].toBool(true);
+    m_directBoot = json["directBoot"].toBool(true);
+    m_memoryBacking = memoryBackingFromName(json["memoryBacking"].toString());
+    m_memoryPrealloc = json["memoryPrealloc"].toBool(false);
+    m_memoryBalloon = json["memoryBalloon"].toBool(true);
+    m_memoryMerge = json["memoryMerge"].toBool(true);
+    m_diskAio = diskAioFromName(json["diskAio"].toString());
+    m_diskCache = diskCacheFromName(json["diskCache"].toString());
+    m_diskIothread = json["diskIothread"].toBool(true);
+    m_diskDiscard = json["diskDiscard"].toBool(true);
+    m_networkMode = networkModeFromName(json["networkMode"].toString());
+    m_tapDevice = json["tapDevice"].toString();
+    m_displayBackend = displayBackendFromName(json["displayBackend"].toString());
+}
+
+QString VMConfig::snapshotFingerprint() const {
+    // Bump when the generated QEMU machine changes in a way that breaks
+    // restoring older snapshots
+    // 2: disk attached as an explicit multi-queue virtio-blk-pci device
+    // 3: virtio-balloon
+    // 4: GPU added with -device, sized to the resolution
+    // 5: DPI counts for directly booted kernels
+    const int MACHINE_VERSION = 5;
+
+    QJsonObject json = toJson();
+    json.remove("name");
+    json.remove("instancePath");
+    json.remove("fastBoot");
+    json.remove("cpuPinning");
+    json.remove("memoryBacking");
+    json.remove("memoryPrealloc");
+    // The machine depends on how the VM actually boots. A directly booted
+    // kernel gets the DPI on its command line, which a snapshot would keep
+    json["directBoot"] = usesDirectBoot();
+    if (!usesDirectBoot()) {
+        json.remove("dpi");
+    }
+    json.remove("memoryMerge");
+    json.remove("diskAio");
+    json.remove("diskCache");
+    json.remove("diskIothread");
+    json.remove("diskDiscard");
+    json.remove("tapDevice");
+    json["machineVersion"] = MACHINE_VERSION;
+
+    QByteArray data = QJsonDocument(json).toJson(QJsonDocument::Compact);
+    return QString(QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex());
 }
 
 bool VMConfig::isValid() const {
@@ -130,6 +210,146 @@ int VMConfig::getMaxCpuCores() {
     return QThread::idealThreadCount();
 }
 
+bool VMConfig::usesDirectBoot() const {
+    return m_directBoot && DiskImageManager::isInstallerImage(m_imagePath) &&
+           DiskImageManager::hasBootFiles(m_imagePath);
+}
+
+QString VMConfig::kernelDisplayArgs() const {
+    // video= sets the framebuffer mode, DPI= is read by Android-x86's init
+    return QString("video=%1x%2 DPI=%3").arg(m_resolution.width()).arg(m_resolution.height()).arg(dpi());
+}
+
+int VMConfig::defaultDpi(const QSize& resolution) {
+    // Android density buckets, by the shorter side of the screen
+    int side = qMin(resolution.width(), resolution.height());
+    if (side <= 480) {
+        return 120;
+    } else if (side <= 540) {
+        return 160;
+    } else if (side <= 720) {
+        return 213;
+    } else if (side <= 1080) {
+        return 320;
+    } else if (side <= 1440) {
+        return 480;
+    }
+    return 640;
+}
+
+QList<VMConfig::DisplayPreset> VMConfig::displayPresets() {
+    return {
+        { "VGA, headless tests", QSize(640, 480) },
+        { "qHD, headless tests", QSize(960, 540) },
+        { "720p", QSize(1280, 720) },
+        { "1080p", QSize(1920, 1080) },
+        { "1440p", QSize(2560, 1440) },
+        { "4K", QSize(3840, 2160) }
+    };
+}
+
+QString VMConfig::memoryBackingName(MemoryBacking backing) {
+    switch (backing) {
+    case DefaultMemory: return "default";
+    case SharedMemory:  return "memfd";
+    case HugePages2M:   return "hugepages-2M";
+    case HugePages1G:   return "hugepages-1G";
+    }
+    return "default";
+}
+
+VMConfig::MemoryBacking VMConfig::memoryBackingFromName(const QString& name) {
+    static const MemoryBacking backings[] = { DefaultMemory, SharedMemory, HugePages2M, HugePages1G };
+    for (MemoryBacking backing : backings) {
+        if (memoryBackingName(backing) == name) {
+            return backing;
+        }
+    }
+    return DefaultMemory;
+}
+
+int VMConfig::hugePageSizeKB(MemoryBacking backing) {
+    switch (backing) {
+    case HugePages2M: return 2 * 1024;
+    case HugePages1G: return 1024 * 1024;
+    default:          return 0;
+    }
+}
+
+QString VMConfig::diskAioName(DiskAio aio) {
+    switch (aio) {
+    case AutoAio:    return "auto";
+    case ThreadsAio: return "threads";
+    case NativeAio:  return "native";
+    case IoUringAio: return "io_uring";
+    }
+    return "auto";
+}
+
+VMConfig::DiskAio VMConfig::diskAioFromName(const QString& name) {
+    static const DiskAio modes[] = { AutoAio, ThreadsAio, NativeAio, IoUringAio };
+    for (DiskAio aio : modes) {
+        if (diskAioName(aio) == name) {
+            return aio;
+        }
+    }
+    return AutoAio;
+}
+
+QString VMConfig::diskCacheName(DiskCache cache) {
+    switch (cache) {
+    case AutoCache:      return "auto";
+    case WritebackCache: return "writeback";
+    case NoCache:        return "none";
+    }
+    return "auto";
+}
+
+VMConfig::DiskCache VMConfig::diskCacheFromName(const QString& name) {
+    static const DiskCache modes[] = { AutoCache, WritebackCache, NoCache };
+    for (DiskCache cache : modes) {
+        if (diskCacheName(cache) == name) {
+            return cache;
+        }
+    }
+    return AutoCache;
+}
+
+QString VMConfig::networkModeName(NetworkMode mode) {
+    switch (mode) {
+    case UserNetwork: return "user";
+    case TapNetwork:  return "tap";
+    }
+    return "user";
+}
+
+VMConfig::NetworkMode VMConfig::networkModeFromName(const QString& name) {
+    return name == "tap" ? TapNetwork : UserNetwork;
+}
+
+QString VMConfig::displayBackendName(DisplayBackend backend) {
+    switch (backend) {
+    case GtkDisplay:         return "gtk";
+    case NoDisplay:          return "none";
+    case VncDisplay:         return "vnc";
+    case SpiceDisplay:       return "spice";
+    case EglHeadlessDisplay: return "egl-headless";
+    }
+    return "gtk";
+}
+
+VMConfig::DisplayBackend VMConfig::displayBackendFromName(const QString& name) {
+    static const DisplayBackend backends[] = {
+        GtkDisplay, NoDisplay, VncDisplay, SpiceDisplay, EglHeadlessDisplay
+    };
+    for (DisplayBackend backend : backends) {
+        if (displayBackendName(backend) == name) {
+            return backend;
+        }
+    }
+    return GtkDisplay;
+}
+
 int VMConfig::getMaxRamMB() {
     // Get total system RAM and reserve 2GB for system
     QFile meminfo("/proc/meminfo");
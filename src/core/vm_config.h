@@ -3,10 +3,51 @@
 
 #include <QString>
 #include <QSize>
+#include <QList>
 #include <QJsonObject>
 
 class VMConfig {
 public:
+    // Where guest RAM comes from
+    enum MemoryBacking {
+        DefaultMemory,  // Anonymous memory, 4K pages
+        SharedMemory,   // memfd, 4K pages
+        HugePages2M,    // memfd on hugetlbfs, 2M pages
+        HugePages1G     // memfd on hugetlbfs, 1G pages
+    };
+
+    // How QEMU submits disk I/O; Auto picks the best one the host supports
+    enum DiskAio {
+        AutoAio,
+        ThreadsAio,     // Thread pool, works everywhere
+        NativeAio,      // Linux AIO, needs the host page cache bypassed
+        IoUringAio      // io_uring, Linux 5.6+
+    };
+
+    enum DiskCache {
+        AutoCache,
+        WritebackCache, // Through the host page cache
+        NoCache         // O_DIRECT, bypasses the host page cache
+    };
+
+    enum NetworkMode {
+        UserNetwork,    // QEMU's built-in user-mode stack (SLIRP)
+        TapNetwork      // Pre-created tap device on a host bridge, vhost-net
+    };
+
+    enum DisplayBackend {
+        GtkDisplay,         // Desktop window, host OpenGL
+        NoDisplay,          // Headless, nothing rendered on the host
+        VncDisplay,         // VNC on a free localhost port
+        SpiceDisplay,       // SPICE on a Unix socket in the instance directory
+        EglHeadlessDisplay  // Host GPU renders, no window (CI with a GPU)
+    };
+
+    struct DisplayPreset {
+        QString name;
+        QSize resolution;
+    };
+
     VMConfig();
     explicit VMConfig(const QString& configPath);
 
@@ -17,8 +58,27 @@ public:
     int cpuCores() const { return m_cpuCores; }
     int ramMB() const { return m_ramMB; }
     QSize resolution() const { return m_resolution; }
+    // Android screen density; derived from the resolution unless set
+    int dpi() const { return m_dpi > 0 ? m_dpi : defaultDpi(m_resolution); }
     bool rootEnabled() const { return m_rootEnabled; }
     QString instancePath() const { return m_instancePath; }
+    bool fastBoot() const { return m_fastBoot; }
+    bool cpuPinning() const { return m_cpuPinning; }
+    bool directBoot() const { return m_directBoot; }
+    // Whether starts boot the ISO's kernel directly, i.e. direct boot is
+    // on and the boot files have been extracted
+    bool usesDirectBoot() const;
+    MemoryBacking memoryBacking() const { return m_memoryBacking; }
+    bool memoryPrealloc() const { return m_memoryPrealloc; }
+    bool memoryBalloon() const { return m_memoryBalloon; }
+    bool memoryMerge() const { return m_memoryMerge; }
+    DiskAio diskAio() const { return m_diskAio; }
+    DiskCache diskCache() const { return m_diskCache; }
+    bool diskIothread() const { return m_diskIothread; }
+    bool diskDiscard() const { return m_diskDiscard; }
+    NetworkMode networkMode() const { return m_networkMode; }
+    QString tapDevice() const { return m_tapDevice; }
+    DisplayBackend displayBackend() const { return m_displayBackend; }
 
     // Setters
     void setName(const QString& name) { m_name = name; }
@@ -27,8 +87,32 @@ public:
     void setCpuCores(int cores) { m_cpuCores = cores; }
     void setRamMB(int mb) { m_ramMB = mb; }
     void setResolution(const QSize& res) { m_resolution = res; }
+    // 0 derives the density from the resolution
+    void setDpi(int dpi) { m_dpi = dpi; }
     void setRootEnabled(bool enabled) { m_rootEnabled = enabled; }
     void setInstancePath(const QString& path) { m_instancePath = path; }
+    void setFastBoot(bool enabled) { m_fastBoot = enabled; }
+    void setCpuPinning(bool enabled) { m_cpuPinning = enabled; }
+    // Boot the kernel extracted from the ISO instead of going through the
+    // BIOS, bootloader and live CD
+    void setDirectBoot(bool enabled) { m_directBoot = enabled; }
+    void setMemoryBacking(MemoryBacking backing) { m_memoryBacking = backing; }
+    // Fault in all guest RAM at start instead of on first touch
+    void setMemoryPrealloc(bool enabled) { m_memoryPrealloc = enabled; }
+    // Let the host take back memory the guest isn't using
+    void setMemoryBalloon(bool enabled) { m_memoryBalloon = enabled; }
+    // Let KSM deduplicate guest RAM; has no effect with hugepages
+    void setMemoryMerge(bool enabled) { m_memoryMerge = enabled; }
+    void setDiskAio(DiskAio aio) { m_diskAio = aio; }
+    void setDiskCache(DiskCache cache) { m_diskCache = cache; }
+    // Run disk I/O on its own thread instead of QEMU's main loop
+    void setDiskIothread(bool enabled) { m_diskIothread = enabled; }
+    // Pass guest TRIM through so the qcow2 overlay shrinks again
+    void setDiskDiscard(bool enabled) { m_diskDiscard = enabled; }
+    void setNetworkMode(NetworkMode mode) { m_networkMode = mode; }
+    // Tap device the instance attaches to in TapNetwork mode
+    void setTapDevice(const QString& device) { m_tapDevice = device; }
+    void setDisplayBackend(DisplayBackend backend) { m_displayBackend = backend; }
 
     // Serialization
     bool loadFromFile(const QString& filePath);
@@ -36,6 +120,10 @@ public:
     QJsonObject toJson() const;
     void fromJson(const QJsonObject& json);
 
+    // Hash of everything that shapes the VM's hardware; a saved VM state
+    // can only be restored into a VM with the same fingerprint
+    QString snapshotFingerprint() const;
+
     // Validation
     bool isValid() const;
     QString validationError() const;
@@ -45,6 +133,27 @@ public:
     static int getMaxCpuCores();
     static int getMaxRamMB();
 
+    // Kernel command line arguments that set the Android display mode
+    QString kernelDisplayArgs() const;
+
+    static int defaultDpi(const QSize& resolution);
+    // Resolutions offered for new instances, smallest first; the low ones
+    // are meant for headless test runs
+    static QList<DisplayPreset> displayPresets();
+
+    static QString memoryBackingName(MemoryBacking backing);
+    static MemoryBacking memoryBackingFromName(const QString& name);
+    // Page size of a hugepage backing in KB, 0 for the others
+    static int hugePageSizeKB(MemoryBacking backing);
+    static QString diskAioName(DiskAio aio);
+    static DiskAio diskAioFromName(const QString& name);
+    static QString diskCacheName(DiskCache cache);
+    static DiskCache diskCacheFromName(const QString& name);
+    static QString networkModeName(NetworkMode mode);
+    static NetworkMode networkModeFromName(const QString& name);
+    static QString displayBackendName(DisplayBackend backend);
+    static DisplayBackend displayBackendFromName(const QString& name);
+
 private:
     QString m_name;
     QString m_imagePath;
@@ -53,7 +162,22 @@ private:
     int m_cpuCores;
     int m_ramMB;
     QSize m_resolution;
+    int m_dpi;
     bool m_rootEnabled;
+    bool m_fastBoot;
+    bool m_cpuPinning;
+    bool m_directBoot;
+    MemoryBacking m_memoryBacking;
+    bool m_memoryPrealloc;
+    bool m_memoryBalloon;
+    bool m_memoryMerge;
+    DiskAio m_diskAio;
+    DiskCache m_diskCache;
+    bool m_diskIothread;
+    bool m_diskDiscard;
+    NetworkMode m_networkMode;
+    QString m_tapDevice;
+    DisplayBackend m_displayBackend;
     QString m_lastError;
 };
 
@@ -0,0 +1,758 @@
+#include "vm_instance.h"
+#include "disk_image_manager.h"
+#include "../utils/system_checker.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QTimer>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QCryptographicHash>
+#include <sched.h>
+
+namespace {
+
+// QEMU option values use ',' as separator; a literal comma is doubled
+QString escapeOption(QString value) {
+    return value.replace(",", ",,");
+}
+
+// exec: migration commands run through /bin/sh; single quotes protect
+// everything but a single quote, which closes, escapes and reopens
+QString shellQuote(QString value) {
+    return "'" + value.replace("'", "'\\''") + "'";
+}
+
+} // namespace
+
+QString VMInstance::stateReadUri(const QString& path) {
+    return "exec:cat " + shellQuote(path);
+}
+
+QString VMInstance::stateWriteUri(const QString& path) {
+    return "exec:cat > " + shellQuote(path);
+}
+
+VMInstance::VMInstance(const VMConfig& config, int adbPort, QObject *parent)
+    : QObject(parent),
+      m_config(config),
+      m_process(new QProcess(this)),
+      m_qmp(new QmpClient(this)),
+      m_bootWatcher(new BootWatcher(this)),
+      m_restoring(false),
+      m_savingSnapshot(false),
+      m_state(Stopped),
+      m_adbPort(adbPort),
+      m_vncPort(-1) {
+
+    connect(m_process, &QProcess::readyReadStandardOutput,
+            this, &VMInstance::handleProcessOutput);
+    connect(m_process, &QProcess::readyReadStandardError,
+            this, &VMInstance::handleProcessError);
+    connect(m_process, &QProcess::finished,
+            this, &VMInstance::handleProcessFinished);
+    connect(m_process, &QProcess::started, this, [this]() {
+        m_qmp->connectToSocket(qmpSocketPath());
+    });
+    connect(m_process, &QProcess::errorOccurred, this, [this](QProcess::ProcessError processError) {
+        if (processError == QProcess::FailedToStart) {
+            fail("Failed to start QEMU process: " + m_process->errorString());
+        }
+    });
+
+    connect(m_qmp, &QmpClient::ready, this, &VMInstance::handleQmpReady);
+    connect(m_qmp, &QmpClient::connectionFailed, this, [this](const QString& qmpError) {
+        // The VM runs without a control channel; pause/resume won't work
+        qWarning() << name() << "- VM control channel unavailable:" << qmpError;
+        if (m_state == Starting) {
+            setState(Running);
+            emit started();
+        }
+    });
+    // State follows QEMU's events, whoever caused the change
+    connect(m_qmp, &QmpClient::stopped, this, [this]() {
+        if (m_state == Running) {
+            setState(Paused);
+        }
+    });
+    connect(m_qmp, &QmpClient::resumed, this, [this]() {
+        if (m_state == Paused) {
+            setState(Running);
+        }
+    });
+    connect(m_qmp, &QmpClient::shutdown, this, [this](bool guest, const QString& reason) {
+        qDebug() << name() << "shutting down:" << reason << (guest ? "(guest)" : "(host)");
+        setState(Stopping);
+    });
+
+    connect(m_bootWatcher, &BootWatcher::bootCompleted, this, &VMInstance::onBootCompleted);
+}
+
+VMInstance::~VMInstance() {
+    if (m_process->state() != QProcess::NotRunning) {
+        m_qmp->disconnectFromQemu();
+        m_process->terminate();
+        if (!m_process->waitForFinished(3000)) {
+            m_process->kill();
+            m_process->waitForFinished();
+        }
+    }
+}
+
+bool VMInstance::start() {
+    if (isActive()) {
+        m_lastError = "VM is already running";
+        emit error(m_lastError);
+        return false;
+    }
+
+    if (QStandardPaths::findExecutable("qemu-system-x86_64").isEmpty()) {
+        fail("QEMU not found. Please install qemu-system-x86");
+        return false;
+    }
+
+    if (!QFile::exists("/dev/kvm")) {
+        qWarning() << "KVM not available. Performance will be reduced.";
+    }
+
+    // A socket left behind by a crashed QEMU would make it fail to start
+    QFile::remove(qmpSocketPath());
+    QFile::remove(spiceSocketPath());
+    m_vncPort = -1;
+
+    m_restoring = m_incomingState.isEmpty() && hasUsableSnapshot();
+    m_startTimer.start();
+
+    QStringList args = buildQemuCommand();
+    qDebug() << "Starting" << name() << "with args:" << args;
+
+    // Every QEMU thread starts out confined to the instance's CPUs;
+    // vCPU threads are narrowed to one CPU each once QMP is up
+    if (m_placement.isValid()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : m_placement.cpus) {
+            CPU_SET(cpu, &set);
+        }
+        m_process->setChildProcessModifier([set]() {
+            ::sched_setaffinity(0, sizeof(set), &set);
+        });
+    } else {
+        m_process->setChildProcessModifier(nullptr);
+    }
+
+    m_lastError.clear();
+    setState(Starting);
+    m_process->start("qemu-system-x86_64", args);
+    return true;
+}
+
+void VMInstance::stop(int timeoutMs) {
+    if (m_process->state() == QProcess::NotRunning) {
+        return;
+    }
+
+    bool guestRunning = m_state == Running && m_qmp->isReady();
+    setState(Stopping);
+    m_bootWatcher->stop();
+
+    // Never block the event loop on one instance while others run
+    if (guestRunning) {
+        // ACPI power button first; QEMU is only terminated if the guest
+        // ignores it for half the timeout
+        m_qmp->execute("system_powerdown");
+        QTimer::singleShot(timeoutMs / 2, this, [this]() {
+            if (m_state == Stopping && m_process->state() != QProcess::NotRunning) {
+                qDebug() << name() << "ignored the power button, terminating QEMU";
+                m_qmp->disconnectFromQemu();
+                m_process->terminate();
+            }
+        });
+    } else {
+        m_qmp->disconnectFromQemu();
+        m_process->terminate();
+    }
+
+    QTimer::singleShot(timeoutMs, this, [this]() {
+        if (m_state == Stopping && m_process->state() != QProcess::NotRunning) {
+            qWarning() << name() << "did not stop in time, killing QEMU";
+            m_process->kill();
+        }
+    });
+}
+
+void VMInstance::pause() {
+    if (m_state == Running) {
+        // Paused follows from the STOP event
+        m_qmp->execute("stop");
+    }
+}
+
+void VMInstance::resume() {
+    if (m_state == Paused) {
+        m_qmp->execute("cont");
+    }
+}
+
+int VMInstance::pid() const {
+    return m_process->state() == QProcess::NotRunning ? -1 : static_cast<int>(m_process->processId());
+}
+
+bool VMInstance::failedToStart() const {
+    return m_state == Error && m_process->state() == QProcess::NotRunning &&
+           m_process->error() == QProcess::FailedToStart;
+}
+
+QString VMInstance::qmpSocketPath() const {
+    return socketPath("qmp");
+}
+
+QString VMInstance::spiceSocketPath() const {
+    return socketPath("spice");
+}
+
+QString VMInstance::socketPath(const QString& kind) const {
+    if (!m_config.instancePath().isEmpty()) {
+        return QDir(m_config.instancePath()).filePath(kind + ".sock");
+    }
+    return QDir(QDir::tempPath()).filePath(
+        QString("linuxdroid-%1-%2-%3.sock").arg(m_adbPort).arg(QString(name()).replace('/', '_')).arg(kind));
+}
+
+QString VMInstance::stateName(State state) {
+    switch (state) {
+    case Stopped:  return "Stopped";
+    case Starting: return "Starting";
+    case Running:  return "Running";
+    case Paused:   return "Paused";
+    case Stopping: return "Stopping";
+    case Error:    return "Error";
+    }
+    return "Stopped";
+}
+
+QStringList VMInstance::memoryBackendArgs() const {
+    qint64 ramMB = m_config.ramMB();
+    VMConfig::MemoryBacking backing = m_config.memoryBacking();
+    int pageKB = VMConfig::hugePageSizeKB(backing);
+
+    // Hugepages are only used when all of guest RAM fits in them; a guest
+    // that starts on 4K pages is better than one that doesn't start
+    if (pageKB > 0) {
+        if ((ramMB * 1024) % pageKB != 0) {
+            qWarning() << name() << ": RAM size is not a multiple of"
+                       << VMConfig::memoryBackingName(backing) << "pages, using regular memory";
+            backing = VMConfig::DefaultMemory;
+        } else if (!SystemChecker::hasFreeHugePages(ramMB, pageKB, m_placement.node)) {
+            qWarning() << name() << ": Not enough free" << VMConfig::memoryBackingName(backing)
+                       << "for" << ramMB << "MB, using regular memory";
+            backing = VMConfig::DefaultMemory;
+        }
+    }
+
+    bool prealloc = m_config.memoryPrealloc();
+    if (backing == VMConfig::DefaultMemory && m_placement.node < 0 && !prealloc) {
+        return QStringList();
+    }
+
+    QString object = QString("%1,id=pc.ram,size=%2M")
+        .arg(backing == VMConfig::DefaultMemory ? "memory-backend-ram" : "memory-backend-memfd")
+        .arg(ramMB);
+    if (backing == VMConfig::HugePages2M || backing == VMConfig::HugePages1G) {
+        object += QString(",hugetlb=on,hugetlbsize=%1").arg(backing == VMConfig::HugePages1G ? "1G" : "2M");
+    }
+
+    // Keep guest RAM on the node the vCPUs run on
+    if (m_placement.node >= 0) {
+        object += QString(",host-nodes=%1,policy=bind").arg(m_placement.node);
+    }
+
+    // Touch every page up front, with as many threads as the guest has CPUs
+    if (prealloc) {
+        object += QString(",prealloc=on,prealloc-threads=%1").arg(m_config.cpuCores());
+    }
+
+    // The backend id is the machine's default RAM id, so saved states load
+    // whichever backend they were saved with
+    return QStringList() << "-object" << object << "-machine" << "memory-backend=pc.ram";
+}
+
+QStringList VMInstance::diskArgs() const {
+    QString diskPath = m_config.diskPath();
+    if (diskPath.isEmpty()) {
+        return QStringList();
+    }
+
+    // Bypass the host page cache where the filesystem allows it; the guest
+    // caches on its own and double caching only costs host memory
+    VMConfig::DiskCache cache = m_config.diskCache();
+    if (cache == VMConfig::AutoCache) {
+        cache = SystemChecker::supportsDirectIO(diskPath) ? VMConfig::NoCache : VMConfig::WritebackCache;
+    }
+
+    VMConfig::DiskAio aio = m_config.diskAio();
+    if (aio == VMConfig::AutoAio) {
+        if (SystemChecker::qemuSupportsIoUring()) {
+            aio = VMConfig::IoUringAio;
+        } else {
+            aio = cache == VMConfig::NoCache ? VMConfig::NativeAio : VMConfig::ThreadsAio;
+        }
+    } else if (aio == VMConfig::NativeAio && cache != VMConfig::NoCache) {
+        qWarning() << name() << ": aio=native needs cache=none, using threads";
+        aio = VMConfig::ThreadsAio;
+    }
+
+    QString drive = "file=" + escapeOption(diskPath) + ",if=none,id=disk0";
+    if (diskPath.endsWith(".qcow2")) {
+        drive += ",format=qcow2";
+    }
+    drive += ",cache=" + VMConfig::diskCacheName(cache);
+    drive += ",aio=" + VMConfig::diskAioName(aio);
+    if (m_config.diskDiscard()) {
+        drive += ",discard=unmap,detect-zeroes=unmap";
+    }
+
+    QStringList args;
+    args << "-drive" << drive;
+
+    // One request queue per vCPU, so guest I/O doesn't funnel through a
+    // single virtqueue
+    QString device = QString("virtio-blk-pci,drive=disk0,num-queues=%1").arg(m_config.cpuCores());
+    if (m_config.diskIothread()) {
+        args << "-object" << "iothread,id=iothread0";
+        device += ",iothread=iothread0";
+    }
+    args << "-device" << device;
+
+    return args;
+}
+
+QStringList VMInstance::networkArgs() const {
+    QString adbForward = QString("hostfwd=tcp::%1-:5555").arg(m_adbPort);
+    QStringList args;
+
+    bool multiQueue = false;
+    QString tap = m_config.tapDevice();
+    if (m_config.networkMode() == VMConfig::TapNetwork) {
+        if (tap.isEmpty()) {
+            qWarning() << name() << ": No tap device configured, using user-mode networking";
+        } else if (!SystemChecker::canOpenTap(tap, &multiQueue)) {
+            qWarning() << name() << ": Cannot open tap device" << tap << ", using user-mode networking";
+        } else {
+            int queues = multiQueue ? qMin(m_config.cpuCores(), MAX_NET_QUEUES) : 1;
+
+            QString netdev = QString("tap,id=net0,ifname=%1,script=no,downscript=no").arg(tap);
+            if (queues > 1) {
+                netdev += QString(",queues=%1").arg(queues);
+            }
+            if (SystemChecker::canUseVhostNet()) {
+                netdev += ",vhost=on";
+            } else {
+                qDebug() << name() << ": /dev/vhost-net not accessible, tap without vhost";
+            }
+
+            // Instances share the bridge, so each needs its own MAC
+            QString device = "virtio-net-pci,netdev=net0,mac=" + macAddress();
+            if (queues > 1) {
+                device += QString(",mq=on,vectors=%1").arg(2 * queues + 2);
+            }
+            args << "-netdev" << netdev << "-device" << device;
+
+            // adb keeps using a forwarded port on a second NIC; restrict=on
+            // stops guest traffic from leaving through it
+            args << "-netdev" << "user,id=adb0,restrict=on," + adbForward;
+            args << "-device" << "virtio-net-pci,netdev=adb0";
+            return args;
+        }
+    }
+
+    args << "-netdev" << "user,id=net0," + adbForward;
+    args << "-device" << "virtio-net-pci,netdev=net0";
+    return args;
+}
+
+QString VMInstance::macAddress() const {
+    // Locally administered QEMU prefix plus a stable hash of the name
+    QByteArray hash = QCryptographicHash::hash(name().toUtf8(), QCryptographicHash::Sha1);
+    return QString("52:54:00:%1:%2:%3")
+        .arg(uint(quint8(hash[0])), 2, 16, QChar('0'))
+        .arg(uint(quint8(hash[1])), 2, 16, QChar('0'))
+        .arg(uint(quint8(hash[2])), 2, 16, QChar('0'));
+}
+
+QString VMInstance::gpuDevice(bool gl) const {
+    // The guest sees the configured resolution as the preferred mode in
+    // the EDID, so it doesn't come up at the device's default size
+    QSize resolution = m_config.resolution();
+    return QString("%1,xres=%2,yres=%3,edid=on")
+        .arg(gl ? "virtio-vga-gl" : "virtio-vga")
+        .arg(resolution.width())
+        .arg(resolution.height());
+}
+
+QStringList VMInstance::displayArgs() const {
+    QStringList args;
+
+    switch (m_config.displayBackend()) {
+    case VMConfig::GtkDisplay:
+        args << "-vga" << "none" << "-device" << gpuDevice(false);
+        args << "-display" << "gtk,gl=on";
+        break;
+
+    case VMConfig::NoDisplay:
+        // Keep a 2D GPU so the guest still has a framebuffer to dump
+        args << "-vga" << "none" << "-device" << gpuDevice(false);
+        args << "-display" << "none";
+        break;
+
+    case VMConfig::VncDisplay:
+        // QEMU takes the first free display from :0 on; the port is read
+        // back over QMP once it's up
+        args << "-vga" << "none" << "-device" << gpuDevice(false);
+        args << "-display" << QString("vnc=127.0.0.1:0,to=%1").arg(VNC_DISPLAY_LAST);
+        break;
+
+    case VMConfig::SpiceDisplay:
+        args << "-vga" << "none" << "-device" << gpuDevice(false);
+        args << "-display" << "none";
+        args << "-spice" << "unix=on,addr=" + escapeOption(spiceSocketPath()) + ",disable-ticketing=on";
+        break;
+
+    case VMConfig::EglHeadlessDisplay:
+        // virgl renders on the host GPU into a buffer nobody displays
+        args << "-vga" << "none" << "-device" << gpuDevice(true);
+        args << "-display" << "egl-headless";
+        break;
+    }
+
+    return args;
+}
+
+QStringList VMInstance::bootArgs() const {
+    QStringList args;
+
+    if (!m_config.usesDirectBoot()) {
+        args << "-cdrom" << m_config.imagePath();
+        return args;
+    }
+
+    // The extracted kernel and initrd run straight away. The initrd looks
+    // for system.sfs on every disk, so the ISO is attached read-only as a
+    // virtio disk instead of an emulated CD-ROM.
+    QDir boot(DiskImageManager::bootFilesPath(m_config.imagePath()));
+    args << "-machine" << "q35";
+    args << "-kernel" << boot.filePath(DiskImageManager::KERNEL_FILE);
+    args << "-initrd" << boot.filePath(DiskImageManager::INITRD_FILE);
+    args << "-append" << kernelCommandLine();
+    args << "-drive" << "file=" + escapeOption(m_config.imagePath()) + ",if=none,id=system,format=raw,readonly=on";
+    args << "-device" << "virtio-blk-pci,drive=system";
+    return args;
+}
+
+QString VMInstance::kernelCommandLine() const {
+    // What the ISO's bootloader passes for its live entry, plus the
+    // display mode
+    return "root=/dev/ram0 androidboot.selinux=permissive quiet SRC= DATA= " + m_config.kernelDisplayArgs();
+}
+
+QStringList VMInstance::buildQemuCommand() const {
+    QStringList args;
+
+    args << "-name" << escapeOption(name());
+
+    // Enable KVM if available
+    if (QFile::exists("/dev/kvm")) {
+        args << "-enable-kvm";
+    }
+
+    // CPU configuration
+    args << "-cpu" << "host";
+    args << "-smp" << QString::number(m_config.cpuCores());
+
+    // Memory
+    args << "-m" << QString::number(m_config.ramMB()) + "M";
+
+    args << memoryBackendArgs();
+
+    // Mergeable for KSM, which pays off when instances run the same image
+    args << "-machine" << (m_config.memoryMerge() ? "mem-merge=on" : "mem-merge=off");
+
+    // Control channel; QEMU creates the socket and doesn't wait for us
+    args << "-qmp" << "unix:" + escapeOption(qmpSocketPath()) + ",server=on,wait=off";
+
+    // Display
+    args << displayArgs();
+
+    // Boot from image
+    args << bootArgs();
+
+    // Disk image for persistent storage, normally a qcow2 overlay on the
+    // shared base image
+    args << diskArgs();
+
+    // Network; adb is forwarded on a port allocated for this instance
+    args << networkArgs();
+
+    // Balloon; free-page reporting hands pages the guest frees back to the
+    // host, and BalloonController inflates it under host memory pressure
+    if (m_config.memoryBalloon()) {
+        args << "-device" << QString("virtio-balloon-pci,id=%1,deflate-on-oom=on,free-page-reporting=on")
+                                 .arg(BALLOON_ID);
+    }
+
+    // Audio
+    args << "-device" << "intel-hda";
+    args << "-device" << "hda-duplex";
+
+    // USB support
+    args << "-usb";
+    args << "-device" << "usb-tablet";
+
+    // Boot order; a directly booted kernel needs none
+    if (!m_config.usesDirectBoot()) {
+        args << "-boot" << "d";
+    }
+
+    // Resume where the saved first boot left off
+    if (m_restoring) {
+        args << "-loadvm" << SNAPSHOT_TAG;
+    }
+
+    // Load a saved state and wait, paused, until resume()
+    if (!m_incomingState.isEmpty()) {
+        args << "-S" << "-incoming" << stateReadUri(m_incomingState);
+    }
+
+    return args;
+}
+
+void VMInstance::handleProcessOutput() {
+    QString output = QString::fromUtf8(m_process->readAllStandardOutput());
+    emit outputReceived(output);
+    qDebug() << name() << "QEMU output:" << output;
+}
+
+void VMInstance::handleProcessError() {
+    QString output = QString::fromUtf8(m_process->readAllStandardError());
+    qWarning() << name() << "QEMU error:" << output;
+
+    // Keep the last complaint for when QEMU exits with an error
+    QString trimmed = output.trimmed();
+    if (!trimmed.isEmpty()) {
+        m_lastError = trimmed.section('\n', -1);
+    }
+}
+
+void VMInstance::handleProcessFinished(int exitCode, QProcess::ExitStatus exitStatus) {
+    qDebug() << name() << "QEMU process finished with exit code:" << exitCode;
+
+    m_bootWatcher->stop();
+    m_qmp->disconnectFromQemu();
+    QFile::remove(qmpSocketPath());
+
+    bool requested = (m_state == Stopping);
+    bool failed = (exitStatus == QProcess::CrashExit || exitCode != 0);
+
+    // QEMU refuses snapshots it can't load into this machine; boot cold
+    // instead and save a fresh one
+    if (m_restoring && m_state == Starting && failed) {
+        qWarning() << name() << "could not restore its snapshot, cold booting:" << m_lastError;
+        // The next savevm replaces the stale state under the same tag
+        QFile::remove(snapshotInfoPath());
+        setState(Stopped);
+        start();
+        return;
+    }
+
+    if (!requested && failed) {
+        QString reason = exitStatus == QProcess::CrashExit
+                             ? QString("QEMU crashed")
+                             : "QEMU exited with code " + QString::number(exitCode);
+        fail(m_lastError.isEmpty() ? reason : reason + ": " + m_lastError);
+    } else {
+        setState(Stopped);
+    }
+
+    emit stopped();
+}
+
+void VMInstance::handleQmpReady() {
+    // Pick up the actual run state, e.g. when started with -S
+    m_qmp->execute("query-status", QJsonObject(),
+                   [this](bool ok, const QJsonValue& result, const QString&) {
+        if (m_state != Starting) {
+            return;
+        }
+
+        // Still loading the incoming state
+        if (ok && result.toObject()["status"].toString() == "inmigrate") {
+            QTimer::singleShot(INCOMING_POLL_MS, this, &VMInstance::handleQmpReady);
+            return;
+        }
+
+        bool running = !ok || result.toObject()["running"].toBool();
+        pinVcpus();
+        queryVncPort();
+        setState(running ? Running : Paused);
+        emit started();
+
+        if (m_restoring || !m_incomingState.isEmpty()) {
+            // The snapshot was taken at the home screen
+            qDebug() << name() << "restored from snapshot in" << m_startTimer.elapsed() << "ms";
+            emit bootCompleted(m_startTimer.elapsed());
+        } else if (BootWatcher::isAdbAvailable()) {
+            m_bootWatcher->start(m_adbPort);
+        }
+    });
+}
+
+void VMInstance::queryVncPort() {
+    if (m_config.displayBackend() != VMConfig::VncDisplay) {
+        return;
+    }
+
+    m_qmp->execute("query-vnc", QJsonObject(),
+                   [this](bool ok, const QJsonValue& result, const QString&) {
+        if (ok && result.toObject()["enabled"].toBool()) {
+            m_vncPort = result.toObject()["service"].toString().toInt();
+            qDebug() << name() << "VNC on 127.0.0.1:" << m_vncPort;
+        }
+    });
+}
+
+void VMInstance::pinVcpus() {
+    if (!m_placement.isValid()) {
+        return;
+    }
+
+    m_qmp->execute("query-cpus-fast", QJsonObject(),
+                   [this](bool ok, const QJsonValue& result, const QString&) {
+        if (!ok) {
+            return;
+        }
+
+        for (const QJsonValue& value : result.toArray()) {
+            QJsonObject vcpu = value.toObject();
+            int index = vcpu["cpu-index"].toInt();
+            pid_t thread = static_cast<pid_t>(vcpu["thread-id"].toInteger());
+            int hostCpu = m_placement.cpus[index % m_placement.cpus.size()];
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(hostCpu, &set);
+            if (::sched_setaffinity(thread, sizeof(set), &set) != 0) {
+                qWarning() << name() << "cannot pin vCPU" << index << "to CPU" << hostCpu;
+            }
+        }
+
+        qDebug() << name() << "vCPUs pinned to" << HostTopology::formatCpuList(m_placement.cpus)
+                 << (m_placement.node >= 0 ? QString("on node %1").arg(m_placement.node) : QString());
+    });
+}
+
+void VMInstance::onBootCompleted() {
+    qint64 elapsed = m_startTimer.elapsed();
+    qDebug() << name() << "cold boot completed in" << elapsed << "ms";
+    emit bootCompleted(elapsed);
+
+    if (m_config.fastBoot() && supportsSnapshots() && m_state == Running) {
+        saveSnapshot();
+    }
+}
+
+bool VMInstance::supportsSnapshots() const {
+    // Internal snapshots live in the qcow2 disk; the CD-ROM is read-only
+    return m_config.diskPath().endsWith(".qcow2") && !m_config.instancePath().isEmpty();
+}
+
+bool VMInstance::hasUsableSnapshot() const {
+    if (!m_config.fastBoot() || !supportsSnapshots()) {
+        return false;
+    }
+
+    QFile file(snapshotInfoPath());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonObject info = QJsonDocument::fromJson(file.readAll()).object();
+    if (info["fingerprint"].toString() != m_config.snapshotFingerprint()) {
+        qDebug() << name() << "configuration changed since the snapshot was saved, cold booting";
+        return false;
+    }
+    return info["tag"].toString() == SNAPSHOT_TAG;
+}
+
+void VMInstance::saveSnapshot() {
+    if (m_state != Running || m_savingSnapshot || !supportsSnapshots()) {
+        return;
+    }
+
+    m_savingSnapshot = true;
+    QString fingerprint = m_config.snapshotFingerprint();
+    QElapsedTimer timer;
+    timer.start();
+
+    // savevm pauses the guest while RAM and device state are written into
+    // the overlay, then lets it continue
+    m_qmp->executeHuman(QString("savevm %1").arg(SNAPSHOT_TAG),
+                        [this, fingerprint, timer](bool ok, const QJsonValue& result, const QString& qmpError) {
+        m_savingSnapshot = false;
+
+        // HMP reports failures as text rather than as a QMP error
+        QString message = ok ? result.toString().trimmed() : qmpError;
+        if (!message.isEmpty()) {
+            qWarning() << name() << "could not save snapshot:" << message;
+            return;
+        }
+
+        QJsonObject info;
+        info["tag"] = SNAPSHOT_TAG;
+        info["fingerprint"] = fingerprint;
+        info["qemuVersion"] = m_qmp->qemuVersion();
+        info["created"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+
+        QSaveFile file(snapshotInfoPath());
+        if (!file.open(QIODevice::WriteOnly)) {
+            return;
+        }
+        file.write(QJsonDocument(info).toJson(QJsonDocument::Indented));
+        if (file.commit()) {
+            qDebug() << name() << "snapshot saved in" << timer.elapsed() << "ms";
+            emit snapshotSaved();
+        }
+    });
+}
+
+void VMInstance::discardSnapshot() {
+    QFile::remove(snapshotInfoPath());
+
+    // The VM state itself is inside the disk; reclaim it while QEMU isn't
+    // holding the image
+    if (m_process->state() == QProcess::NotRunning && supportsSnapshots()) {
+        QProcess::startDetached("qemu-img", QStringList() << "snapshot" << "-d" << SNAPSHOT_TAG
+                                                          << m_config.diskPath());
+    }
+}
+
+QString VMInstance::snapshotInfoPath() const {
+    return QDir(m_config.instancePath()).filePath("snapshot.json");
+}
+
+void VMInstance::setState(State state) {
+    if (m_state == state) {
+        return;
+    }
+    m_state = state;
+    emit stateChanged(state);
+}
+
+void VMInstance::fail(const QString& message) {
+    m_lastError = message;
+    qWarning() << name() << "-" << message;
+    setState(Error);
+    emit error(message);
+}
@@ -0,0 +1,136 @@
+#ifndef VM_INSTANCE_H
+#define VM_INSTANCE_H
+
+#include <QObject>
+#include <QProcess>
+#include <QString>
+#include <QElapsedTimer>
+#include "vm_config.h"
+#include "qmp_client.h"
+#include "boot_watcher.h"
+#include "../utils/host_topology.h"
+
+// One running (or runnable) Android VM: its QEMU process, QMP channel,
+// host ports and lifecycle. Owned by QemuManager, which supervises any
+// number of them side by side.
+//
+// With fast boot, the first cold boot that reaches the home screen is
+// saved as an internal snapshot of the instance's qcow2 disk, and later
+// starts restore it with -loadvm. The snapshot is only used while the
+// config fingerprint matches; if QEMU can't load it, the VM cold-boots.
+class VMInstance : public QObject {
+    Q_OBJECT
+
+public:
+    enum State {
+        Stopped,
+        Starting,   // Process launched, QMP not yet ready
+        Running,
+        Paused,
+        Stopping,
+        Error       // Exited unexpectedly or failed to start
+    };
+
+    VMInstance(const VMConfig& config, int adbPort, QObject *parent = nullptr);
+    ~VMInstance();
+
+    // Instead of booting, load the VM state saved in path (by a migration
+    // to file) and stay paused; must be set before start()
+    void setIncomingState(const QString& path) { m_incomingState = path; }
+    // Host CPUs (and NUMA node) this VM runs on; set before start()
+    void setPlacement(const HostTopology::Placement& placement) { m_placement = placement; }
+    HostTopology::Placement placement() const { return m_placement; }
+    bool start();
+    // Presses the guest's ACPI power button, terminates QEMU if the guest
+    // is still up after half of timeoutMs (right away when it isn't
+    // running) and kills QEMU if it hasn't exited after timeoutMs
+    void stop(int timeoutMs = 5000);
+    void pause();
+    void resume();
+
+    QString name() const { return m_config.name(); }
+    const VMConfig& config() const { return m_config; }
+    State state() const { return m_state; }
+    bool isActive() const { return m_state != Stopped && m_state != Error; }
+    QString errorString() const { return m_lastError; }
+    int pid() const;
+    // QEMU could not be launched at all; no stopped() follows
+    bool failedToStart() const;
+    int adbPort() const { return m_adbPort; }
+    QString qmpSocketPath() const;
+    QString spiceSocketPath() const;
+    // VNC port with the vnc display backend once running, otherwise -1
+    int vncPort() const { return m_vncPort; }
+    QmpClient *qmp() const { return m_qmp; }
+
+    // Saves the running VM's state for the next start
+    void saveSnapshot();
+    void discardSnapshot();
+    bool supportsSnapshots() const;
+    bool hasUsableSnapshot() const;
+    bool restoredFromSnapshot() const { return m_restoring; }
+
+    static QString stateName(State state);
+    // Migration URIs that load or save a state file. exec: rather than
+    // file:, which needs QEMU 8.2
+    static QString stateReadUri(const QString& path);
+    static QString stateWriteUri(const QString& path);
+    static constexpr const char *SNAPSHOT_TAG = "linuxdroid-fastboot";
+    static const int INCOMING_POLL_MS = 50;
+    // QOM id of the balloon device, under /machine/peripheral/
+    static constexpr const char *BALLOON_ID = "balloon0";
+    // virtio-net queue pairs on a multi_queue tap
+    static constexpr int MAX_NET_QUEUES = 8;
+    // VNC displays tried, :0 (port 5900) to :99
+    static const int VNC_DISPLAY_LAST = 99;
+
+signals:
+    void stateChanged(VMInstance::State state);
+    void started();
+    void stopped();
+    // Android is at the home screen, elapsedMs after start()
+    void bootCompleted(qint64 elapsedMs);
+    void snapshotSaved();
+    void error(const QString& error);
+    void outputReceived(const QString& output);
+
+private slots:
+    void handleProcessOutput();
+    void handleProcessError();
+    void handleProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void handleQmpReady();
+
+private:
+    QStringList buildQemuCommand() const;
+    QStringList memoryBackendArgs() const;
+    QStringList diskArgs() const;
+    QStringList networkArgs() const;
+    QString macAddress() const;
+    QStringList displayArgs() const;
+    QString gpuDevice(bool gl) const;
+    QStringList bootArgs() const;
+    QString kernelCommandLine() const;
+    QString socketPath(const QString& kind) const;
+    void queryVncPort();
+    void pinVcpus();
+    QString snapshotInfoPath() const;
+    void onBootCompleted();
+    void setState(State state);
+    void fail(const QString& error);
+
+    VMConfig m_config;
+    QProcess *m_process;
+    QmpClient *m_qmp;
+    BootWatcher *m_bootWatcher;
+    QElapsedTimer m_startTimer;
+    bool m_restoring;
+    bool m_savingSnapshot;
+    QString m_incomingState;
+    HostTopology::Placement m_placement;
+    State m_state;
+    int m_adbPort;
+    int m_vncPort;
+    QString m_lastError;
+};
+
+#endif // VM_INSTANCE_H
@@ -0,0 +1,433 @@
+#include "warm_pool.h"
+#include "disk_image_manager.h"
+#include "boot_watcher.h"
+#include "../utils/system_checker.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QProcess>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+namespace {
+
+const int MIGRATION_POLL_MS = 200;
+
+} // namespace
+
+WarmPool::WarmPool(QemuManager *manager, const VMConfig& config, QObject *parent)
+    : QObject(parent),
+      m_manager(manager),
+      m_config(config),
+      m_targetSize(2),
+      m_running(false),
+      m_buildingTemplate(false),
+      m_template(nullptr),
+      m_nextMember(0) {
+
+    // Members restore the template's NIC, MAC address included, so they
+    // can't share a bridge
+    m_config.setNetworkMode(VMConfig::UserNetwork);
+    // A window per pooled copy would pile up on the desktop; VNC still
+    // lets a handed-out copy be viewed
+    if (m_config.displayBackend() == VMConfig::GtkDisplay) {
+        m_config.setDisplayBackend(VMConfig::VncDisplay);
+    }
+
+    m_copyProcess = new QProcess(this);
+    connect(m_copyProcess, &QProcess::finished, this, &WarmPool::onTemplateDiskCopied);
+    connect(m_copyProcess, &QProcess::errorOccurred, this, [this](QProcess::ProcessError processError) {
+        if (processError == QProcess::FailedToStart) {
+            finishTemplate(false, "Cannot copy the instance disk: " + m_copyProcess->errorString());
+        }
+    });
+
+    m_memoryTimer = new QTimer(this);
+    connect(m_memoryTimer, &QTimer::timeout, this, &WarmPool::checkMemory);
+}
+
+WarmPool::~WarmPool() {
+    stop();
+}
+
+void WarmPool::setTargetSize(int size) {
+    m_targetSize = qMax(0, size);
+
+    // Shrink right away; growing happens as memory allows
+    while (m_ready.size() + m_starting.size() > m_targetSize) {
+        retireMember(!m_starting.isEmpty() ? m_starting.last() : m_ready.last());
+    }
+    refill();
+}
+
+void WarmPool::start() {
+    if (m_running) {
+        return;
+    }
+    m_running = true;
+
+    // Members don't survive a restart of the pool
+    QDir(poolPath() + "/members").removeRecursively();
+
+    m_memoryTimer->start(MEMORY_CHECK_MS);
+
+    if (isTemplateReady()) {
+        refill();
+    } else {
+        buildTemplate();
+    }
+}
+
+void WarmPool::stop() {
+    m_running = false;
+    m_memoryTimer->stop();
+
+    for (VMInstance *vm : m_starting + m_ready) {
+        retireMember(vm);
+    }
+
+    if (m_copyProcess->state() != QProcess::NotRunning) {
+        m_buildingTemplate = false;
+        m_copyProcess->kill();
+    }
+
+    if (m_template) {
+        m_buildingTemplate = false;
+        m_template->stop();
+    }
+}
+
+bool WarmPool::isTemplateReady() const {
+    if (!QFile::exists(templateDiskPath()) || !QFile::exists(templateStatePath())) {
+        return false;
+    }
+
+    QFile file(templateInfoPath());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QJsonObject info = QJsonDocument::fromJson(file.readAll()).object();
+    return info["fingerprint"].toString() == m_config.snapshotFingerprint();
+}
+
+VMInstance *WarmPool::acquire() {
+    if (m_ready.isEmpty()) {
+        return nullptr;
+    }
+
+    VMInstance *vm = m_ready.takeFirst();
+    m_handedOut.insert(vm);
+
+    // The guest is booted and paused; cont takes milliseconds
+    vm->resume();
+    qDebug() << "Warm pool" << m_config.name() << "handed out" << vm->name();
+
+    emit poolChanged(m_ready.size(), m_starting.size());
+    QTimer::singleShot(0, this, &WarmPool::refill);
+    return vm;
+}
+
+void WarmPool::release(VMInstance *vm) {
+    if (!m_handedOut.contains(vm)) {
+        return;
+    }
+    // Cleaned up in onMemberStopped()
+    vm->stop();
+}
+
+QString WarmPool::poolPath() const {
+    return "/opt/linuxdroid/pool/" + m_config.name();
+}
+
+QString WarmPool::templateDiskPath() const {
+    return poolPath() + "/template.qcow2";
+}
+
+QString WarmPool::templateStatePath() const {
+    return poolPath() + "/template.state";
+}
+
+QString WarmPool::templateInfoPath() const {
+    return poolPath() + "/template.json";
+}
+
+void WarmPool::buildTemplate() {
+    if (m_buildingTemplate) {
+        return;
+    }
+
+    if (m_config.diskPath().isEmpty() || !QFile::exists(m_config.diskPath())) {
+        emit error(m_config.name() + " has no disk to build the pool template from");
+        return;
+    }
+    if (m_manager->isRunning(m_config.name())) {
+        emit error("Stop " + m_config.name() + " before building its pool template");
+        return;
+    }
+    if (!BootWatcher::isAdbAvailable()) {
+        emit error("adb is required to detect when the pool template has booted");
+        return;
+    }
+
+    QDir(poolPath()).removeRecursively();
+    QDir().mkpath(poolPath());
+
+    // The template boots from a copy, so the instance keeps its own disk.
+    // An overlay copies as just the overlay, still backed by the shared base.
+    m_buildingTemplate = true;
+    m_copyProcess->start("cp", QStringList()
+                             << "--reflink=auto" << "--sparse=always"
+                             << m_config.diskPath() << templateDiskPath() + ".part");
+}
+
+void WarmPool::onTemplateDiskCopied(int exitCode, QProcess::ExitStatus exitStatus) {
+    if (!m_buildingTemplate) {
+        QFile::remove(templateDiskPath() + ".part");
+        return;
+    }
+
+    if (exitStatus != QProcess::NormalExit || exitCode != 0 ||
+        !QFile::rename(templateDiskPath() + ".part", templateDiskPath())) {
+        QString message = QString::fromUtf8(m_copyProcess->readAllStandardError()).trimmed();
+        QFile::remove(templateDiskPath() + ".part");
+        finishTemplate(false, "Cannot copy the instance disk: " + message);
+        return;
+    }
+
+    VMConfig config = m_config;
+    config.setName(m_config.name() + "-pool-template");
+    config.setInstancePath(poolPath());
+    config.setDiskPath(templateDiskPath());
+    config.setFastBoot(false);
+
+    qDebug() << "Warm pool" << m_config.name() << "cold booting its template";
+    m_template = m_manager->startVM(config);
+    if (!m_template) {
+        finishTemplate(false, "Cannot start the template VM");
+        return;
+    }
+
+    VMInstance *vm = m_template;
+    connect(vm, &VMInstance::bootCompleted, this, [this, vm]() {
+        saveTemplateState(vm);
+    });
+    connect(vm, &VMInstance::error, this, [this](const QString& vmError) {
+        finishTemplate(false, vmError);
+    });
+    connect(vm, &VMInstance::stopped, this, [this, vm]() {
+        m_template = nullptr;
+        m_manager->removeInstance(vm->name());
+        if (!m_buildingTemplate) {
+            return;
+        }
+
+        if (!QFile::exists(templateStatePath())) {
+            finishTemplate(false, "Template VM stopped before its state was saved");
+            return;
+        }
+
+        // Every member's overlay is backed by this disk from now on
+        QFile::setPermissions(templateDiskPath(), QFileDevice::ReadOwner | QFileDevice::ReadGroup |
+                                                  QFileDevice::ReadOther);
+
+        QJsonObject info;
+        info["fingerprint"] = m_config.snapshotFingerprint();
+        info["created"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+
+        QSaveFile file(templateInfoPath());
+        if (!file.open(QIODevice::WriteOnly)) {
+            finishTemplate(false, "Cannot write " + templateInfoPath());
+            return;
+        }
+        file.write(QJsonDocument(info).toJson(QJsonDocument::Indented));
+        finishTemplate(file.commit(), "Cannot write " + templateInfoPath());
+    });
+}
+
+void WarmPool::saveTemplateState(VMInstance *vm) {
+    // Stopped first, so the disk and the saved RAM describe the same moment
+    vm->qmp()->execute("stop", QJsonObject(), [this, vm](bool ok, const QJsonValue&, const QString& qmpError) {
+        if (!ok) {
+            finishTemplate(false, "Cannot pause the template VM: " + qmpError);
+            return;
+        }
+
+        QJsonObject arguments;
+        arguments["uri"] = VMInstance::stateWriteUri(templateStatePath() + ".part");
+        vm->qmp()->execute("migrate", arguments, [this, vm](bool ok, const QJsonValue&, const QString& qmpError) {
+            if (!ok) {
+                finishTemplate(false, "Cannot save the template state: " + qmpError);
+                return;
+            }
+            pollTemplateMigration(vm);
+        });
+    });
+}
+
+void WarmPool::pollTemplateMigration(VMInstance *vm) {
+    vm->qmp()->execute("query-migrate", QJsonObject(),
+                       [this, vm](bool ok, const QJsonValue& result, const QString& qmpError) {
+        if (!m_buildingTemplate) {
+            return;
+        }
+
+        QJsonObject status = result.toObject();
+        QString state = status["status"].toString();
+
+        if (!ok || state == "failed" || state == "cancelled") {
+            QString reason = ok ? status["error-desc"].toString(state) : qmpError;
+            finishTemplate(false, "Saving the template state failed: " + reason);
+            return;
+        }
+
+        if (state != "completed") {
+            QTimer::singleShot(MIGRATION_POLL_MS, this, [this, vm]() { pollTemplateMigration(vm); });
+            return;
+        }
+
+        QFile::remove(templateStatePath());
+        if (!QFile::rename(templateStatePath() + ".part", templateStatePath())) {
+            finishTemplate(false, "Cannot store the template state");
+            return;
+        }
+
+        qDebug() << "Warm pool" << m_config.name() << "saved template state,"
+                 << status["ram"].toObject()["total"].toInteger() / (1024 * 1024) << "MB of RAM";
+
+        // QEMU flushes the disk on exit; the stopped handler finishes up
+        vm->stop();
+    });
+}
+
+void WarmPool::finishTemplate(bool ok, const QString& message) {
+    if (!m_buildingTemplate) {
+        return;
+    }
+    m_buildingTemplate = false;
+
+    if (!ok) {
+        qWarning() << "Warm pool" << m_config.name() << "template failed:" << message;
+        if (m_template && m_template->isActive()) {
+            m_template->stop();
+        } else if (m_template) {
+            m_manager->removeInstance(m_template->name());
+            m_template = nullptr;
+        }
+        QFile::remove(templateInfoPath());
+        emit error(message);
+        return;
+    }
+
+    qDebug() << "Warm pool" << m_config.name() << "template ready";
+    emit templateReady();
+    refill();
+}
+
+void WarmPool::refill() {
+    if (!m_running || m_buildingTemplate || !isTemplateReady()) {
+        return;
+    }
+
+    if (m_ready.size() + m_starting.size() < m_targetSize && m_starting.size() < MAX_STARTING) {
+        // A member touches roughly all of its RAM while loading the state
+        qint64 available = SystemChecker::getAvailableRAM();
+        if (available - m_config.ramMB() >= RESERVE_MB) {
+            spawnMember();
+        } else {
+            qDebug() << "Warm pool" << m_config.name() << "limited by memory:"
+                     << available << "MB available";
+        }
+    }
+
+    emit poolChanged(m_ready.size(), m_starting.size());
+}
+
+void WarmPool::checkMemory() {
+    qint64 available = SystemChecker::getAvailableRAM();
+    if (available < RESERVE_MB) {
+        // Idle members give their memory back before anything else suffers
+        VMInstance *vm = !m_starting.isEmpty() ? m_starting.last()
+                         : !m_ready.isEmpty() ? m_ready.last() : nullptr;
+        if (vm) {
+            qDebug() << "Warm pool" << m_config.name() << "shrinking, only"
+                     << available << "MB available";
+            retireMember(vm);
+        }
+        return;
+    }
+
+    refill();
+}
+
+void WarmPool::spawnMember() {
+    int index = m_nextMember++;
+    QString path = QString("%1/members/%2").arg(poolPath()).arg(index);
+    QString disk = path + "/disk.qcow2";
+
+    QString message;
+    if (!DiskImageManager::createOverlay(templateDiskPath(), disk, &message)) {
+        QDir(path).removeRecursively();
+        emit error("Cannot create pool member disk: " + message);
+        return;
+    }
+
+    VMConfig config = m_config;
+    config.setName(QString("%1-pool-%2").arg(m_config.name()).arg(index));
+    config.setInstancePath(path);
+    config.setDiskPath(disk);
+    config.setFastBoot(false);
+
+    VMInstance *vm = m_manager->startVM(config, templateStatePath());
+    if (!vm) {
+        QDir(path).removeRecursively();
+        return;
+    }
+
+    m_starting.append(vm);
+    m_memberPaths.insert(vm, path);
+
+    connect(vm, &VMInstance::started, this, [this, vm]() {
+        if (!m_starting.removeOne(vm)) {
+            return;
+        }
+        m_ready.append(vm);
+        emit instanceReady(vm);
+        refill();
+    });
+    connect(vm, &VMInstance::stopped, this, [this, vm]() {
+        onMemberStopped(vm);
+    });
+    // QEMU that never started emits no stopped()
+    connect(vm, &VMInstance::error, this, [this, vm]() {
+        if (vm->pid() < 0) {
+            onMemberStopped(vm);
+        }
+    });
+}
+
+void WarmPool::retireMember(VMInstance *vm) {
+    m_starting.removeOne(vm);
+    m_ready.removeOne(vm);
+    vm->stop();
+}
+
+void WarmPool::onMemberStopped(VMInstance *vm) {
+    if (!m_memberPaths.contains(vm)) {
+        return;
+    }
+
+    bool expected = !m_starting.contains(vm) && !m_ready.contains(vm);
+    m_starting.removeOne(vm);
+    m_ready.removeOne(vm);
+    m_handedOut.remove(vm);
+
+    QDir(m_memberPaths.take(vm)).removeRecursively();
+    m_manager->removeInstance(vm->name());
+
+    if (!expected) {
+        qWarning() << "Warm pool member" << vm->name() << "stopped unexpectedly";
+    }
+    refill();
+}
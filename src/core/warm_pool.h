@@ -0,0 +1,96 @@
+#ifndef WARM_POOL_H
+#define WARM_POOL_H
+
+#include <QObject>
+#include <QList>
+#include <QSet>
+#include <QMap>
+#include <QTimer>
+#include <QProcess>
+#include "qemu_manager.h"
+#include "vm_config.h"
+
+// Keeps a number of paused, fully booted copies of one instance ready to
+// hand out. The template is cold-booted once from a copy of the instance's
+// disk, stopped at the home screen and saved: the copy becomes a read-only
+// backing file and its RAM and device state a state file. Pool members are thin overlays on that disk
+// which load the state file and wait paused, so acquire() only has to
+// resume one. Handed-out members are refilled in the background, as far
+// as free host memory allows. Pooled copies never open a window.
+class WarmPool : public QObject {
+    Q_OBJECT
+
+public:
+    // config describes the VM to pool; its name names the pool
+    WarmPool(QemuManager *manager, const VMConfig& config, QObject *parent = nullptr);
+    ~WarmPool();
+
+    // Upper bound; the pool stays smaller while memory is short
+    void setTargetSize(int size);
+    int targetSize() const { return m_targetSize; }
+
+    // Builds the template if needed, then fills the pool
+    void start();
+    // Stops all members that haven't been handed out
+    void stop();
+
+    bool isTemplateReady() const;
+    int readyCount() const { return m_ready.size(); }
+    int startingCount() const { return m_starting.size(); }
+
+    // A ready instance, already resuming, or nullptr if none is ready.
+    // The caller gives it back with release() when done.
+    VMInstance *acquire();
+    // Stops a handed-out instance and discards its disk
+    void release(VMInstance *vm);
+
+    QString poolPath() const;
+
+    // Memory the host keeps for itself when sizing the pool
+    static const qint64 RESERVE_MB = 2048;
+    static const int MEMORY_CHECK_MS = 5000;
+    // Members booting at the same time; restores are disk-bound
+    static const int MAX_STARTING = 1;
+
+signals:
+    void templateReady();
+    void instanceReady(VMInstance *vm);
+    void poolChanged(int ready, int starting);
+    void error(const QString& error);
+
+private slots:
+    void refill();
+    void checkMemory();
+    void onTemplateDiskCopied(int exitCode, QProcess::ExitStatus exitStatus);
+
+private:
+    void buildTemplate();
+    void saveTemplateState(VMInstance *vm);
+    void pollTemplateMigration(VMInstance *vm);
+    void finishTemplate(bool ok, const QString& message);
+    void spawnMember();
+    void retireMember(VMInstance *vm);
+    void onMemberStopped(VMInstance *vm);
+
+    QString templateDiskPath() const;
+    QString templateStatePath() const;
+    QString templateInfoPath() const;
+
+    QemuManager *m_manager;
+    VMConfig m_config;
+    int m_targetSize;
+    bool m_running;
+    bool m_buildingTemplate;
+    VMInstance *m_template;
+    QProcess *m_copyProcess;  // Copies the instance disk for the template
+
+    QList<VMInstance*> m_starting;
+    QList<VMInstance*> m_ready;
+    QSet<VMInstance*> m_handedOut;
+    QMap<VMInstance*, QString> m_memberPaths;
+    int m_nextMember;
+
+    QTimer *m_memoryTimer;
+};
+
+#endif // WARM_POOL_H
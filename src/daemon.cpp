@@ -6,14 +6,23 @@
 #include <QTimer>
 #include <QDir>
 #include <QFileInfo>
+#include <QCommandLineParser>
+#include <QJsonArray>
 #include <signal.h>
 #include "core/download_manager.h"
+#include "core/download_queue.h"
+#include "core/image_verifier.h"
+#include "core/control_server.h"
+#include "core/control_client.h"
 
 class LinuxDroidDaemon : public QObject {
     Q_OBJECT
 
 public:
-    LinuxDroidDaemon(QObject *parent = nullptr) : QObject(parent) {
+    // With a queuePath the daemon runs as a service on a persistent job
+    // queue; without one it handles a single command and exits
+    explicit LinuxDroidDaemon(const QString& queuePath = QString(), QObject *parent = nullptr)
+        : QObject(parent), m_oneShot(queuePath.isEmpty()) {
         m_logFile.setFileName("/var/log/linuxdroid/download.log");
 
         QDir logDir = QFileInfo(m_logFile).dir();
@@ -25,16 +34,38 @@ public:
             log("LinuxDroid daemon started");
         }
 
+        m_queue = new DownloadQueue(queuePath, this);
+        m_controlServer = nullptr;
+
+        connect(m_queue, &DownloadQueue::jobProgress,
+                this, &LinuxDroidDaemon::onJobProgress);
+        connect(m_queue, &DownloadQueue::jobStateChanged,
+                this, &LinuxDroidDaemon::onJobStateChanged);
+        connect(m_queue, &DownloadQueue::jobCompleted,
+                this, &LinuxDroidDaemon::onJobCompleted);
+        connect(m_queue, &DownloadQueue::jobFailed,
+                this, &LinuxDroidDaemon::onJobFailed);
+        // Queued: the queue can go idle before the event loop runs
+        connect(m_queue, &DownloadQueue::idle,
+                this, &LinuxDroidDaemon::maybeQuit, Qt::QueuedConnection);
+
+        // Only used to repair images; shares the queue's rate limit
         m_downloadManager = new DownloadManager(this);
+        m_downloadManager->setBandwidthShaper(m_queue->bandwidthShaper());
 
-        connect(m_downloadManager, &DownloadManager::downloadProgress,
-                this, &LinuxDroidDaemon::onDownloadProgress);
         connect(m_downloadManager, &DownloadManager::downloadFinished,
-                this, &LinuxDroidDaemon::onDownloadFinished);
+                this, &LinuxDroidDaemon::onRepairFinished);
         connect(m_downloadManager, &DownloadManager::downloadError,
-                this, &LinuxDroidDaemon::onDownloadError);
-        connect(m_downloadManager, &DownloadManager::checksumVerified,
-                this, &LinuxDroidDaemon::onChecksumVerified);
+                this, &LinuxDroidDaemon::onRepairError);
+
+        m_verifier = new ImageVerifier(this);
+
+        connect(m_verifier, &ImageVerifier::manifestCreated,
+                this, &LinuxDroidDaemon::onManifestCreated);
+        connect(m_verifier, &ImageVerifier::verificationFinished,
+                this, &LinuxDroidDaemon::onVerificationFinished);
+        connect(m_verifier, &ImageVerifier::error,
+                this, &LinuxDroidDaemon::onVerifierError);
     }
 
     ~LinuxDroidDaemon() {
@@ -42,19 +73,94 @@ public:
         m_logFile.close();
     }
 
-    void startDownload(const QString& url, const QString& destination) {
+    // Restores the persistent queue; interrupted jobs resume from their
+    // .part state
+    void startService(int concurrentJobs, const QString& socketPath) {
+        m_queue->setMaxConcurrent(concurrentJobs);
+        if (m_queue->load()) {
+            log(QString("Resumed download queue with %1 job(s), %2 concurrent")
+                    .arg(m_queue->jobs().size()).arg(m_queue->maxConcurrent()));
+        } else {
+            log("Download queue is empty");
+        }
+
+        // Clients (the setup wizard, --ctl) drive the queue through here
+        m_controlServer = new ControlServer(m_queue, this);
+        if (m_controlServer->listen(socketPath)) {
+            log("Control socket: " + socketPath);
+        } else {
+            log("Control socket unavailable: " + m_controlServer->errorString());
+        }
+    }
+
+    bool startDownload(const QString& url, const QString& destination,
+                       const QString& sha256 = QString()) {
         log("Starting download: " + url);
         log("Destination: " + destination);
-        m_downloadManager->startDownload(url, destination);
+
+        // Hashed while downloading; the job completes once it matches
+        if (m_queue->enqueue(url, destination, sha256) < 0) {
+            log("Destination already in use: " + destination);
+            return false;
+        }
+        return true;
+    }
+
+    // Applies the --limit, --schedule and --idle-only options to every
+    // download this daemon runs
+    bool configureBandwidth(const QString& limit, const QStringList& schedule,
+                            bool idleOnly, const QString& interface) {
+        BandwidthShaper *shaper = m_queue->bandwidthShaper();
+
+        if (!limit.isEmpty()) {
+            bool ok = false;
+            qint64 rate = BandwidthShaper::parseRate(limit, &ok);
+            if (!ok) {
+                log("Invalid rate limit: " + limit);
+                return false;
+            }
+            shaper->setRateLimit(rate);
+        }
+
+        QVector<BandwidthShaper::Rule> rules;
+        for (const QString& text : schedule) {
+            BandwidthShaper::Rule rule;
+            if (!BandwidthShaper::parseRule(text, rule)) {
+                log("Invalid schedule rule: " + text);
+                return false;
+            }
+            rules.append(rule);
+        }
+        shaper->setSchedule(rules);
+
+        if (idleOnly) {
+            log("Idle-only mode on " + (interface.isEmpty() ? QString("all interfaces") : interface));
+            shaper->setIdleOnly(true, interface);
+        }
+
+        if (!limit.isEmpty() || !rules.isEmpty()) {
+            log(QString("Bandwidth: %1, %2 schedule rule(s)")
+                    .arg(limit.isEmpty() ? QString("unlimited") : limit).arg(rules.size()));
+        }
+        return true;
+    }
+
+    // Checks an installed image against its chunk manifest. With a URL,
+    // corrupt chunks are re-fetched and the image is verified again.
+    void verifyImage(const QString& imagePath, const QString& repairUrl = QString()) {
+        log("Verifying image: " + imagePath);
+        m_repairUrl = repairUrl;
+        m_verifying = true;
+        m_verifier->verify(imagePath);
     }
 
 public slots:
-    void onDownloadProgress(qint64 received, qint64 total) {
+    void onJobProgress(int id, qint64 received, qint64 total) {
         if (total > 0) {
             int percentage = static_cast<int>((received * 100) / total);
-            if (percentage % 10 == 0 && percentage != m_lastLoggedPercentage) {
-                log(QString("Download progress: %1%").arg(percentage));
-                m_lastLoggedPercentage = percentage;
+            if (percentage % 10 == 0 && percentage != m_lastLoggedPercentage.value(id, -1)) {
+                log(QString("Job %1 progress: %2%").arg(id).arg(percentage));
+                m_lastLoggedPercentage[id] = percentage;
 
                 // Send D-Bus notification (in production)
                 // notifyProgress(percentage);
@@ -62,35 +168,108 @@ public slots:
         }
     }
 
-    void onDownloadFinished(const QString& filePath) {
-        log("Download completed: " + filePath);
+    void onJobStateChanged(int id, DownloadQueue::State state) {
+        log(QString("Job %1 is %2").arg(id).arg(DownloadQueue::stateName(state)));
+        if (state != DownloadQueue::Active) {
+            m_lastLoggedPercentage.remove(id);
+        }
+    }
 
-        // Verify checksum if set
-        if (!m_expectedChecksum.isEmpty()) {
-            log("Verifying checksum...");
-            m_downloadManager->verifyChecksum();
-        } else {
-            log("Download finished successfully (no checksum verification)");
-            QCoreApplication::quit();
+    void onJobCompleted(int id, const QString& filePath) {
+        DownloadQueue::Job job = m_queue->job(id);
+        log("Download completed: " + filePath +
+            (job.sha256.isEmpty() ? " (no checksum verification)" : " (checksum verified)"));
+        buildManifest(filePath);
+    }
+
+    void onJobFailed(int id, const QString& error) {
+        log(QString("Job %1 failed: %2").arg(id).arg(error));
+        if (m_exitCode == 0) {
+            m_exitCode = error.startsWith("Checksum") ? 2 : 1;
         }
     }
 
-    void onDownloadError(const QString& error) {
-        log("Download error: " + error);
+    void onRepairFinished(const QString& filePath) {
+        log("Repaired chunks written, verifying again");
+        m_verifier->verify(filePath);
+    }
+
+    void onRepairError(const QString& error) {
+        log("Repair error: " + error);
         QCoreApplication::exit(1);
     }
 
-    void onChecksumVerified(bool success) {
+    void onManifestCreated(const QString& imagePath, const QByteArray& rootHash) {
+        log("Chunk manifest written for " + imagePath + " (root " + QString(rootHash.toHex()) + ")");
+        nextManifest();
+    }
+
+    void onVerificationFinished(const QString& imagePath, bool success, const QVector<int>& badChunks) {
         if (success) {
-            log("Checksum verification: SUCCESS");
+            log("Image verification: SUCCESS");
             QCoreApplication::quit();
-        } else {
-            log("Checksum verification: FAILED");
+            return;
+        }
+
+        QStringList chunks;
+        for (int chunk : badChunks) {
+            chunks << QString::number(chunk);
+        }
+        log(QString("Image verification: FAILED, %1 bad chunk(s): %2")
+                .arg(badChunks.size()).arg(chunks.join(", ")));
+
+        ImageVerifier::Manifest manifest;
+        if (m_repairUrl.isEmpty() || m_repairAttempted ||
+            !ImageVerifier::loadManifest(ImageVerifier::manifestPath(imagePath), manifest)) {
             QCoreApplication::exit(2);
+            return;
+        }
+
+        log("Re-fetching bad chunks from " + m_repairUrl);
+        m_repairAttempted = true;
+        m_downloadManager->repairRanges(m_repairUrl, imagePath,
+                                        ImageVerifier::rangesForChunks(manifest, badChunks));
+    }
+
+    void onVerifierError(const QString& error) {
+        log("Verification error: " + error);
+        if (m_verifying) {
+            QCoreApplication::exit(1);
+            return;
+        }
+        nextManifest();
+    }
+
+    void maybeQuit() {
+        // A service keeps waiting for jobs; a one-shot run ends once its
+        // download and manifest are done
+        if (m_oneShot && !m_verifying && m_queue->isIdle() &&
+            m_manifestQueue.isEmpty() && !m_verifier->isBusy()) {
+            QCoreApplication::exit(m_exitCode);
         }
     }
 
 private:
+    void buildManifest(const QString& imagePath) {
+        // Lets later verifications run in parallel and pinpoint bad chunks.
+        // ImageVerifier runs one job at a time, so they are queued here.
+        m_manifestQueue.append(imagePath);
+        if (!m_verifier->isBusy()) {
+            nextManifest();
+        }
+    }
+
+    void nextManifest() {
+        if (m_manifestQueue.isEmpty()) {
+            maybeQuit();
+            return;
+        }
+
+        QString imagePath = m_manifestQueue.takeFirst();
+        log("Building chunk manifest for " + imagePath);
+        m_verifier->createManifest(imagePath);
+    }
+
     void log(const QString& message) {
         QString timestamp = QDateTime::currentDateTime().toString(Qt::ISODate);
         QString logMessage = QString("[%1] %2\n").arg(timestamp, message);
@@ -104,10 +283,131 @@ private:
         qDebug() << message;
     }
 
+    DownloadQueue *m_queue;
+    ControlServer *m_controlServer;
     DownloadManager *m_downloadManager;
+    ImageVerifier *m_verifier;
     QFile m_logFile;
-    QString m_expectedChecksum;
-    int m_lastLoggedPercentage = -1;
+    QStringList m_manifestQueue;
+    QString m_repairUrl;
+    bool m_oneShot;
+    bool m_verifying = false;
+    bool m_repairAttempted = false;
+    int m_exitCode = 0;
+    QMap<int, int> m_lastLoggedPercentage;
+};
+
+// Runs one --ctl command against a running service and prints the reply;
+// "watch" keeps printing job events until interrupted
+class ControlCommand : public QObject {
+    Q_OBJECT
+
+public:
+    explicit ControlCommand(QObject *parent = nullptr)
+        : QObject(parent), m_client(new ControlClient(this)), m_out(stdout), m_request(-1),
+          m_watch(false) {
+        connect(m_client, &ControlClient::replyReceived, this, &ControlCommand::onReply);
+        connect(m_client, &ControlClient::jobProgress, this, &ControlCommand::onProgress);
+        connect(m_client, &ControlClient::jobStateChanged, this, &ControlCommand::onStateChanged);
+        connect(m_client, &ControlClient::disconnected, this, []() {
+            qWarning() << "Daemon closed the connection";
+            QCoreApplication::exit(1);
+        });
+    }
+
+    bool run(const QString& socketPath, const QString& command, const QStringList& args,
+             int priority) {
+        if (!m_client->connectToDaemon(socketPath)) {
+            qWarning() << "linuxdroid-daemon is not running:" << m_client->errorString();
+            return false;
+        }
+
+        bool hasId = false;
+        int id = args.value(0).toInt(&hasId);
+
+        if (command == "list") {
+            m_request = m_client->list();
+        } else if (command == "enqueue" && args.size() >= 2) {
+            m_request = m_client->enqueue(args[0], args[1], args.value(2), priority);
+        } else if (command == "pause" && hasId) {
+            m_request = m_client->pause(id);
+        } else if (command == "resume" && hasId) {
+            m_request = m_client->resume(id);
+        } else if (command == "cancel" && hasId) {
+            m_request = m_client->cancel(id);
+        } else if (command == "priority" && hasId) {
+            m_request = m_client->setPriority(id, priority);
+        } else if (command == "watch") {
+            m_watch = true;
+            m_request = m_client->subscribe(hasId ? id : -1);
+        } else {
+            qWarning() << "Unknown or incomplete command:" << command << args;
+            return false;
+        }
+        return true;
+    }
+
+private slots:
+    void onReply(int requestId, bool ok, const QJsonObject& reply) {
+        if (requestId != m_request) {
+            return;
+        }
+
+        if (!ok) {
+            qWarning().noquote() << "Error:" << reply["error"].toString();
+            QCoreApplication::exit(1);
+            return;
+        }
+
+        for (const QJsonValue& job : reply["jobs"].toArray()) {
+            printJob(job.toObject());
+        }
+        if (reply.contains("job")) {
+            printJob(reply["job"].toObject());
+        }
+
+        if (!m_watch) {
+            m_client->disconnectFromDaemon();
+            QCoreApplication::exit(0);
+        }
+    }
+
+    void onProgress(int jobId, const QJsonObject& progress) {
+        qint64 received = progress["bytesReceived"].toVariant().toLongLong();
+        qint64 total = progress["totalBytes"].toVariant().toLongLong();
+
+        m_out << QString("%1  %2%  %3 / %4 MB  %5 KB/s  %6")
+                     .arg(jobId, 4)
+                     .arg(total > 0 ? received * 100 / total : 0, 3)
+                     .arg(received / (1024 * 1024))
+                     .arg(total / (1024 * 1024))
+                     .arg(static_cast<qint64>(progress["bytesPerSecond"].toDouble() / 1024))
+                     .arg(DownloadManager::formatTimeRemaining(
+                              progress["secondsRemaining"].toInteger(-1)))
+              << Qt::endl;
+    }
+
+    void onStateChanged(const QJsonObject& job) {
+        printJob(job);
+    }
+
+private:
+    void printJob(const QJsonObject& job) {
+        QString line = QString("%1  %2  %3  %4")
+                           .arg(job["id"].toInt(), 4)
+                           .arg(job["state"].toString(), -9)
+                           .arg(job["priority"].toInt(), 3)
+                           .arg(job["destination"].toString());
+        if (job.contains("error")) {
+            line += "  (" + job["error"].toString() + ")";
+        }
+        m_out << line << Qt::endl;
+    }
+
+    ControlClient *m_client;
+    QTextStream m_out;
+    int m_request;
+    bool m_watch;
 };
 
 // Signal handler for graceful shutdown
@@ -125,19 +425,73 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
 
-    LinuxDroidDaemon daemon;
+    QCommandLineParser parser;
+    parser.setApplicationDescription("LinuxDroid background download service");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("url", "Image to download");
+    parser.addPositionalArgument("destination", "Where to store the image");
+    parser.addPositionalArgument("sha256", "Expected checksum", "[sha256]");
 
-    // Check for command line arguments
-    if (argc >= 3) {
-        QString url = argv[1];
-        QString destination = argv[2];
-        daemon.startDownload(url, destination);
-    } else {
-        qWarning() << "Usage: linuxdroid-daemon <url> <destination>";
-        qWarning() << "Running in idle mode - waiting for D-Bus commands";
+    QCommandLineOption verifyOption("verify",
+        "Verify <image> against its chunk manifest; a url argument enables repair.", "image");
+    QCommandLineOption limitOption("limit",
+        "Download rate limit, e.g. 512K or 2M bytes per second (0 = unlimited).", "rate");
+    QCommandLineOption scheduleOption("schedule",
+        "Rate for a time of day, e.g. 09:00-18:00=256K. May be repeated.", "rule");
+    QCommandLineOption idleOption("idle-only",
+        "Slow down to a trickle while other traffic is using the network.");
+    QCommandLineOption interfaceOption("interface",
+        "Interface watched by --idle-only (default: all but loopback).", "name");
+    QCommandLineOption queueOption("queue",
+        "Persistent job queue used when running as a service.", "file",
+        "/opt/linuxdroid/queue.json");
+    QCommandLineOption jobsOption("jobs",
+        "Number of downloads the service runs at the same time.", "count",
+        QString::number(DownloadQueue::DEFAULT_CONCURRENT));
+    QCommandLineOption socketOption("socket",
+        "Control socket of the service.", "path", ControlProtocol::SOCKET_PATH);
+    QCommandLineOption ctlOption("ctl",
+        "Send a command to the running service: list, enqueue <url> <destination> [sha256], "
+        "pause|resume|cancel <id>, priority <id>, watch [id].", "command");
+    QCommandLineOption priorityOption("priority",
+        "Priority for --ctl enqueue and --ctl priority.", "n", "0");
+    parser.addOptions({verifyOption, limitOption, scheduleOption, idleOption, interfaceOption,
+                       queueOption, jobsOption, socketOption, ctlOption, priorityOption});
+
+    parser.process(app);
+
+    QStringList args = parser.positionalArguments();
+
+    if (parser.isSet(ctlOption)) {
+        ControlCommand command;
+        if (!command.run(parser.value(socketOption), parser.value(ctlOption), args,
+                         parser.value(priorityOption).toInt())) {
+            return 1;
+        }
+        return app.exec();
+    }
 
-        // In production, would listen for D-Bus commands
-        // For now, just run event loop
+    bool service = !parser.isSet(verifyOption) && args.size() < 2;
+
+    LinuxDroidDaemon daemon(service ? parser.value(queueOption) : QString());
+
+    if (!daemon.configureBandwidth(parser.value(limitOption), parser.values(scheduleOption),
+                                   parser.isSet(idleOption), parser.value(interfaceOption))) {
+        return 1;
+    }
+
+    if (parser.isSet(verifyOption)) {
+        QString repairUrl = args.isEmpty() ? QString() : args.first();
+        daemon.verifyImage(parser.value(verifyOption), repairUrl);
+    } else if (!service) {
+        QString sha256 = args.size() >= 3 ? args[2] : QString();
+        if (!daemon.startDownload(args[0], args[1], sha256)) {
+            return 1;
+        }
+    } else {
+        // Service mode: work through the persistent queue
+        daemon.startService(parser.value(jobsOption).toInt(), parser.value(socketOption));
     }
 
     return app.exec();
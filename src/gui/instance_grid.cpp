@@ -0,0 +1,128 @@
+#include "instance_grid.h"
+#include <QPainter>
+#include <QPaintEvent>
+#include <QMouseEvent>
+#include <QtMath>
+
+InstanceGrid::InstanceGrid(QWidget *parent)
+    : QWidget(parent) {
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
+    updateHeight();
+}
+
+QSize InstanceGrid::sizeHint() const {
+    int rows = (m_order.size() + columns() - 1) / columns();
+    return QSize(CELL_WIDTH + 2 * SPACING, rows * (CELL_HEIGHT + LABEL_HEIGHT + SPACING) + SPACING);
+}
+
+int InstanceGrid::columns() const {
+    return qMax(1, (width() - SPACING) / (CELL_WIDTH + SPACING));
+}
+
+QRect InstanceGrid::cellRect(int index) const {
+    int column = index % columns();
+    int row = index / columns();
+    return QRect(SPACING + column * (CELL_WIDTH + SPACING),
+                 SPACING + row * (CELL_HEIGHT + LABEL_HEIGHT + SPACING),
+                 CELL_WIDTH, CELL_HEIGHT + LABEL_HEIGHT);
+}
+
+QRect InstanceGrid::imageRect(int index) const {
+    QRect cell = cellRect(index);
+    QSize size = m_frames.value(m_order[index]).size();
+    if (size.isEmpty()) {
+        return QRect(cell.topLeft(), QSize(CELL_WIDTH, CELL_HEIGHT));
+    }
+
+    size.scale(CELL_WIDTH, CELL_HEIGHT, Qt::KeepAspectRatio);
+    return QRect(cell.left() + (CELL_WIDTH - size.width()) / 2,
+                 cell.top() + (CELL_HEIGHT - size.height()) / 2,
+                 size.width(), size.height());
+}
+
+void InstanceGrid::updateHeight() {
+    setFixedHeight(m_order.isEmpty() ? 0 : sizeHint().height());
+}
+
+void InstanceGrid::updateFrame(const QString& name, const QImage& frame, const QVector<QRect>& dirty) {
+    int index = m_order.indexOf(name);
+    bool resized = index < 0 || m_frames.value(name).size() != frame.size();
+    if (index < 0) {
+        m_order.append(name);
+        index = m_order.size() - 1;
+        updateHeight();
+    }
+    m_frames.insert(name, frame);
+
+    if (resized) {
+        update(cellRect(index));
+        return;
+    }
+
+    // Map the dirty rectangles from frame to widget coordinates, with a
+    // pixel of margin for the smoothing filter
+    QRect target = imageRect(index);
+    qreal scaleX = qreal(target.width()) / frame.width();
+    qreal scaleY = qreal(target.height()) / frame.height();
+    for (const QRect& rect : dirty) {
+        QRect mapped(target.left() + qFloor(rect.left() * scaleX) - 1,
+                     target.top() + qFloor(rect.top() * scaleY) - 1,
+                     qCeil(rect.width() * scaleX) + 2,
+                     qCeil(rect.height() * scaleY) + 2);
+        update(mapped.intersected(target));
+    }
+}
+
+void InstanceGrid::removeFrame(const QString& name) {
+    if (m_order.removeAll(name) == 0) {
+        return;
+    }
+    m_frames.remove(name);
+    updateHeight();
+    update();
+}
+
+void InstanceGrid::paintEvent(QPaintEvent *event) {
+    QPainter painter(this);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+
+    for (int i = 0; i < m_order.size(); ++i) {
+        QRect cell = cellRect(i);
+        if (!event->rect().intersects(cell)) {
+            continue;
+        }
+
+        QImage frame = m_frames.value(m_order[i]);
+        QRect target = imageRect(i);
+        if (frame.isNull()) {
+            painter.fillRect(target, Qt::black);
+        } else {
+            // Only the part of the frame behind the exposed area is scaled
+            QRect exposed = event->rect().intersected(target);
+            QRectF source((exposed.left() - target.left()) * qreal(frame.width()) / target.width(),
+                          (exposed.top() - target.top()) * qreal(frame.height()) / target.height(),
+                          exposed.width() * qreal(frame.width()) / target.width(),
+                          exposed.height() * qreal(frame.height()) / target.height());
+            painter.drawImage(QRectF(exposed), frame, source);
+        }
+
+        QRect label(cell.left(), cell.top() + CELL_HEIGHT, CELL_WIDTH, LABEL_HEIGHT);
+        painter.drawText(label, Qt::AlignCenter | Qt::TextSingleLine,
+                         fontMetrics().elidedText(m_order[i], Qt::ElideRight, CELL_WIDTH));
+    }
+}
+
+void InstanceGrid::mousePressEvent(QMouseEvent *event) {
+    for (int i = 0; i < m_order.size(); ++i) {
+        if (cellRect(i).contains(event->position().toPoint())) {
+            emit instanceClicked(m_order[i]);
+            return;
+        }
+    }
+    QWidget::mousePressEvent(event);
+}
+
+void InstanceGrid::resizeEvent(QResizeEvent *event) {
+    QWidget::resizeEvent(event);
+    updateHeight();
+}
@@ -0,0 +1,50 @@
+#ifndef INSTANCE_GRID_H
+#define INSTANCE_GRID_H
+
+#include <QWidget>
+#include <QImage>
+#include <QMap>
+#include <QStringList>
+#include <QVector>
+#include <QRect>
+
+// Live thumbnails of running instances, composited into one widget.
+// Frames are kept as received (QImage shares the data) and scaled while
+// painting; an update only repaints the parts of a cell that changed.
+class InstanceGrid : public QWidget {
+    Q_OBJECT
+
+public:
+    explicit InstanceGrid(QWidget *parent = nullptr);
+
+    void updateFrame(const QString& name, const QImage& frame, const QVector<QRect>& dirty);
+    void removeFrame(const QString& name);
+    bool isEmpty() const { return m_order.isEmpty(); }
+
+    QSize sizeHint() const override;
+
+    static const int CELL_WIDTH = 160;
+    static const int CELL_HEIGHT = 120;
+    static const int LABEL_HEIGHT = 18;
+    static const int SPACING = 6;
+
+signals:
+    void instanceClicked(const QString& name);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+    void mousePressEvent(QMouseEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+
+private:
+    int columns() const;
+    QRect cellRect(int index) const;
+    // Where a frame is drawn inside its cell, keeping its aspect ratio
+    QRect imageRect(int index) const;
+    void updateHeight();
+
+    QStringList m_order;
+    QMap<QString, QImage> m_frames;
+};
+
+#endif // INSTANCE_GRID_H
@@ -7,13 +7,18 @@
 #include <QHBoxLayout>
 #include <QMessageBox>
 #include <QDir>
+#include <QFile>
 #include <QFileDialog>
 #include <QInputDialog>
+#include <QDebug>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent),
       m_qemuManager(new QemuManager(this)),
-      m_currentInstance(nullptr) {
+      m_balloons(new BalloonController(m_qemuManager, this)),
+      m_ksm(new KsmController(m_qemuManager, this)),
+      m_capture(new FramebufferCapture(m_qemuManager, this)),
+      m_diskImages(new DiskImageManager(this)) {
 
     setWindowTitle("LinuxDroid - Android Emulator");
     setMinimumSize(900, 600);
@@ -25,14 +30,65 @@ MainWindow::MainWindow(QWidget *parent)
     setupTrayIcon();
     loadInstances();
 
-    connect(m_qemuManager, &QemuManager::vmStarted, this, &MainWindow::onVMStarted);
-    connect(m_qemuManager, &QemuManager::vmStopped, this, &MainWindow::onVMStopped);
-    connect(m_qemuManager, &QemuManager::vmError, this, &MainWindow::onVMError);
+    connect(m_qemuManager, &QemuManager::instanceStarted, this, &MainWindow::onInstanceStarted);
+    connect(m_qemuManager, &QemuManager::instanceStateChanged,
+            this, &MainWindow::onInstanceStateChanged);
+    connect(m_qemuManager, &QemuManager::instanceError, this, &MainWindow::onInstanceError);
+    connect(m_qemuManager, &QemuManager::instanceStopped, this, &MainWindow::onInstanceStopped);
+
+    connect(m_diskImages, &DiskImageManager::baseReady, this, &MainWindow::onBaseImageReady);
+    connect(m_diskImages, &DiskImageManager::error, this, &MainWindow::onBaseImageError);
+    connect(m_diskImages, &DiskImageManager::bootFilesError, this, &MainWindow::onBootFilesError);
+
+    connect(m_ksm, &KsmController::statsUpdated, this, &MainWindow::refreshInstanceList);
+
+    connect(m_capture, &FramebufferCapture::frameUpdated, m_thumbnails, &InstanceGrid::updateFrame);
+    connect(m_capture, &FramebufferCapture::frameRemoved, m_thumbnails, &InstanceGrid::removeFrame);
+    connect(m_thumbnails, &InstanceGrid::instanceClicked, this, &MainWindow::onThumbnailClicked);
+
+    m_balloons->start();
+    m_ksm->start();
+    m_capture->start();
 }
 
 MainWindow::~MainWindow() {
 }
 
+bool MainWindow::startWarmPool(const QString& name, int size) {
+    const VMConfig *config = nullptr;
+    for (const VMConfig& candidate : m_instances) {
+        if (candidate.name() == name) {
+            config = &candidate;
+        }
+    }
+    if (!config || !config->isValid()) {
+        qWarning() << "Cannot pool" << name << ": no such valid instance";
+        return false;
+    }
+
+    WarmPool *pool = m_pools.value(name);
+    if (!pool) {
+        pool = new WarmPool(m_qemuManager, *config, this);
+        connect(pool, &WarmPool::error, this, [this, name](const QString& error) {
+            m_statusLabel->setText(name + " warm pool: " + error);
+        });
+        connect(pool, &WarmPool::poolChanged, this, [this, name](int ready, int starting) {
+            m_statusLabel->setText(QString("%1 warm pool: %2 ready, %3 starting")
+                                       .arg(name).arg(ready).arg(starting));
+        });
+        m_pools.insert(name, pool);
+    }
+
+    pool->setTargetSize(size);
+    pool->start();
+    return true;
+}
+
+VMInstance *MainWindow::runningVM(const QString& name) const {
+    VMInstance *vm = m_pooledRuns.value(name);
+    return vm ? vm : m_qemuManager->instance(name);
+}
+
 void MainWindow::setupUI() {
     QWidget *centralWidget = new QWidget(this);
     QVBoxLayout *mainLayout = new QVBoxLayout(centralWidget);
@@ -47,6 +103,10 @@ void MainWindow::setupUI() {
             this, &MainWindow::onInstanceSelected);
     mainLayout->addWidget(m_instanceList);
 
+    // Live screens of the running instances
+    m_thumbnails = new InstanceGrid();
+    mainLayout->addWidget(m_thumbnails);
+
     // Control buttons
     QHBoxLayout *buttonLayout = new QHBoxLayout();
 
@@ -118,12 +178,17 @@ void MainWindow::loadInstances() {
         return;
     }
 
-    QStringList configFiles = instanceDir.entryList(QStringList() << "*.json", QDir::Files);
+    // Each instance lives in its own directory, next to its disk and
+    // sockets: instances/<name>/config.json
+    QStringList instanceNames = instanceDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
 
-    for (const QString& configFile : configFiles) {
-        QString fullPath = instanceDir.absoluteFilePath(configFile);
+    for (const QString& instanceName : instanceNames) {
+        QString instancePath = instanceDir.absoluteFilePath(instanceName);
         VMConfig config;
-        if (config.loadFromFile(fullPath)) {
+        if (config.loadFromFile(instancePath + "/config.json")) {
+            if (config.instancePath().isEmpty()) {
+                config.setInstancePath(instancePath);
+            }
             m_instances.append(config);
         }
     }
@@ -132,6 +197,7 @@ void MainWindow::loadInstances() {
 }
 
 void MainWindow::refreshInstanceList() {
+    int row = m_instanceList->currentRow();
     m_instanceList->clear();
 
     for (const VMConfig& config : m_instances) {
@@ -139,8 +205,53 @@ void MainWindow::refreshInstanceList() {
                                  .arg(config.name())
                                  .arg(config.cpuCores())
                                  .arg(config.ramMB() / 1024);
+
+        VMInstance *vm = runningVM(config.name());
+        if (vm && vm->isActive()) {
+            displayText += QString(" [%1, adb :%2")
+                               .arg(VMInstance::stateName(vm->state()))
+                               .arg(vm->adbPort());
+
+            if (vm->vncPort() > 0) {
+                displayText += QString(", vnc :%1").arg(vm->vncPort());
+            }
+
+            qint64 sharedMB = KsmController::pagesToMB(m_ksm->instanceStats(config.name()).mergingPages);
+            if (sharedMB > 0) {
+                displayText += QString(", %1 MB shared").arg(sharedMB);
+            }
+            displayText += "]";
+        } else if (vm && vm->state() == VMInstance::Error) {
+            displayText += " [Error]";
+        }
         m_instanceList->addItem(displayText);
     }
+
+    if (row >= 0 && row < m_instanceList->count()) {
+        m_instanceList->setCurrentRow(row);
+    }
+    updateButtons();
+}
+
+VMConfig *MainWindow::selectedInstance() {
+    int row = m_instanceList->currentRow();
+    if (row < 0 || row >= m_instances.size()) {
+        return nullptr;
+    }
+    return &m_instances[row];
+}
+
+void MainWindow::updateButtons() {
+    VMConfig *config = selectedInstance();
+    VMInstance *vm = config ? runningVM(config->name()) : nullptr;
+    bool running = vm && vm->isActive();
+
+    m_startButton->setEnabled(config && !running);
+    m_stopButton->setEnabled(running);
+    m_deleteButton->setEnabled(config && !running);
+
+    int count = m_qemuManager->runningCount();
+    m_statusLabel->setText(count > 0 ? QString("%1 instance(s) running").arg(count) : QString("Ready"));
 }
 
 void MainWindow::onNewInstance() {
@@ -153,6 +264,11 @@ void MainWindow::onNewInstance() {
         config.setCpuCores(wizard.cpuCores());
         config.setRamMB(wizard.ramMB());
 
+        QStringList resolution = wizard.resolution().split('x');
+        if (resolution.size() == 2) {
+            config.setResolution(QSize(resolution[0].toInt(), resolution[1].toInt()));
+        }
+
         // Set image path
         QString imagePath = SystemChecker::getAndroidImagePath();
         if (!imagePath.isEmpty()) {
@@ -166,49 +282,223 @@ void MainWindow::onNewInstance() {
 
         config.setInstancePath(instancePath);
 
-        // Save configuration
-        QString configPath = instancePath + "/config.json";
-        config.saveToFile(configPath);
+        if (config.imagePath().isEmpty()) {
+            finishNewInstance(config);
+            return;
+        }
 
-        m_instances.append(config);
-        refreshInstanceList();
+        if (DiskImageManager::isInstallerImage(config.imagePath()) &&
+            !QFile::exists(DiskImageManager::baseImagePath(config.imagePath()))) {
+            // No instance of the ISO has been installed yet; Android is
+            // installed onto this one's own disk, which becomes the base
+            QString diskPath = config.instancePath() + "/disk.qcow2";
+            QString error;
+            if (DiskImageManager::createInstallDisk(diskPath, &error)) {
+                config.setDiskPath(diskPath);
+            } else {
+                QMessageBox::warning(this, "Instance Disk",
+                                   "Cannot create the disk for '" + config.name() + "':\n" + error +
+                                   "\nThe instance will run from the image without a disk.");
+            }
+
+            if (!DiskImageManager::hasBootFiles(config.imagePath()) && !m_diskImages->isExtracting()) {
+                m_diskImages->ensureBootFiles(config.imagePath());
+            }
+            finishNewInstance(config);
+            return;
+        }
 
-        QMessageBox::information(this, "Instance Created",
-                               "Instance '" + config.name() + "' created successfully!");
+        // The instance disk is an overlay on the image's shared base,
+        // which is only built the first time the image is used
+        m_pendingInstances.append(config);
+        m_statusLabel->setText("Preparing disk for " + config.name() + "...");
+        if (!m_diskImages->isBusy()) {
+            m_diskImages->ensureBaseImage(config.imagePath());
+        }
     }
 }
 
-void MainWindow::onStartInstance() {
-    int row = m_instanceList->currentRow();
-    if (row < 0 || row >= m_instances.size()) {
+void MainWindow::onInstanceStopped(const QString& name) {
+    const VMConfig *config = nullptr;
+    for (const VMConfig& candidate : m_instances) {
+        if (candidate.name() == name) {
+            config = &candidate;
+        }
+    }
+
+    // The first finished install of an ISO becomes its shared base
+    if (!config || !m_promotingInstance.isEmpty() || m_diskImages->isBusy() ||
+        !DiskImageManager::isInstallerImage(config->imagePath()) ||
+        QFile::exists(DiskImageManager::baseImagePath(config->imagePath())) ||
+        config->diskPath().isEmpty() || !DiskImageManager::holdsInstall(config->diskPath())) {
         return;
     }
 
-    VMConfig& config = m_instances[row];
+    m_promotingInstance = name;
+    m_statusLabel->setText("Turning " + name + "'s installed disk into a shared base image...");
+    m_diskImages->promoteToBase(config->imagePath(), config->diskPath());
+}
+
+void MainWindow::finishPromotion(const QString& basePath) {
+    QString name = m_promotingInstance;
+    m_promotingInstance.clear();
+
+    for (const VMConfig& config : m_instances) {
+        if (config.name() != name) {
+            continue;
+        }
+
+        // The base holds exactly what the disk held, so an empty overlay
+        // on it shows the instance the same disk in a fraction of the space
+        QString overlayPath = config.diskPath() + ".overlay";
+        QString error;
+        if (!DiskImageManager::createOverlay(basePath, overlayPath, &error) ||
+            !QFile::remove(config.diskPath()) || !QFile::rename(overlayPath, config.diskPath())) {
+            QFile::remove(overlayPath);
+            qWarning() << "Keeping the standalone disk of" << name << ":" << error;
+            return;
+        }
+        m_statusLabel->setText(name + "'s disk is now the shared base image");
+    }
+}
+
+void MainWindow::onBaseImageReady(const QString& sourceImage, const QString& basePath) {
+    if (!m_promotingInstance.isEmpty()) {
+        finishPromotion(basePath);
+    }
+
+    for (int i = m_pendingInstances.size() - 1; i >= 0; --i) {
+        VMConfig config = m_pendingInstances[i];
+        if (config.imagePath() != sourceImage) {
+            continue;
+        }
+        m_pendingInstances.removeAt(i);
+
+        QString overlayPath = config.instancePath() + "/disk.qcow2";
+        QString error;
+        if (DiskImageManager::createOverlay(basePath, overlayPath, &error)) {
+            config.setDiskPath(overlayPath);
+        } else {
+            QMessageBox::warning(this, "Instance Disk",
+                               "Cannot create the disk for '" + config.name() + "':\n" + error +
+                               "\nThe instance will run from the image without a disk.");
+        }
+        finishNewInstance(config);
+    }
+
+    // Instances for another image may be waiting their turn
+    if (!m_pendingInstances.isEmpty()) {
+        m_diskImages->ensureBaseImage(m_pendingInstances.first().imagePath());
+    }
+}
+
+void MainWindow::onBootFilesError(const QString& sourceImage, const QString& error) {
+    // Instances keep booting from the ISO
+    qWarning() << "No direct boot for" << sourceImage << ":" << error;
+}
+
+void MainWindow::onBaseImageError(const QString& sourceImage, const QString& error) {
+    if (!m_promotingInstance.isEmpty()) {
+        qWarning() << "Cannot turn" << m_promotingInstance << "into a base image:" << error;
+        m_promotingInstance.clear();
+    }
+
+    for (int i = m_pendingInstances.size() - 1; i >= 0; --i) {
+        if (m_pendingInstances[i].imagePath() != sourceImage) {
+            continue;
+        }
+        VMConfig config = m_pendingInstances.takeAt(i);
+        QMessageBox::warning(this, "Instance Disk",
+                           "Cannot prepare the base image for '" + config.name() + "':\n" + error +
+                           "\nThe instance will run from the image without a disk.");
+        finishNewInstance(config);
+    }
 
-    if (!config.isValid()) {
+    if (!m_pendingInstances.isEmpty()) {
+        m_diskImages->ensureBaseImage(m_pendingInstances.first().imagePath());
+    }
+}
+
+void MainWindow::finishNewInstance(const VMConfig& config) {
+    // Save configuration
+    QString configPath = config.instancePath() + "/config.json";
+    config.saveToFile(configPath);
+
+    m_instances.append(config);
+    refreshInstanceList();
+
+    QString message = "Instance '" + config.name() + "' created successfully!";
+    if (DiskImageManager::isInstallerImage(config.imagePath()) && !config.diskPath().isEmpty() &&
+        DiskImageManager::backingFile(config.diskPath()).isEmpty()) {
+        message += "\n\nInstall Android onto this instance's disk. Once it has been installed "
+                   "and the instance is stopped, its disk becomes the shared base image and "
+                   "later instances of this ISO start as thin overlays on it.";
+    }
+    QMessageBox::information(this, "Instance Created", message);
+}
+
+void MainWindow::onStartInstance() {
+    VMConfig *config = selectedInstance();
+    if (!config) {
+        return;
+    }
+
+    if (!config->isValid()) {
         QMessageBox::warning(this, "Invalid Configuration",
-                           "Cannot start instance: " + config.validationError());
+                           "Cannot start instance: " + config->validationError());
         return;
     }
 
-    m_statusLabel->setText("Starting " + config.name() + "...");
-    m_currentInstance = &config;
+    if (config->name() == m_promotingInstance) {
+        QMessageBox::information(this, "Start Instance",
+                               "The disk of '" + config->name() + "' is being turned into a "
+                               "shared base image. Try again in a moment.");
+        return;
+    }
 
-    if (m_qemuManager->startVM(config)) {
-        m_startButton->setEnabled(false);
-        m_stopButton->setEnabled(true);
-    } else {
-        QMessageBox::critical(this, "Start Failed",
-                            "Failed to start instance: " + m_qemuManager->getStatus());
-        m_statusLabel->setText("Failed to start");
+    // A pooled instance starts as a booted, paused clone; the pool boots
+    // a replacement in the background
+    WarmPool *pool = m_pools.value(config->name());
+    if (VMInstance *vm = pool ? pool->acquire() : nullptr) {
+        QString name = config->name();
+        m_pooledRuns.insert(name, vm);
+        connect(vm, &VMInstance::stopped, this, [this, name, vm]() {
+            if (m_pooledRuns.value(name) == vm) {
+                m_pooledRuns.remove(name);
+            }
+            refreshInstanceList();
+        });
+        m_statusLabel->setText(name + " started from its warm pool");
+        refreshInstanceList();
+        return;
     }
+
+    m_statusLabel->setText("Starting " + config->name() + "...");
+
+    // Failures are reported through onInstanceError()
+    m_qemuManager->startVM(*config);
+
+    // This start still goes through the ISO's bootloader; later ones
+    // boot the extracted kernel
+    if (config->directBoot() && DiskImageManager::isInstallerImage(config->imagePath()) &&
+        !DiskImageManager::hasBootFiles(config->imagePath()) && !m_diskImages->isExtracting()) {
+        m_diskImages->ensureBootFiles(config->imagePath());
+    }
+    refreshInstanceList();
 }
 
 void MainWindow::onStopInstance() {
-    if (m_qemuManager->isRunning()) {
-        m_qemuManager->stopVM();
+    VMConfig *config = selectedInstance();
+    if (!config) {
+        return;
     }
+
+    if (VMInstance *vm = m_pooledRuns.value(config->name())) {
+        // Discards the clone's disk; the instance's own disk is untouched
+        m_pools.value(config->name())->release(vm);
+        return;
+    }
+    m_qemuManager->stopVM(config->name());
 }
 
 void MainWindow::onDeleteInstance() {
@@ -218,6 +508,11 @@ void MainWindow::onDeleteInstance() {
     }
 
     const VMConfig& config = m_instances[row];
+    VMInstance *vm = runningVM(config.name());
+    if (vm && vm->isActive()) {
+        QMessageBox::warning(this, "Delete Instance", "Stop the instance before deleting it.");
+        return;
+    }
 
     auto reply = QMessageBox::question(this, "Delete Instance",
                                       QString("Are you sure you want to delete '%1'?").arg(config.name()),
@@ -228,6 +523,11 @@ void MainWindow::onDeleteInstance() {
         QDir instanceDir(config.instancePath());
         instanceDir.removeRecursively();
 
+        m_qemuManager->removeInstance(config.name());
+        if (WarmPool *pool = m_pools.take(config.name())) {
+            pool->stop();
+            pool->deleteLater();
+        }
         m_instances.removeAt(row);
         refreshInstanceList();
 
@@ -249,27 +549,34 @@ void MainWindow::onAbout() {
 }
 
 void MainWindow::onInstanceSelected() {
-    bool hasSelection = m_instanceList->currentRow() >= 0;
-    m_startButton->setEnabled(hasSelection && !m_qemuManager->isRunning());
-    m_deleteButton->setEnabled(hasSelection);
+    updateButtons();
 }
 
-void MainWindow::onVMStarted() {
-    m_statusLabel->setText("Running: " + (m_currentInstance ? m_currentInstance->name() : "Unknown"));
-    m_startButton->setEnabled(false);
-    m_stopButton->setEnabled(true);
+void MainWindow::onInstanceStarted(const QString& name) {
+    VMInstance *vm = m_qemuManager->instance(name);
+    m_trayIcon->showMessage("LinuxDroid",
+                            QString("%1 started (adb port %2)").arg(name).arg(vm ? vm->adbPort() : 0),
+                            QSystemTrayIcon::Information, 3000);
+}
 
-    m_trayIcon->showMessage("LinuxDroid", "Android instance started", QSystemTrayIcon::Information, 3000);
+void MainWindow::onInstanceStateChanged(const QString& name, VMInstance::State state) {
+    Q_UNUSED(name);
+    Q_UNUSED(state);
+    refreshInstanceList();
 }
 
-void MainWindow::onVMStopped() {
-    m_statusLabel->setText("Stopped");
-    m_startButton->setEnabled(true);
-    m_stopButton->setEnabled(false);
-    m_currentInstance = nullptr;
+void MainWindow::onInstanceError(const QString& name, const QString& error) {
+    refreshInstanceList();
+    m_statusLabel->setText(name + ": " + error);
+    QMessageBox::critical(this, "VM Error", name + ": " + error);
 }
 
-void MainWindow::onVMError(const QString& error) {
-    m_statusLabel->setText("Error: " + error);
-    QMessageBox::critical(this, "VM Error", error);
+void MainWindow::onThumbnailClicked(const QString& name) {
+    for (int i = 0; i < m_instances.size(); ++i) {
+        VMInstance *pooled = m_pooledRuns.value(m_instances[i].name());
+        if (m_instances[i].name() == name || (pooled && pooled->name() == name)) {
+            m_instanceList->setCurrentRow(i);
+            return;
+        }
+    }
 }
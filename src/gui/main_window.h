@@ -8,6 +8,12 @@
 #include <QSystemTrayIcon>
 #include "../core/qemu_manager.h"
 #include "../core/vm_config.h"
+#include "../core/disk_image_manager.h"
+#include "../core/balloon_controller.h"
+#include "../core/ksm_controller.h"
+#include "../core/framebuffer_capture.h"
+#include "../core/warm_pool.h"
+#include "instance_grid.h"
 
 class MainWindow : public QMainWindow {
     Q_OBJECT
@@ -16,6 +22,10 @@ public:
     explicit MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    // Keeps size booted copies of the named instance ready; starting that
+    // instance then hands one out instead of cold booting
+    bool startWarmPool(const QString& name, int size);
+
 private slots:
     void onNewInstance();
     void onStartInstance();
@@ -24,9 +34,14 @@ private slots:
     void onSettings();
     void onAbout();
     void onInstanceSelected();
-    void onVMStarted();
-    void onVMStopped();
-    void onVMError(const QString& error);
+    void onInstanceStarted(const QString& name);
+    void onInstanceStateChanged(const QString& name, VMInstance::State state);
+    void onInstanceError(const QString& name, const QString& error);
+    void onInstanceStopped(const QString& name);
+    void onBaseImageReady(const QString& sourceImage, const QString& basePath);
+    void onBaseImageError(const QString& sourceImage, const QString& error);
+    void onBootFilesError(const QString& sourceImage, const QString& error);
+    void onThumbnailClicked(const QString& name);
 
 private:
     void setupUI();
@@ -36,9 +51,17 @@ private:
     void setupTrayIcon();
     void loadInstances();
     void refreshInstanceList();
+    void updateButtons();
+    void finishNewInstance(const VMConfig& config);
+    // Swaps the promoted instance's standalone disk for an overlay
+    void finishPromotion(const QString& basePath);
+    VMConfig *selectedInstance();
+    // The instance's own VM or the pool member handed out in its place
+    VMInstance *runningVM(const QString& name) const;
 
     // UI Components
     QListWidget *m_instanceList;
+    InstanceGrid *m_thumbnails;
     QPushButton *m_startButton;
     QPushButton *m_stopButton;
     QPushButton *m_deleteButton;
@@ -47,8 +70,15 @@ private:
 
     // Core
     QemuManager *m_qemuManager;
+    BalloonController *m_balloons;
+    KsmController *m_ksm;
+    FramebufferCapture *m_capture;
     QList<VMConfig> m_instances;
-    VMConfig *m_currentInstance;
+    DiskImageManager *m_diskImages;
+    QList<VMConfig> m_pendingInstances;  // Waiting for their base image
+    QString m_promotingInstance;  // Whose disk is becoming a base image
+    QMap<QString, WarmPool*> m_pools;
+    QMap<QString, VMInstance*> m_pooledRuns;  // Instance name -> handed-out member
 };
 
 #endif // MAIN_WINDOW_H
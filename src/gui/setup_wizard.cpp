@@ -1,4 +1,5 @@
 #include "setup_wizard.h"
+#include "../core/vm_config.h"
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QGridLayout>
@@ -8,6 +9,7 @@
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QDir>
+#include <QFileInfo>
 #include <QPixmap>
 #include <QThread>
 #include <QGroupBox>
@@ -37,10 +39,13 @@ SetupWizard::SetupWizard(QWidget *parent)
 SetupWizard::~SetupWizard() {
 }
 
-void SetupWizard::setSelectedImage(const QString& url, const QString& name, qint64 size) {
+void SetupWizard::setSelectedImage(const QString& url, const QString& name, qint64 size,
+                                   const QString& sha256, const QStringList& mirrors) {
     m_selectedImageUrl = url;
     m_selectedImageName = name;
     m_selectedImageSize = size;
+    m_selectedImageSha256 = sha256;
+    m_selectedImageMirrors = mirrors;
 }
 
 void SetupWizard::setInstanceConfig(const QString& name, int cores, int ram, const QString& res, bool root) {
@@ -295,15 +300,48 @@ void ImageSelectionPage::setupUI() {
 
 void ImageSelectionPage::loadAvailableImages() {
     // Load from bundled JSON or use defaults
+    QFile file("/opt/linuxdroid/android_images.json");
+    if (file.open(QIODevice::ReadOnly)) {
+        QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+
+        for (const QJsonValue& value : root["images"].toArray()) {
+            QJsonObject obj = value.toObject();
+
+            ImageInfo img;
+            img.name = obj["name"].toString() + " - " + obj["architecture"].toString("x86_64");
+            img.version = obj["version"].toString();
+            img.url = obj["url"].toString();
+            img.sizeMB = obj["size_mb"].toInt();
+            img.sha256 = obj["sha256"].toString();
+            img.recommended = obj["recommended"].toBool(false);
+
+            QString mirror = obj["mirror_url"].toString();
+            if (!mirror.isEmpty()) {
+                img.mirrors << mirror;
+            }
+
+            if (!img.url.isEmpty()) {
+                m_availableImages.append(img);
+            }
+        }
+    }
+
+    if (!m_availableImages.isEmpty()) {
+        return;
+    }
+
     m_availableImages = {
         {"Android 9.0 (Pie) - x86_64", "9.0",
          "https://sourceforge.net/projects/android-x86/files/Release%209.0/android-x86_64-9.0-r2.iso/download",
+         {"https://osdn.net/projects/android-x86/downloads/69704/android-x86_64-9.0-r2.iso"},
          1200, "", true},
         {"Android 11 (R) - x86_64", "11.0",
          "https://sourceforge.net/projects/android-x86/files/Release%2011/android-x86_64-11.0-r4.iso/download",
+         {"https://osdn.net/projects/android-x86/downloads/75303/android-x86_64-11.0-r4.iso"},
          1400, "", false},
         {"Android 13 (Tiramisu) - x86_64", "13.0",
          "https://sourceforge.net/projects/android-x86/files/Release%2013/android-x86_64-13.0-r1.iso/download",
+         {},
          1600, "", false}
     };
 }
@@ -317,7 +355,13 @@ void ImageSelectionPage::onImageSelected(int index) {
     m_imageSizeLabel->setText(QString("Size: %1 MB (%2 GB)")
                                   .arg(img.sizeMB)
                                   .arg(img.sizeMB / 1024.0, 0, 'f', 2));
-    m_imageSourceLabel->setText("Source: SourceForge/Android-x86 Project");
+    if (img.mirrors.isEmpty()) {
+        m_imageSourceLabel->setText("Source: SourceForge/Android-x86 Project");
+    } else {
+        m_imageSourceLabel->setText(QString("Source: SourceForge/Android-x86 Project (+%1 mirror%2, fastest is used)")
+                                        .arg(img.mirrors.size())
+                                        .arg(img.mirrors.size() == 1 ? "" : "s"));
+    }
 }
 
 void ImageSelectionPage::initializePage() {
@@ -331,7 +375,7 @@ bool ImageSelectionPage::validatePage() {
 
         SetupWizard *wiz = qobject_cast<SetupWizard*>(wizard());
         if (wiz) {
-            wiz->setSelectedImage(img.url, img.name, img.sizeMB * 1024 * 1024);
+            wiz->setSelectedImage(img.url, img.name, img.sizeMB * 1024 * 1024, img.sha256, img.mirrors);
         }
 
         return true;
@@ -344,7 +388,11 @@ bool ImageSelectionPage::validatePage() {
 DownloadProgressPage::DownloadProgressPage(QWidget *parent)
     : QWizardPage(parent),
       m_downloadManager(nullptr),
-      m_downloadComplete(false) {
+      m_verifier(new ImageVerifier(this)),
+      m_downloadComplete(false),
+      m_control(nullptr),
+      m_enqueueRequest(-1),
+      m_daemonJob(-1) {
 
     setTitle("Downloading Android Image");
     setSubTitle("Please wait while the Android system image is downloaded");
@@ -388,6 +436,9 @@ void DownloadProgressPage::setupUI() {
 
 void DownloadProgressPage::initializePage() {
     m_downloadComplete = false;
+    m_daemonJob = -1;
+    m_enqueueRequest = -1;
+    m_backgroundButton->setEnabled(true);
     m_downloadManager = new DownloadManager(this);
 
     connect(m_downloadManager, &DownloadManager::downloadProgress,
@@ -396,8 +447,10 @@ void DownloadProgressPage::initializePage() {
             this, &DownloadProgressPage::onDownloadFinished);
     connect(m_downloadManager, &DownloadManager::downloadError,
             this, &DownloadProgressPage::onDownloadError);
-    connect(m_downloadManager, &DownloadManager::downloadSpeedUpdated,
-            this, &DownloadProgressPage::onSpeedUpdated);
+    connect(m_downloadManager, &DownloadManager::downloadStatsUpdated,
+            this, &DownloadProgressPage::onStatsUpdated);
+    connect(m_downloadManager, &DownloadManager::checksumVerified,
+            this, &DownloadProgressPage::onChecksumVerified);
 
     startDownload();
 }
@@ -417,10 +470,12 @@ void DownloadProgressPage::startDownload() {
 
     // Extract filename from name
     QString filename = name.split(" - ").first().replace(" ", "_") + ".iso";
-    QString destination = "/opt/linuxdroid/images/" + filename;
+    m_destination = "/opt/linuxdroid/images/" + filename;
 
     m_statusLabel->setText("Downloading: " + name);
-    m_downloadManager->startDownload(url, destination);
+    m_downloadManager->setExpectedChecksum(wiz->selectedImageSha256());
+    m_downloadManager->setMirrorUrls(wiz->selectedImageMirrors());
+    m_downloadManager->startDownload(url, m_destination);
 }
 
 void DownloadProgressPage::onDownloadProgress(qint64 received, qint64 total) {
@@ -445,6 +500,13 @@ void DownloadProgressPage::onDownloadFinished(const QString& filePath) {
     m_backgroundButton->setEnabled(false);
     m_cancelButton->setEnabled(false);
 
+    // Unverified images get their chunk manifest right away; verified
+    // ones once checksumVerified confirms the content
+    SetupWizard *wiz = qobject_cast<SetupWizard*>(wizard());
+    if (wiz && wiz->selectedImageSha256().isEmpty()) {
+        m_verifier->createManifest(filePath);
+    }
+
     emit completeChanged();
 }
 
@@ -456,16 +518,147 @@ void DownloadProgressPage::onDownloadError(const QString& error) {
                         "Failed to download Android image:\n" + error);
 }
 
-void DownloadProgressPage::onSpeedUpdated(double bytesPerSecond) {
-    m_speedLabel->setText("Speed: " + formatSpeed(bytesPerSecond));
+void DownloadProgressPage::onStatsUpdated(const DownloadManager::TransferStats& stats) {
+    QString speed = "Speed: " + formatSpeed(stats.bytesPerSecond);
+    if (stats.connections.size() > 1) {
+        speed += QString(" (%1 connections)").arg(stats.connections.size());
+    }
+    m_speedLabel->setText(speed);
     m_timeLabel->setText("Time remaining: " + m_downloadManager->estimatedTimeRemaining());
 }
 
+void DownloadProgressPage::onChecksumVerified(bool success) {
+    if (success) {
+        m_statusLabel->setText("✅ Download completed and verified!");
+        m_verifier->createManifest(m_downloadedFilePath);
+        return;
+    }
+
+    m_downloadComplete = false;
+    m_statusLabel->setText("❌ Checksum verification failed");
+    emit completeChanged();
+
+    QMessageBox::critical(this, "Verification Error",
+                        "The downloaded image does not match its SHA256 checksum.\n"
+                        "Please retry the download.");
+}
+
 void DownloadProgressPage::onBackgroundClicked() {
-    QMessageBox::information(this, "Background Download",
-                           "Download will continue in the background.\n"
-                           "You can check progress in the system tray.");
-    // In production, this would minimize to tray
+    SetupWizard *wiz = qobject_cast<SetupWizard*>(wizard());
+    if (!wiz || m_downloadComplete || m_enqueueRequest >= 0 || m_daemonJob >= 0) {
+        return;
+    }
+
+    if (!m_control) {
+        m_control = new ControlClient(this);
+        connect(m_control, &ControlClient::replyReceived,
+                this, &DownloadProgressPage::onDaemonReply);
+        connect(m_control, &ControlClient::jobProgress,
+                this, &DownloadProgressPage::onDaemonProgress);
+        connect(m_control, &ControlClient::jobStateChanged,
+                this, &DownloadProgressPage::onDaemonStateChanged);
+        connect(m_control, &ControlClient::disconnected,
+                this, &DownloadProgressPage::onDaemonDisconnected);
+    }
+
+    if (!m_control->isConnected() && !m_control->connectToDaemon()) {
+        QMessageBox::information(this, "Background Download",
+                               "The LinuxDroid download service is not running.\n"
+                               "The download will continue here.");
+        return;
+    }
+
+    // The daemon continues from the .part state saved by the pause
+    m_downloadManager->pauseDownload();
+    m_backgroundButton->setEnabled(false);
+    m_statusLabel->setText("Handing download to the background service...");
+
+    m_enqueueRequest = m_control->enqueue(wiz->selectedImageUrl(), m_destination,
+                                          wiz->selectedImageSha256(), 0,
+                                          wiz->selectedImageMirrors());
+}
+
+void DownloadProgressPage::onDaemonReply(int requestId, bool ok, const QJsonObject& reply) {
+    if (requestId != m_enqueueRequest) {
+        return;
+    }
+    m_enqueueRequest = -1;
+
+    if (!ok) {
+        resumeInForeground(reply["error"].toString());
+        return;
+    }
+
+    m_daemonJob = reply["job"].toObject()["id"].toInt();
+    m_control->subscribe(m_daemonJob);
+    m_statusLabel->setText("Downloading in background: " +
+                           QFileInfo(m_destination).fileName());
+}
+
+void DownloadProgressPage::onDaemonProgress(int jobId, const QJsonObject& progress) {
+    if (jobId != m_daemonJob) {
+        return;
+    }
+
+    onDownloadProgress(progress["bytesReceived"].toVariant().toLongLong(),
+                       progress["totalBytes"].toVariant().toLongLong());
+
+    if (progress.contains("bytesPerSecond")) {
+        m_speedLabel->setText("Speed: " + formatSpeed(progress["bytesPerSecond"].toDouble()));
+        m_timeLabel->setText("Time remaining: " + DownloadManager::formatTimeRemaining(
+                                 progress["secondsRemaining"].toVariant().toLongLong()));
+    }
+}
+
+void DownloadProgressPage::onDaemonStateChanged(const QJsonObject& job) {
+    if (job["id"].toInt() != m_daemonJob) {
+        return;
+    }
+
+    QString state = job["state"].toString();
+    if (state == "completed") {
+        // The daemon has already checked the SHA256 and builds the chunk
+        // manifest itself
+        m_daemonJob = -1;
+        m_downloadComplete = true;
+        m_downloadedFilePath = job["destination"].toString();
+        m_statusLabel->setText("✅ Download completed successfully!");
+        m_progressBar->setValue(100);
+        m_cancelButton->setEnabled(false);
+        emit completeChanged();
+    } else if (state == "failed") {
+        m_daemonJob = -1;
+        onDownloadError(job["error"].toString());
+    } else if (state == "paused") {
+        m_statusLabel->setText("Background download paused");
+    } else if (state == "active") {
+        m_statusLabel->setText("Downloading in background: " +
+                               QFileInfo(m_destination).fileName());
+    }
+}
+
+void DownloadProgressPage::onDaemonDisconnected() {
+    if (m_enqueueRequest >= 0) {
+        m_enqueueRequest = -1;
+        resumeInForeground("The background service went away");
+        return;
+    }
+
+    // The job itself lives on in the daemon's queue
+    if (m_daemonJob >= 0) {
+        m_statusLabel->setText("Lost connection to the background service; "
+                               "the download continues there");
+    }
+}
+
+void DownloadProgressPage::resumeInForeground(const QString& reason) {
+    m_statusLabel->setText("Downloading: " + QFileInfo(m_destination).fileName());
+    m_backgroundButton->setEnabled(true);
+    m_downloadManager->resumeDownload();
+
+    QMessageBox::warning(this, "Background Download",
+                       "The download could not be handed to the background service:\n" +
+                       reason + "\nIt will continue here.");
 }
 
 void DownloadProgressPage::onCancelClicked() {
@@ -474,7 +667,10 @@ void DownloadProgressPage::onCancelClicked() {
                                       QMessageBox::Yes | QMessageBox::No);
 
     if (reply == QMessageBox::Yes) {
-        if (m_downloadManager) {
+        if (m_daemonJob >= 0 && m_control->isConnected()) {
+            m_control->cancel(m_daemonJob);
+            m_control->disconnectFromDaemon();
+        } else if (m_downloadManager) {
             m_downloadManager->cancelDownload();
         }
         wizard()->reject();
@@ -523,9 +719,13 @@ void InstanceSetupPage::setupUI() {
     QGroupBox *resGroup = new QGroupBox("Display Resolution");
     QVBoxLayout *resLayout = new QVBoxLayout(resGroup);
     m_resolutionCombo = new QComboBox();
-    m_resolutionCombo->addItems({"1280x720 (720p)", "1920x1080 (1080p)",
-                                 "2560x1440 (1440p)", "3840x2160 (4K)"});
-    m_resolutionCombo->setCurrentIndex(1);  // Default 1080p
+    for (const VMConfig::DisplayPreset& preset : VMConfig::displayPresets()) {
+        m_resolutionCombo->addItem(QString("%1x%2 (%3)")
+                                       .arg(preset.resolution.width())
+                                       .arg(preset.resolution.height())
+                                       .arg(preset.name));
+    }
+    m_resolutionCombo->setCurrentIndex(m_resolutionCombo->findText("1920x1080", Qt::MatchStartsWith));  // Default 1080p
     resLayout->addWidget(m_resolutionCombo);
     layout->addWidget(resGroup);
 
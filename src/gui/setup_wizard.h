@@ -12,6 +12,8 @@
 #include <QRadioButton>
 #include "../utils/system_checker.h"
 #include "../core/download_manager.h"
+#include "../core/image_verifier.h"
+#include "../core/control_client.h"
 
 // Forward declarations
 class WelcomePage;
@@ -41,19 +43,25 @@ public:
     QString selectedImageUrl() const { return m_selectedImageUrl; }
     QString selectedImageName() const { return m_selectedImageName; }
     qint64 selectedImageSize() const { return m_selectedImageSize; }
+    QString selectedImageSha256() const { return m_selectedImageSha256; }
+    QStringList selectedImageMirrors() const { return m_selectedImageMirrors; }
     QString instanceName() const { return m_instanceName; }
     int cpuCores() const { return m_cpuCores; }
     int ramMB() const { return m_ramMB; }
     QString resolution() const { return m_resolution; }
     bool rootEnabled() const { return m_rootEnabled; }
 
-    void setSelectedImage(const QString& url, const QString& name, qint64 size);
+    void setSelectedImage(const QString& url, const QString& name, qint64 size,
+                          const QString& sha256 = QString(),
+                          const QStringList& mirrors = QStringList());
     void setInstanceConfig(const QString& name, int cores, int ram, const QString& res, bool root);
 
 private:
     QString m_selectedImageUrl;
     QString m_selectedImageName;
     qint64 m_selectedImageSize;
+    QString m_selectedImageSha256;
+    QStringList m_selectedImageMirrors;
     QString m_instanceName;
     int m_cpuCores;
     int m_ramMB;
@@ -131,6 +139,7 @@ private:
         QString name;
         QString version;
         QString url;
+        QStringList mirrors;
         qint64 sizeMB;
         QString sha256;
         bool recommended;
@@ -153,13 +162,19 @@ private slots:
     void onDownloadProgress(qint64 received, qint64 total);
     void onDownloadFinished(const QString& filePath);
     void onDownloadError(const QString& error);
-    void onSpeedUpdated(double bytesPerSecond);
+    void onStatsUpdated(const DownloadManager::TransferStats& stats);
+    void onChecksumVerified(bool success);
     void onBackgroundClicked();
     void onCancelClicked();
+    void onDaemonReply(int requestId, bool ok, const QJsonObject& reply);
+    void onDaemonProgress(int jobId, const QJsonObject& progress);
+    void onDaemonStateChanged(const QJsonObject& job);
+    void onDaemonDisconnected();
 
 private:
     void setupUI();
     void startDownload();
+    void resumeInForeground(const QString& reason);
     QString formatSize(qint64 bytes) const;
     QString formatSpeed(double bytesPerSecond) const;
 
@@ -172,8 +187,15 @@ private:
     QPushButton *m_cancelButton;
 
     DownloadManager *m_downloadManager;
+    ImageVerifier *m_verifier;
     bool m_downloadComplete;
+    QString m_destination;
     QString m_downloadedFilePath;
+
+    // Set once the download has been handed to linuxdroid-daemon
+    ControlClient *m_control;
+    int m_enqueueRequest;
+    int m_daemonJob;
 };
 
 // Instance Setup Page
@@ -1,4 +1,5 @@
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QFile>
 #include <QMessageBox>
 #include <QDebug>
@@ -14,6 +15,28 @@ int main(int argc, char *argv[]) {
     app.setOrganizationName("TripleTech");
     app.setOrganizationDomain("tripletech.com");
 
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Android emulator for Linux");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    QCommandLineOption warmPoolOption("warm-pool",
+        "Keep booted, paused copies of an instance ready; starting it hands one out.", "instance");
+    QCommandLineOption poolSizeOption("pool-size",
+        "Copies kept ready for --warm-pool, as free memory allows.", "n", "2");
+    parser.addOptions({warmPoolOption, poolSizeOption});
+    parser.process(app);
+
+    // Answered long before the first instance starts
+    SystemChecker::probeQemuIoUring();
+
+    // Applied once the main window has loaded its instances
+    auto startPool = [&parser, &warmPoolOption, &poolSizeOption](MainWindow& window) {
+        if (parser.isSet(warmPoolOption)) {
+            window.startWarmPool(parser.value(warmPoolOption),
+                                 qMax(1, parser.value(poolSizeOption).toInt()));
+        }
+    };
+
     // Check if first run
     bool firstRun = QFile::exists("/opt/linuxdroid/.first_run");
 
@@ -31,6 +54,7 @@ int main(int argc, char *argv[]) {
             // Launch main window
             MainWindow window;
             window.show();
+            startPool(window);
             return app.exec();
         } else {
             qDebug() << "Setup cancelled by user";
@@ -65,6 +89,7 @@ int main(int argc, char *argv[]) {
         // Launch main window
         MainWindow window;
         window.show();
+        startPool(window);
         return app.exec();
     }
 }
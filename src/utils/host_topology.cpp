@@ -0,0 +1,203 @@
+#include "host_topology.h"
+#include <QDir>
+#include <QFile>
+#include <QRegularExpression>
+#include <algorithm>
+
+namespace {
+
+QString readFile(const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QString();
+    }
+    return QString::fromLatin1(file.readAll()).trimmed();
+}
+
+int readInt(const QString& path, int fallback) {
+    bool ok = false;
+    int value = readFile(path).toInt(&ok);
+    return ok ? value : fallback;
+}
+
+// "Node 0 MemFree:   123456 kB" from a node's meminfo, in MB
+qint64 nodeMemoryMB(const QString& meminfo, const QString& field) {
+    QRegularExpression re(field + ":\\s+(\\d+) kB");
+    QRegularExpressionMatch match = re.match(meminfo);
+    return match.hasMatch() ? match.captured(1).toLongLong() / 1024 : 0;
+}
+
+} // namespace
+
+HostTopology HostTopology::detect(const QString& sysfsRoot) {
+    HostTopology topology;
+    QString cpuRoot = sysfsRoot + "/devices/system/cpu";
+    QString nodeRoot = sysfsRoot + "/devices/system/node";
+
+    QVector<int> online = parseCpuList(readFile(cpuRoot + "/online"));
+    if (online.isEmpty()) {
+        // Very old kernels or no sysfs; treat everything as one node
+        online = parseCpuList(readFile(cpuRoot + "/present"));
+    }
+
+    QMap<int, int> nodeOf;
+    QDir nodes(nodeRoot);
+    for (const QString& entry : nodes.entryList(QStringList() << "node*", QDir::Dirs)) {
+        bool ok = false;
+        int id = entry.mid(4).toInt(&ok);
+        if (!ok) {
+            continue;
+        }
+
+        Node node;
+        node.id = id;
+        node.cpus = parseCpuList(readFile(nodes.filePath(entry + "/cpulist")));
+        QString meminfo = readFile(nodes.filePath(entry + "/meminfo"));
+        node.totalMemoryMB = nodeMemoryMB(meminfo, "MemTotal");
+        node.freeMemoryMB = nodeMemoryMB(meminfo, "MemFree");
+
+        for (int cpu : node.cpus) {
+            nodeOf[cpu] = id;
+        }
+        if (!node.cpus.isEmpty()) {
+            topology.m_nodes.append(node);
+        }
+    }
+
+    for (int id : online) {
+        QString base = QString("%1/cpu%2/topology/").arg(cpuRoot).arg(id);
+        Cpu cpu;
+        cpu.id = id;
+        cpu.core = readInt(base + "core_id", id);
+        cpu.package = readInt(base + "physical_package_id", 0);
+        cpu.node = nodeOf.value(id, 0);
+        topology.m_cpus.append(cpu);
+    }
+
+    if (topology.m_nodes.isEmpty()) {
+        Node node;
+        for (const Cpu& cpu : topology.m_cpus) {
+            node.cpus.append(cpu.id);
+        }
+        topology.m_nodes.append(node);
+    }
+
+    std::sort(topology.m_nodes.begin(), topology.m_nodes.end(),
+              [](const Node& a, const Node& b) { return a.id < b.id; });
+    return topology;
+}
+
+HostTopology::Placement HostTopology::place(int vcpus, qint64 memoryMB,
+                                            const QSet<int>& reserved) const {
+    Placement placement;
+    if (vcpus <= 0) {
+        return placement;
+    }
+
+    // Least loaded node that can hold the whole guest, CPUs and memory
+    int bestNode = -1;
+    int bestFree = 0;
+    for (const Node& node : m_nodes) {
+        int free = 0;
+        for (const QVector<int>& core : freeCores(node.id, reserved)) {
+            free += core.size();
+        }
+        bool memoryFits = node.freeMemoryMB == 0 || node.freeMemoryMB >= memoryMB;
+        if (free >= vcpus && memoryFits && free > bestFree) {
+            bestNode = node.id;
+            bestFree = free;
+        }
+    }
+
+    QVector<QVector<int>> cores = freeCores(bestNode, reserved);
+
+    // Whole cores first, so two guests never share a core's execution
+    // units; leftover single threads only when nothing else is left
+    std::stable_sort(cores.begin(), cores.end(), [](const QVector<int>& a, const QVector<int>& b) {
+        return a.size() > b.size();
+    });
+
+    for (const QVector<int>& core : cores) {
+        for (int cpu : core) {
+            if (placement.cpus.size() < vcpus) {
+                placement.cpus.append(cpu);
+            }
+        }
+    }
+
+    if (placement.cpus.size() < vcpus) {
+        return Placement();
+    }
+
+    // Only a single node's memory can be bound
+    placement.node = (m_nodes.size() > 1) ? bestNode : -1;
+    return placement;
+}
+
+QVector<QVector<int>> HostTopology::freeCores(int node, const QSet<int>& reserved) const {
+    // A core is identified by package and core id
+    QMap<QPair<int, int>, QVector<int>> byCore;
+    QSet<QPair<int, int>> busyCores;
+
+    for (const Cpu& cpu : m_cpus) {
+        if (node >= 0 && cpu.node != node) {
+            continue;
+        }
+        QPair<int, int> key(cpu.package, cpu.core);
+        if (reserved.contains(cpu.id)) {
+            busyCores.insert(key);
+        } else {
+            byCore[key].append(cpu.id);
+        }
+    }
+
+    // Free siblings of a reserved CPU go last; they share a core with
+    // another guest
+    QVector<QVector<int>> whole;
+    QVector<QVector<int>> partial;
+    for (auto it = byCore.constBegin(); it != byCore.constEnd(); ++it) {
+        if (busyCores.contains(it.key())) {
+            for (int cpu : it.value()) {
+                partial.append(QVector<int>() << cpu);
+            }
+        } else {
+            whole.append(it.value());
+        }
+    }
+    return whole + partial;
+}
+
+QVector<int> HostTopology::parseCpuList(const QString& list) {
+    QVector<int> cpus;
+    for (const QString& part : list.split(',', Qt::SkipEmptyParts)) {
+        QStringList range = part.trimmed().split('-');
+        bool okFirst = false;
+        bool okLast = true;
+        int first = range[0].toInt(&okFirst);
+        int last = range.size() > 1 ? range[1].toInt(&okLast) : first;
+        if (!okFirst || !okLast) {
+            continue;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.append(cpu);
+        }
+    }
+    return cpus;
+}
+
+QString HostTopology::formatCpuList(const QVector<int>& cpus) {
+    QVector<int> sorted = cpus;
+    std::sort(sorted.begin(), sorted.end());
+
+    QStringList parts;
+    for (int i = 0; i < sorted.size();) {
+        int j = i;
+        while (j + 1 < sorted.size() && sorted[j + 1] == sorted[j] + 1) {
+            ++j;
+        }
+        parts << (i == j ? QString::number(sorted[i])
+                         : QString("%1-%2").arg(sorted[i]).arg(sorted[j]));
+        i = j + 1;
+    }
+    return parts.join(',');
+}
@@ -0,0 +1,62 @@
+#ifndef HOST_TOPOLOGY_H
+#define HOST_TOPOLOGY_H
+
+#include <QString>
+#include <QVector>
+#include <QMap>
+#include <QSet>
+#include <QPair>
+
+// Host CPU and NUMA layout as reported by sysfs, and exclusive placement
+// of VM instances on it. A placement is a set of host CPUs, whole physical
+// cores where possible, taken from a single NUMA node when one has room,
+// so a guest's vCPUs and memory stay on the same socket.
+class HostTopology {
+public:
+    struct Cpu {
+        int id = -1;
+        int core = -1;     // Physical core id, unique within a package
+        int package = -1;  // Socket
+        int node = 0;      // NUMA node
+    };
+
+    struct Node {
+        int id = 0;
+        QVector<int> cpus;
+        qint64 totalMemoryMB = 0;
+        qint64 freeMemoryMB = 0;
+    };
+
+    struct Placement {
+        int node = -1;      // -1: spans nodes, memory isn't bound
+        QVector<int> cpus;  // One host CPU per vCPU, siblings adjacent
+
+        bool isValid() const { return !cpus.isEmpty(); }
+    };
+
+    // Reads the current topology; sysfsRoot is for testing on a copy
+    static HostTopology detect(const QString& sysfsRoot = "/sys");
+
+    QVector<Cpu> cpus() const { return m_cpus; }
+    QVector<Node> nodes() const { return m_nodes; }
+    int cpuCount() const { return m_cpus.size(); }
+    int nodeCount() const { return m_nodes.size(); }
+
+    // Picks vcpus host CPUs that aren't in reserved, preferring a node with
+    // memoryMB free and whole cores. Invalid if there aren't enough free CPUs.
+    Placement place(int vcpus, qint64 memoryMB, const QSet<int>& reserved) const;
+
+    // "0-3,8,10-11" <-> {0,1,2,3,8,10,11}
+    static QVector<int> parseCpuList(const QString& list);
+    static QString formatCpuList(const QVector<int>& cpus);
+
+private:
+    // Free CPUs of the given node (all nodes for -1) grouped by core,
+    // cores ordered by id
+    QVector<QVector<int>> freeCores(int node, const QSet<int>& reserved) const;
+
+    QVector<Cpu> m_cpus;
+    QVector<Node> m_nodes;
+};
+
+#endif // HOST_TOPOLOGY_H
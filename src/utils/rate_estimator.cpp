@@ -0,0 +1,57 @@
+#include "rate_estimator.h"
+#include <cmath>
+
+RateEstimator::RateEstimator(double timeConstantSeconds)
+    : m_timeConstant(timeConstantSeconds),
+      m_rate(0.0),
+      m_primed(false),
+      m_windowStart(0),
+      m_windowBytes(0),
+      m_lastActivity(0) {
+}
+
+void RateEstimator::reset(qint64 nsecs) {
+    m_rate = 0.0;
+    m_primed = false;
+    m_windowStart = nsecs;
+    m_windowBytes = 0;
+    m_lastActivity = nsecs;
+}
+
+void RateEstimator::addBytes(qint64 bytes, qint64 nsecs) {
+    if (bytes <= 0) {
+        return;
+    }
+    if (!m_primed && m_windowBytes == 0) {
+        // Connection setup before the first byte is not transfer time
+        m_windowStart = nsecs;
+    }
+    m_windowBytes += bytes;
+    m_lastActivity = nsecs;
+    update(nsecs);
+}
+
+void RateEstimator::update(qint64 nsecs) {
+    qint64 elapsed = nsecs - m_windowStart;
+    if (elapsed < SAMPLE_WINDOW_NS || (!m_primed && m_windowBytes == 0)) {
+        return;
+    }
+
+    double seconds = elapsed / 1e9;
+    double sample = m_windowBytes / seconds;
+
+    if (!m_primed) {
+        // Don't ramp up from zero: the first window is the best estimate
+        // we have, which is what keeps the ETA sane right after a resume
+        m_rate = sample;
+        m_primed = true;
+    } else {
+        // A window of length dt carries weight 1 - e^(-dt/tau), which
+        // makes the average independent of how often samples arrive
+        double alpha = 1.0 - std::exp(-seconds / m_timeConstant);
+        m_rate += alpha * (sample - m_rate);
+    }
+
+    m_windowStart = nsecs;
+    m_windowBytes = 0;
+}
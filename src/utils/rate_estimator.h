@@ -0,0 +1,36 @@
+#ifndef RATE_ESTIMATOR_H
+#define RATE_ESTIMATOR_H
+
+#include <QtGlobal>
+
+// Exponentially weighted transfer rate. Bytes are collected into short
+// sample windows on a nanosecond clock; each closed window is folded into
+// the average with a weight that depends on its length, so irregular
+// readyRead timing and timer jitter don't show up as rate spikes.
+class RateEstimator {
+public:
+    explicit RateEstimator(double timeConstantSeconds = DEFAULT_TIME_CONSTANT);
+
+    // Starts over at time nsecs; the first full window sets the rate
+    void reset(qint64 nsecs);
+    void addBytes(qint64 bytes, qint64 nsecs);
+    // Closes the current window if it is due, decaying an idle rate
+    void update(qint64 nsecs);
+
+    double rate() const { return m_rate; }  // Bytes per second
+    bool hasRate() const { return m_primed; }
+    qint64 idleNsecs(qint64 nsecs) const { return nsecs - m_lastActivity; }
+
+    static constexpr double DEFAULT_TIME_CONSTANT = 3.0;
+    static constexpr qint64 SAMPLE_WINDOW_NS = 250 * 1000 * 1000;  // 250ms
+
+private:
+    double m_timeConstant;
+    double m_rate;
+    bool m_primed;
+    qint64 m_windowStart;
+    qint64 m_windowBytes;
+    qint64 m_lastActivity;
+};
+
+#endif // RATE_ESTIMATOR_H
@@ -0,0 +1,184 @@
+#include "sha256.h"
+#include <QDataStream>
+#include <QIODevice>
+#include <cstring>
+
+namespace {
+
+const quint32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+const QByteArray STATE_MAGIC = "SHA256S1";
+
+inline quint32 rotr(quint32 x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+} // namespace
+
+Sha256::Sha256() {
+    reset();
+}
+
+void Sha256::reset() {
+    m_state[0] = 0x6a09e667;
+    m_state[1] = 0xbb67ae85;
+    m_state[2] = 0x3c6ef372;
+    m_state[3] = 0xa54ff53a;
+    m_state[4] = 0x510e527f;
+    m_state[5] = 0x9b05688c;
+    m_state[6] = 0x1f83d9ab;
+    m_state[7] = 0x5be0cd19;
+    m_length = 0;
+    m_bufferSize = 0;
+}
+
+void Sha256::transform(const uchar *block) {
+    quint32 w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (quint32(block[i * 4]) << 24) | (quint32(block[i * 4 + 1]) << 16) |
+               (quint32(block[i * 4 + 2]) << 8) | quint32(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        quint32 s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        quint32 s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    quint32 a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    quint32 e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for (int i = 0; i < 64; ++i) {
+        quint32 S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        quint32 ch = (e & f) ^ (~e & g);
+        quint32 t1 = h + S1 + ch + K[i] + w[i];
+        quint32 S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        quint32 maj = (a & b) ^ (a & c) ^ (b & c);
+        quint32 t2 = S0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
+
+void Sha256::addData(const char *data, qint64 length) {
+    const uchar *input = reinterpret_cast<const uchar*>(data);
+    m_length += static_cast<quint64>(length);
+
+    // Top up a partially filled block first
+    if (m_bufferSize > 0) {
+        int take = static_cast<int>(qMin<qint64>(64 - m_bufferSize, length));
+        std::memcpy(m_buffer + m_bufferSize, input, take);
+        m_bufferSize += take;
+        input += take;
+        length -= take;
+
+        if (m_bufferSize < 64) {
+            return;
+        }
+        transform(m_buffer);
+        m_bufferSize = 0;
+    }
+
+    // Hash whole blocks straight from the caller's memory
+    while (length >= 64) {
+        transform(input);
+        input += 64;
+        length -= 64;
+    }
+
+    if (length > 0) {
+        std::memcpy(m_buffer, input, static_cast<size_t>(length));
+        m_bufferSize = static_cast<int>(length);
+    }
+}
+
+QByteArray Sha256::result() const {
+    // Pad a copy so the running state stays usable
+    Sha256 copy(*this);
+    quint64 bitLength = m_length * 8;
+
+    const char pad = static_cast<char>(0x80);
+    copy.addData(&pad, 1);
+
+    const char zeros[64] = {};
+    int fill = (copy.m_bufferSize <= 56) ? 56 - copy.m_bufferSize : 120 - copy.m_bufferSize;
+    copy.addData(zeros, fill);
+
+    char lengthBytes[8];
+    for (int i = 0; i < 8; ++i) {
+        lengthBytes[i] = static_cast<char>(bitLength >> (56 - i * 8));
+    }
+    copy.addData(lengthBytes, 8);
+
+    QByteArray digest(32, Qt::Uninitialized);
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<char>(copy.m_state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<char>(copy.m_state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<char>(copy.m_state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<char>(copy.m_state[i]);
+    }
+    return digest;
+}
+
+QByteArray Sha256::saveState() const {
+    QByteArray state;
+    QDataStream stream(&state, QIODevice::WriteOnly);
+    stream.writeRawData(STATE_MAGIC.constData(), STATE_MAGIC.size());
+    for (quint32 word : m_state) {
+        stream << word;
+    }
+    stream << m_length;
+    stream << QByteArray(reinterpret_cast<const char*>(m_buffer), m_bufferSize);
+    return state;
+}
+
+bool Sha256::restoreState(const QByteArray& state) {
+    if (!state.startsWith(STATE_MAGIC)) {
+        return false;
+    }
+
+    QDataStream stream(state.mid(STATE_MAGIC.size()));
+    quint32 words[8];
+    quint64 length;
+    QByteArray buffer;
+
+    for (quint32& word : words) {
+        stream >> word;
+    }
+    stream >> length >> buffer;
+
+    if (stream.status() != QDataStream::Ok || buffer.size() >= 64 ||
+        static_cast<quint64>(buffer.size()) != length % 64) {
+        return false;
+    }
+
+    std::memcpy(m_state, words, sizeof(m_state));
+    m_length = length;
+    m_bufferSize = buffer.size();
+    std::memcpy(m_buffer, buffer.constData(), static_cast<size_t>(m_bufferSize));
+    return true;
+}
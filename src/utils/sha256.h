@@ -0,0 +1,34 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+// Incremental SHA-256 whose intermediate state can be saved and restored.
+// QCryptographicHash keeps its state private, which makes it impossible to
+// continue a hash across a resumed download without re-reading the prefix.
+class Sha256 {
+public:
+    Sha256();
+
+    void reset();
+    void addData(const char *data, qint64 length);
+    void addData(const QByteArray& data) { addData(data.constData(), data.size()); }
+    QByteArray result() const;
+
+    qint64 bytesHashed() const { return static_cast<qint64>(m_length); }
+
+    // Opaque serialized form of the running state
+    QByteArray saveState() const;
+    bool restoreState(const QByteArray& state);
+
+private:
+    void transform(const uchar *block);
+
+    quint32 m_state[8];
+    quint64 m_length;
+    uchar m_buffer[64];
+    int m_bufferSize;
+};
+
+#endif // SHA256_H
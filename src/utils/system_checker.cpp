@@ -5,6 +5,50 @@
 #include <QStorageInfo>
 #include <QDebug>
 #include <QRegularExpression>
+#include <QSysInfo>
+#include <QThreadPool>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// -1 until the probe has finished
+std::atomic<int> qemuIoUring(-1);
+std::atomic<bool> qemuIoUringProbing(false);
+
+bool runQemuIoUringProbe() {
+    if (!SystemChecker::supportsIoUring()) {
+        return false;
+    }
+
+    // QEMU built without liburing rejects the drive and exits with an
+    // error; otherwise it waits on QMP, which quits it right away
+    QProcess process;
+    process.start("qemu-system-x86_64", QStringList()
+                      << "-machine" << "none" << "-nodefaults" << "-display" << "none"
+                      << "-drive" << "file=/dev/null,if=none,format=raw,readonly=on,aio=io_uring"
+                      << "-qmp" << "stdio");
+    if (!process.waitForStarted()) {
+        return false;
+    }
+    process.write("{\"execute\": \"qmp_capabilities\"}\n{\"execute\": \"quit\"}\n");
+    process.closeWriteChannel();
+    if (!process.waitForFinished(5000)) {
+        process.kill();
+        process.waitForFinished();
+        return false;
+    }
+
+    bool supported = process.exitStatus() == QProcess::NormalExit && process.exitCode() == 0;
+    if (!supported) {
+        qDebug() << "QEMU cannot use io_uring:"
+                 << QString::fromUtf8(process.readAllStandardError()).trimmed();
+    }
+    return supported;
+}
+
+} // namespace
 
 SystemChecker::SystemInfo SystemChecker::checkSystem() {
     SystemInfo info;
@@ -147,6 +191,31 @@ qint64 SystemChecker::getAvailableRAM() {
     return 0;
 }
 
+qint64 SystemChecker::getFreeHugePages(int pageSizeKB, int node) {
+    QString dir = node < 0
+        ? QString("/sys/kernel/mm/hugepages/hugepages-%1kB").arg(pageSizeKB)
+        : QString("/sys/devices/system/node/node%1/hugepages/hugepages-%2kB").arg(node).arg(pageSizeKB);
+
+    auto readCount = [&dir](const QString& name) -> qint64 {
+        QFile file(dir + "/" + name);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return 0;
+        }
+        return file.readAll().trimmed().toLongLong();
+    };
+
+    // Reserved pages are promised to mappings that haven't touched them
+    // yet; the per-node directories have no reservation count
+    qint64 free = readCount("free_hugepages");
+    qint64 reserved = node < 0 ? readCount("resv_hugepages") : 0;
+    return qMax<qint64>(0, free - reserved);
+}
+
+bool SystemChecker::hasFreeHugePages(qint64 memoryMB, int pageSizeKB, int node) {
+    qint64 needed = (memoryMB * 1024 + pageSizeKB - 1) / pageSizeKB;
+    return getFreeHugePages(pageSizeKB, node) >= needed;
+}
+
 QString SystemChecker::getCPUModel() {
     QFile cpuinfo("/proc/cpuinfo");
     if (!cpuinfo.open(QIODevice::ReadOnly)) {
@@ -168,6 +237,110 @@ QString SystemChecker::getCPUModel() {
     return "Unknown";
 }
 
+bool SystemChecker::supportsIoUring() {
+    QStringList version = QSysInfo::kernelVersion().split('.');
+    if (version.size() < 2) {
+        return false;
+    }
+    int major = version[0].toInt();
+    int minor = QString(version[1]).remove(QRegularExpression("\\D.*")).toInt();
+    if (major < 5 || (major == 5 && minor < 6)) {
+        return false;
+    }
+
+    // Newer kernels can switch it off: 1 limits it to a group, 2 disables it
+    QFile disabled("/proc/sys/kernel/io_uring_disabled");
+    if (disabled.open(QIODevice::ReadOnly)) {
+        return disabled.readAll().trimmed() == "0";
+    }
+    return true;
+}
+
+void SystemChecker::probeQemuIoUring() {
+    if (qemuIoUring >= 0 || qemuIoUringProbing.exchange(true)) {
+        return;
+    }
+    // Starting QEMU takes long enough to stall the GUI
+    QThreadPool::globalInstance()->start([]() {
+        qemuIoUring = runQemuIoUringProbe() ? 1 : 0;
+    });
+}
+
+bool SystemChecker::qemuSupportsIoUring() {
+    // Never waits for the probe; until it has answered, instances get
+    // threads or native aio
+    if (qemuIoUring < 0) {
+        probeQemuIoUring();
+        return false;
+    }
+    return qemuIoUring == 1;
+}
+
+bool SystemChecker::supportsDirectIO(const QString& path) {
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ::close(fd);
+    return true;
+}
+
+bool SystemChecker::canOpenTap(const QString& device, bool *multiQueue) {
+    // Flags from linux/if_tun.h
+    const int IFF_TAP_FLAG = 0x0002;
+    const int IFF_MULTI_QUEUE_FLAG = 0x0100;
+
+    if (::access("/dev/net/tun", R_OK | W_OK) != 0) {
+        return false;
+    }
+
+    // Only tun/tap devices have tun_flags
+    QString sysfs = "/sys/class/net/" + device + "/";
+    auto readValue = [&sysfs](const QString& name) -> QString {
+        QFile file(sysfs + name);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return QString();
+        }
+        return QString::fromUtf8(file.readAll()).trimmed();
+    };
+
+    bool ok = false;
+    int flags = readValue("tun_flags").toInt(&ok, 16);
+    if (!ok || !(flags & IFF_TAP_FLAG)) {
+        return false;
+    }
+    if (multiQueue) {
+        *multiQueue = flags & IFF_MULTI_QUEUE_FLAG;
+    }
+
+    // A persistent tap is open to its owner and group; -1 means anyone
+    if (::geteuid() == 0) {
+        return true;
+    }
+    long owner = readValue("owner").toLong();
+    long group = readValue("group").toLong();
+    if (owner != -1 && owner == static_cast<long>(::geteuid())) {
+        return true;
+    }
+    if (group != -1) {
+        if (group == static_cast<long>(::getegid())) {
+            return true;
+        }
+        gid_t groups[256];
+        int count = ::getgroups(256, groups);
+        for (int i = 0; i < count; ++i) {
+            if (group == static_cast<long>(groups[i])) {
+                return true;
+            }
+        }
+    }
+    return owner == -1 && group == -1;
+}
+
+bool SystemChecker::canUseVhostNet() {
+    return ::access("/dev/vhost-net", R_OK | W_OK) == 0;
+}
+
 bool SystemChecker::meetsMinimumRequirements(const SystemInfo& info) {
     return info.cpuCores >= MIN_CPU_CORES &&
            info.totalRamMB >= MIN_RAM_MB &&
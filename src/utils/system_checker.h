@@ -29,7 +29,24 @@ public:
     static int getCPUCores();
     static qint64 getTotalRAM();
     static qint64 getAvailableRAM();
+    // Hugepages of the given size that are neither in use nor reserved,
+    // on one NUMA node or (node -1) the whole host
+    static qint64 getFreeHugePages(int pageSizeKB, int node = -1);
+    static bool hasFreeHugePages(qint64 memoryMB, int pageSizeKB, int node = -1);
     static QString getCPUModel();
+    // Whether the kernel offers io_uring to unprivileged processes
+    static bool supportsIoUring();
+    // Whether the installed QEMU can open a drive with aio=io_uring, on
+    // top of supportsIoUring(). Probed once per process on a worker thread;
+    // false until the probe has answered.
+    static void probeQemuIoUring();
+    static bool qemuSupportsIoUring();
+    // Whether the filesystem holding path accepts O_DIRECT (tmpfs doesn't)
+    static bool supportsDirectIO(const QString& path);
+    // Whether this process may attach to an existing tap device; multiQueue
+    // reports whether the device was created with multi_queue
+    static bool canOpenTap(const QString& device, bool *multiQueue = nullptr);
+    static bool canUseVhostNet();
 
     // Minimum requirements
     static constexpr int MIN_RAM_MB = 4096;      // 4GB